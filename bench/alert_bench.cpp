@@ -0,0 +1,109 @@
+/*
+  Check 100k alert rules on 1k symbols (40 price above, 40 price below, 10 changes and
+  10 volume spikes over 3 windows per symbol) against 10M tickers of a random walk.
+  The price rules alone are compared with evaluating every rule of the symbol on each
+  ticker.
+*/
+#include "alert_engine.h"
+
+#include <chrono>
+#include <cstdio>
+#include <limits>
+#include <random>
+#include <vector>
+
+static const int nb_symbols = 1000;
+static const size_t nb_tickers = 10000000;
+
+int main(int argc, char **argv) {
+  std::minstd_rand random(42);
+  std::uniform_real_distribution<double> uniform(0, 1);
+
+  cryptom::symbol_table& symbols = cryptom::symbol_table::global();
+  std::vector<cryptom::symbol_id> ids;
+  for (int i = 0; i < nb_symbols; i++) {
+    ids.push_back(symbols.intern("SYM" + std::to_string(i) + "BTC"));
+  }
+
+  // Price thresholds within 20% of the starting price of 1.
+  cryptom::alert_engine prices_only, engine;
+  const int windows[] = {60, 300, 3600};
+  for (cryptom::symbol_id id: ids) {
+    for (int i = 0; i < 40; i++) {
+      cryptom::alert_rule above{cryptom::alert_rule::price_above, id, 1 + 0.2 * uniform(random), 0};
+      cryptom::alert_rule below{cryptom::alert_rule::price_below, id, 1 - 0.2 * uniform(random), 0};
+      prices_only.add(above);
+      prices_only.add(below);
+      engine.add(above);
+      engine.add(below);
+    }
+    for (int i = 0; i < 10; i++) {
+      engine.add({i % 2 == 0 ? cryptom::alert_rule::change_above : cryptom::alert_rule::change_below,
+	    id, (i % 2 == 0 ? 1 : -1) * (1 + i * 0.5), windows[i % 3]});
+      engine.add({cryptom::alert_rule::volume_spike, id, 2 + i * 0.5, windows[i % 3]});
+    }
+  }
+  printf("%zu rules on %d symbols\n", engine.size(), nb_symbols);
+
+  // The tickers of each symbol every 2 seconds, as the batch endpoint gives them.
+  std::vector<cryptom::ticker> tickers(nb_tickers);
+  std::vector<double> prices(nb_symbols, 1.0), volumes(nb_symbols, 100000);
+  for (size_t i = 0; i < nb_tickers; i++) {
+    size_t s = i % nb_symbols;
+    prices[s] *= 1 + 0.002 * (uniform(random) - 0.5);
+    volumes[s] += 2 * uniform(random);
+    cryptom::ticker& t = tickers[i];
+    t.symbol = ids[s];
+    t.close = prices[s];
+    t.volume = volumes[s];
+    t.date = 1500000000 + static_cast<int>(2 * (i / nb_symbols));
+  }
+
+  // The loop without any rule.
+  double sum = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (const cryptom::ticker& t: tickers) {
+    sum += t.close;
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("no rule:             %6.1f ns per ticker (%g)\n", seconds / nb_tickers * 1e9, sum);
+
+  std::vector<cryptom::alert_engine::alert> fired;
+  for (cryptom::alert_engine *e: {&prices_only, &engine}) {
+    size_t nb_alerts = 0;
+    start = std::chrono::steady_clock::now();
+    for (const cryptom::ticker& t: tickers) {
+      fired.clear();
+      nb_alerts += e->check(t, fired);
+    }
+    seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("alert_engine, %3zuk:  %6.1f ns per ticker, %zu alerts\n", e->size() / 1000,
+	   seconds / nb_tickers * 1e9, nb_alerts);
+  }
+
+  // Every price rule of the symbol, against the previous price. No alert on the first
+  // ticker, as for the engine.
+  std::vector<std::vector<cryptom::alert_rule>> by_symbol(ids.back() + 1);
+  for (size_t i = 0; i < prices_only.size(); i++) {
+    const cryptom::alert_rule& rule = prices_only.rule(i);
+    by_symbol[rule.symbol].push_back(rule);
+  }
+  std::vector<double> last(ids.back() + 1, std::numeric_limits<double>::quiet_NaN());
+  size_t nb_alerts = 0;
+  start = std::chrono::steady_clock::now();
+  for (const cryptom::ticker& t: tickers) {
+    double previous = last[t.symbol];
+    for (const cryptom::alert_rule& rule: by_symbol[t.symbol]) {
+      if (rule.type == cryptom::alert_rule::price_above ?
+	  previous < rule.threshold && t.close >= rule.threshold :
+	  previous > rule.threshold && t.close <= rule.threshold) {
+	++nb_alerts;
+      }
+    }
+    last[t.symbol] = t.close;
+  }
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("every rule,   %3zuk:  %6.1f ns per ticker, %zu alerts\n", prices_only.size() / 1000,
+	 seconds / nb_tickers * 1e9, nb_alerts);
+  return 0;
+}
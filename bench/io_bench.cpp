@@ -0,0 +1,154 @@
+/*
+  Poll the mock exchange (tools/mock_exchange) with the scheduled clients of an
+  io_engine for a while, and measure the IO path: requests per second, latency from
+  the read of the response to the pop of its tickers, and CPU time per ticker.
+
+    io_bench [-u url] [-e binance|kucoin] [-c clients] [-i interval_ms] [-d seconds]
+             [-m markets] [-a ca.pem]
+
+  Each client polls one market, COIN<i>BTC (COIN<i>-BTC on kucoin). With -m, the
+  clients poll the endpoint of all the markets instead and keep the first m of them.
+  The rate limits of the exchange are lifted for the mock.
+*/
+#include "io_engine.h"
+#include "json_arena.h"
+
+#include <sys/resource.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static double cpu_seconds() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+int main(int argc, char **argv) {
+  // By default the endpoint of the exchange on the mock, over http.
+  std::string url;
+  std::string exchange = "binance";
+  int nb_clients = 10;
+  int interval_ms = 10;
+  int seconds = 10;
+  int markets = 0;
+  const char *ca_file = nullptr;
+
+  int c;
+  while ((c = getopt(argc, argv, "u:e:c:i:d:m:a:")) != -1) {
+    switch (c) {
+    case 'u':
+      url = optarg;
+      break;
+    case 'e':
+      exchange = optarg;
+      break;
+    case 'c':
+      nb_clients = atoi(optarg);
+      break;
+    case 'i':
+      interval_ms = std::max(1, atoi(optarg));
+      break;
+    case 'd':
+      seconds = atoi(optarg);
+      break;
+    case 'm':
+      markets = atoi(optarg);
+      break;
+    case 'a':
+      ca_file = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-u url] [-e binance|kucoin] [-c clients] [-i interval_ms] [-d seconds]"
+	      " [-m markets] [-a ca.pem]\n", argv[0]);
+      return 1;
+    }
+  }
+  if (url.empty()) {
+    url = std::string("http://localhost:8080") + (exchange == "kucoin" ? "/v1/open/tick" : "/api/v1/ticker/24hr");
+  }
+
+  cryptom::tls_context tls(ca_file);
+  cryptom::ticker_channel queue(1, 4096);
+  cryptom::io_engine engine(1, &tls, cryptom::dns_options(), &queue);
+
+  evhttp_uri *uri = evhttp_uri_parse(url.c_str());
+  if (uri == NULL || evhttp_uri_get_host(uri) == NULL) {
+    fprintf(stderr, "Invalid url %s\n", url.c_str());
+    return 1;
+  }
+  engine.set_rate_limit(evhttp_uri_get_host(uri), cryptom::rate_limit{INT_MAX, std::chrono::seconds(1), 1, 1,
+								       nullptr, nullptr});
+  evhttp_uri_free(uri);
+
+  cryptom::symbol_table& symbols = cryptom::symbol_table::global();
+  const char *separator = exchange == "kucoin" ? "-" : "";
+  for (int i = 0; i < nb_clients; i++) {
+    cryptom::client_spec spec;
+    spec.exchange = exchange;
+    spec.duration = timeval{interval_ms / 1000, (interval_ms % 1000) * 1000};
+    if (markets > 0) {
+      spec.url = url;
+      for (int m = 0; m < markets; m++) {
+	std::string symbol = "COIN" + std::to_string(m) + separator + "BTC";
+	spec.symbols[symbol] = symbols.intern(symbol);
+      }
+    } else {
+      std::string symbol = "COIN" + std::to_string(i) + separator + "BTC";
+      spec.url = url + "?symbol=" + symbol;
+      spec.symbols[symbol] = symbols.intern(symbol);
+    }
+    engine.add_client(std::move(spec));
+  }
+
+  std::vector<int64_t> latencies;
+  latencies.reserve(1 << 20);
+
+  double cpu_start = cpu_seconds();
+  auto start = std::chrono::steady_clock::now();
+  auto end = start + std::chrono::seconds(seconds);
+  engine.start();
+
+  cryptom::ticker t;
+  while (std::chrono::steady_clock::now() < end) {
+    if (queue.pop(t, std::chrono::milliseconds(100))) {
+      latencies.push_back(cryptom::receive_time() - t.received);
+    }
+  }
+
+  engine.stop();
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  double cpu = cpu_seconds() - cpu_start;
+
+  cryptom::request_scheduler::stats stats = engine.scheduler_stats();
+  cryptom::connection_pool::stats pool = engine.pool_stats();
+  printf("%s, %d clients every %dms, %.1fs\n", url.c_str(), nb_clients, interval_ms, elapsed);
+  printf("requests: %lu (%.0f/s), %lu skipped while in flight, %lu handshakes\n",
+	 stats.requests, stats.requests / elapsed, stats.skipped, pool.handshakes);
+  printf("tls: %lu full handshakes, %lu resumed\n",
+	 tls.get_stats().full_handshakes.load(), tls.get_stats().resumed_handshakes.load());
+  if (latencies.empty()) {
+    printf("no ticker received\n");
+    return 1;
+  }
+
+  size_t n = latencies.size();
+  std::sort(latencies.begin(), latencies.end());
+  printf("tickers:  %zu (%.0f/s)\n", n, n / elapsed);
+  printf("latency read -> pop: p50 %.1f us, p99 %.1f us, max %.1f us\n",
+	 latencies[n / 2] / 1e3, latencies[n * 99 / 100] / 1e3, latencies[n - 1] / 1e3);
+  printf("cpu: %.2fs, %.2f us per ticker, %.2f us per request\n",
+	 cpu, cpu / n * 1e6, stats.requests > 0 ? cpu / stats.requests * 1e6 : 0.0);
+  for (const auto& entry: cryptom::json_arena::usage_by_label()) {
+    printf("json %s: %lu parses, %lu pullups\n", entry.first.c_str(), entry.second.parses,
+	   entry.second.pullups);
+  }
+  return 0;
+}
@@ -0,0 +1,64 @@
+/*
+  Cost of recording a sample in a latency_histogram, alone and with the read of the
+  clock which goes with it on the hot path, and of one scrape of the metrics.
+*/
+#include "metrics.h"
+#include "ticker.h"
+
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <string>
+#include <vector>
+
+static const size_t nb_samples = 50000000;
+
+int main(int argc, char **argv) {
+  // Durations from 100ns to 10ms, spread over the buckets.
+  std::minstd_rand random(42);
+  std::lognormal_distribution<double> duration(10, 2);
+  std::vector<int64_t> values(1 << 16);
+  for (int64_t& value: values) {
+    value = static_cast<int64_t>(duration(random));
+  }
+
+  cryptom::metrics_registry& registry = cryptom::metrics_registry::global();
+  cryptom::stage_histograms *metrics = registry.add_writer("bench");
+
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < nb_samples; i++) {
+    metrics->record(cryptom::stage::json_parse, values[i & (values.size() - 1)]);
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("record:               %5.1f ns per sample\n", seconds / nb_samples * 1e9);
+
+  start = std::chrono::steady_clock::now();
+  int64_t last = cryptom::receive_time();
+  for (size_t i = 0; i < nb_samples; i++) {
+    int64_t now = cryptom::receive_time();
+    metrics->record(cryptom::stage::conversion, now - last);
+    last = now;
+  }
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("receive_time + record: %5.1f ns per sample\n", seconds / nb_samples * 1e9);
+
+  // A process with 16 loops polling 2 exchanges.
+  for (int i = 0; i < 32; i++) {
+    cryptom::stage_histograms *writer = registry.add_writer(i % 2 == 0 ? "binance" : "kucoin");
+    for (size_t s = 0; s < cryptom::nb_stages; s++) {
+      for (int64_t value: values) {
+	writer->record(static_cast<cryptom::stage>(s), value);
+      }
+    }
+  }
+  std::string text;
+  const int scrapes = 20;
+  start = std::chrono::steady_clock::now();
+  for (int i = 0; i < scrapes; i++) {
+    text.clear();
+    registry.write_prometheus(text);
+  }
+  seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("scrape of 33 writers: %5.2f ms, %zu bytes\n", seconds / scrapes * 1e3, text.size());
+  return 0;
+}
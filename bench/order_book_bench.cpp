@@ -0,0 +1,178 @@
+/*
+  Replay a stream of depth diffs of binance into an order_book, and into a book of
+  std::map for comparison: once already parsed, then from the JSON messages.
+
+    order_book_bench [diffs.jsonl]
+
+  The file holds one depthUpdate event per line, as recorded from <symbol>@depth. By
+  default a stream of 200k diffs of 10 levels is generated around a random walk of the
+  price, mostly near the top of the book like the real ones.
+*/
+#include "depth_feed.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+static const size_t nb_diffs = 200000;
+static const int levels_per_diff = 10;
+static const int depth = 1000;
+
+// What the order_book replaces.
+struct map_book {
+  std::map<double, double, std::greater<double>> bids;
+  std::map<double, double> asks;
+
+  void apply(const cryptom::depth_update& update) {
+    for (const cryptom::price_level& l: update.bids) {
+      if (l.quantity == 0) {
+	bids.erase(l.price);
+      } else {
+	bids[l.price] = l.quantity;
+      }
+    }
+    for (const cryptom::price_level& l: update.asks) {
+      if (l.quantity == 0) {
+	asks.erase(l.price);
+      } else {
+	asks[l.price] = l.quantity;
+      }
+    }
+  }
+};
+
+static std::vector<std::string> generate() {
+  std::minstd_rand random(42);
+  std::uniform_real_distribution<double> uniform(0, 1);
+  std::geometric_distribution<int> distance(0.15);
+
+  const double tick = 0.00001;
+  long mid = 100000;
+  std::vector<std::string> messages;
+  messages.reserve(nb_diffs);
+  char level[64];
+  for (size_t i = 0; i < nb_diffs; i++) {
+    if (uniform(random) < 0.05) {
+      mid += uniform(random) < 0.5 ? -1 : 1;
+    }
+    std::string message = "{\"e\":\"depthUpdate\",\"E\":1525000000000,\"s\":\"ETHBTC\",\"U\":" +
+      std::to_string(i + 1) + ",\"u\":" + std::to_string(i + 1);
+    for (int side = 0; side < 2; side++) {
+      message += side == 0 ? ",\"b\":[" : "],\"a\":[";
+      for (int n = 0; n < levels_per_diff / 2; n++) {
+	long ticks = 1 + std::min(distance(random), depth - 1);
+	double price = (side == 0 ? mid - ticks : mid + ticks) * tick;
+	double quantity = uniform(random) < 0.3 ? 0 : 0.001 * static_cast<int>(uniform(random) * 100000);
+	snprintf(level, sizeof(level), "%s[\"%.8f\",\"%.8f\"]", n > 0 ? "," : "", price, quantity);
+	message += level;
+      }
+    }
+    messages.push_back(message + "]}");
+  }
+  return messages;
+}
+
+static void report(const char *what, size_t nb_updates, size_t nb_levels,
+		   std::chrono::steady_clock::time_point start) {
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%-20s %6.2f M diffs/s, %6.2f M level updates/s\n", what,
+	 nb_updates / seconds / 1e6, nb_levels / seconds / 1e6);
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> messages;
+  if (argc > 1) {
+    std::ifstream file(argv[1]);
+    std::string line;
+    while (std::getline(file, line)) {
+      if (!line.empty()) {
+	messages.push_back(line);
+      }
+    }
+  } else {
+    messages = generate();
+  }
+
+  // Parsed once for the replays without JSON.
+  std::vector<cryptom::depth_update> updates(messages.size());
+  size_t nb_levels = 0;
+  for (size_t i = 0; i < messages.size(); i++) {
+    std::string text = messages[i];
+    rapidjson::Document json;
+    json.ParseInsitu(&text[0]);
+    const char *symbol;
+    if (json.HasParseError() || cryptom::depth_update_from_json(json, updates[i], symbol) != 0) {
+      fprintf(stderr, "Invalid diff on line %zu\n", i + 1);
+      return 1;
+    }
+    nb_levels += updates[i].bids.size() + updates[i].asks.size();
+  }
+  if (updates.empty()) {
+    fprintf(stderr, "No diff\n");
+    return 1;
+  }
+  printf("%zu diffs, %zu level updates\n", updates.size(), nb_levels);
+
+  // Replay the stream a few times, the book starts empty.
+  const int rounds = 5;
+  uint64_t first = updates.front().first_id - 1;
+
+  double checksum = 0;
+  {
+    cryptom::order_book book(depth);
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+      book.load_snapshot(first, {}, {});
+      for (const cryptom::depth_update& update: updates) {
+	book.apply(update);
+      }
+      checksum += book.best(cryptom::order_book::bid)->price;
+    }
+    report("order_book", rounds * updates.size(), rounds * nb_levels, start);
+  }
+
+  {
+    map_book book;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; r++) {
+      book.bids.clear();
+      book.asks.clear();
+      for (const cryptom::depth_update& update: updates) {
+	book.apply(update);
+      }
+      checksum += book.bids.begin()->first;
+    }
+    report("std::map", rounds * updates.size(), rounds * nb_levels, start);
+  }
+
+  {
+    // What the stream does for each message: parse in situ and apply.
+    std::vector<std::vector<char>> texts;
+    for (const std::string& message: messages) {
+      texts.emplace_back(message.begin(), message.end());
+      texts.back().push_back('\0');
+    }
+    cryptom::order_book book(depth);
+    book.load_snapshot(first, {}, {});
+    cryptom::json_arena arena("order_book_bench", 64 * 1024);
+    cryptom::depth_update update;
+    const char *symbol;
+    auto start = std::chrono::steady_clock::now();
+    for (std::vector<char>& text: texts) {
+      cryptom::json_arena::document_type& json = arena.parse_insitu(text.data());
+      if (!json.HasParseError() && cryptom::depth_update_from_json(json, update, symbol) == 0) {
+	book.apply(update);
+      }
+    }
+    report("order_book + JSON", updates.size(), nb_levels, start);
+    checksum += book.best(cryptom::order_book::ask)->price;
+  }
+
+  printf("(%g)\n", checksum);
+  return 0;
+}
@@ -0,0 +1,67 @@
+/*
+  Append 10M tickers of 500 symbols to a tick log in a temporary directory, then read
+  them back, the second time from the page cache.
+*/
+#include "tick_log.h"
+
+#include <stdlib.h>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+static const size_t nb_tickers = 10000000;
+static const int nb_symbols = 500;
+
+int main(int argc, char **argv) {
+  char directory[] = "/tmp/tick_log_bench.XXXXXX";
+  if (mkdtemp(directory) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  cryptom::symbol_table& symbols = cryptom::symbol_table::global();
+  std::vector<cryptom::symbol_id> ids;
+  for (int i = 0; i < nb_symbols; i++) {
+    ids.push_back(symbols.intern("SYM" + std::to_string(i) + "BTC"));
+  }
+
+  {
+    cryptom::tick_log log(directory);
+    if (log.open() != 0) {
+      return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < nb_tickers; i++) {
+      cryptom::ticker t{};
+      t.symbol = ids[i % nb_symbols];
+      t.close = 0.01 * i;
+      t.date = 1500000000 + static_cast<int>(i / 1000);
+      log.append(t);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("append %zu tickers: %6.1f M/s\n", nb_tickers, nb_tickers / seconds / 1e6);
+  }
+
+  std::vector<cryptom::ticker> batch(4096);
+  for (int pass = 0; pass < 2; pass++) {
+    cryptom::tick_log_reader reader(directory);
+    if (reader.open() != 0) {
+      return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    size_t total = 0, n;
+    double checksum = 0;
+    while ((n = reader.read(batch.data(), batch.size())) > 0) {
+      total += n;
+      checksum += batch[n - 1].close;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("read   %zu tickers: %6.1f M/s (%g)\n", total, total / seconds / 1e6, checksum);
+  }
+
+  std::string command = std::string("rm -rf ") + directory;
+  return system(command.c_str());
+}
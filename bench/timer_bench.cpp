@@ -0,0 +1,180 @@
+/*
+  Compare the timers of 10k polling schedules:
+  - one libevent timer per schedule, added again after each expiration, which is what
+    the scheduled clients did before the request schedulers,
+  - cryptom::timer_wheel, ticked by a single libevent timer.
+
+  Each schedule fires every 50 to 500ms for a few seconds. We measure the CPU time of
+  the loop per expiration and how late the timers fire, then the cost of scheduling and
+  cancelling all the timers at once.
+*/
+#include "timer_wheel.h"
+#include <event2/event.h>
+
+#include <sys/resource.h>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <vector>
+
+typedef std::chrono::steady_clock bench_clock;
+
+static const size_t schedules = 10000;
+static const int run_seconds = 3;
+
+static double cpu_seconds() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+    (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static timeval to_timeval(bench_clock::duration d) {
+  long us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+  return timeval{us / 1000000, us % 1000000};
+}
+
+struct result {
+  unsigned long fired = 0;
+  double late_us = 0;
+};
+
+struct evtimer_schedule {
+  event *timer;
+  bench_clock::duration period;
+  bench_clock::time_point due;
+  result *out;
+
+  static void fire(evutil_socket_t fd, short what, void *arg) {
+    evtimer_schedule *s = static_cast<evtimer_schedule*>(arg);
+    bench_clock::time_point now = bench_clock::now();
+    s->out->late_us += std::chrono::duration<double, std::micro>(now - s->due).count();
+    ++s->out->fired;
+
+    s->due = now + s->period;
+    timeval tv = to_timeval(s->period);
+    evtimer_add(s->timer, &tv);
+  }
+};
+
+struct wheel_schedule: cryptom::timer_wheel::timer {
+  cryptom::timer_wheel *wheel;
+  bench_clock::duration period;
+  bench_clock::time_point due;
+  result *out;
+
+  void expire() {
+    bench_clock::time_point now = bench_clock::now();
+    out->late_us += std::chrono::duration<double, std::micro>(now - due).count();
+    ++out->fired;
+
+    due = now + period;
+    wheel->schedule(this, due);
+  }
+};
+
+static void stop(evutil_socket_t fd, short what, void *arg) {
+  event_base_loopbreak(static_cast<event_base*>(arg));
+}
+
+static void run_loop(event_base *base) {
+  timeval duration{run_seconds, 0};
+  event *stopper = evtimer_new(base, &stop, base);
+  evtimer_add(stopper, &duration);
+  event_base_dispatch(base);
+  event_free(stopper);
+}
+
+static void report(const char *name, const result& r, double cpu) {
+  printf("%-10s %9lu expirations %8.1f ms CPU %7.0f ns/expiration, %7.0f us late on average\n",
+	 name, r.fired, cpu * 1e3, cpu * 1e9 / r.fired, r.late_us / r.fired);
+}
+
+int main() {
+  std::minstd_rand random(42);
+  std::uniform_int_distribution<int> period_ms(50, 500);
+  std::vector<bench_clock::duration> periods;
+  for (size_t i = 0; i < schedules; i++) {
+    periods.push_back(std::chrono::milliseconds(period_ms(random)));
+  }
+
+  printf("%zu schedules, %ds\n", schedules, run_seconds);
+
+  {
+    event_base *base = event_base_new();
+    result r;
+    std::vector<evtimer_schedule> all(schedules);
+    bench_clock::time_point now = bench_clock::now();
+    for (size_t i = 0; i < schedules; i++) {
+      evtimer_schedule& s = all[i];
+      s.timer = evtimer_new(base, &evtimer_schedule::fire, &s);
+      s.period = periods[i];
+      s.due = now + s.period;
+      s.out = &r;
+      timeval tv = to_timeval(s.period);
+      evtimer_add(s.timer, &tv);
+    }
+
+    double cpu = cpu_seconds();
+    run_loop(base);
+    report("evtimer", r, cpu_seconds() - cpu);
+
+    // Churn: cancel and schedule again all the timers.
+    bench_clock::time_point start = bench_clock::now();
+    for (int round = 0; round < 100; round++) {
+      for (evtimer_schedule& s: all) {
+	evtimer_del(s.timer);
+      }
+      for (evtimer_schedule& s: all) {
+	timeval tv = to_timeval(s.period);
+	evtimer_add(s.timer, &tv);
+      }
+    }
+    double ns = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+    printf("%-10s cancel + schedule %7.1f ns per timer\n", "evtimer", ns / (100 * schedules));
+
+    for (evtimer_schedule& s: all) {
+      event_free(s.timer);
+    }
+    event_base_free(base);
+  }
+
+  {
+    event_base *base = event_base_new();
+    std::unique_ptr<cryptom::timer_wheel> wheel(new cryptom::timer_wheel(base, std::chrono::milliseconds(1)));
+    result r;
+    std::vector<wheel_schedule> all(schedules);
+    bench_clock::time_point now = bench_clock::now();
+    for (size_t i = 0; i < schedules; i++) {
+      wheel_schedule& s = all[i];
+      s.wheel = wheel.get();
+      s.period = periods[i];
+      s.due = now + s.period;
+      s.out = &r;
+      wheel->schedule(&s, s.due);
+    }
+
+    double cpu = cpu_seconds();
+    run_loop(base);
+    report("wheel", r, cpu_seconds() - cpu);
+
+    bench_clock::time_point start = bench_clock::now();
+    for (int round = 0; round < 100; round++) {
+      for (wheel_schedule& s: all) {
+	wheel->cancel(&s);
+      }
+      for (wheel_schedule& s: all) {
+	wheel->schedule(&s, s.period);
+      }
+    }
+    double ns = std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+    printf("%-10s cancel + schedule %7.1f ns per timer\n", "wheel", ns / (100 * schedules));
+
+    all.clear();
+    wheel.reset();
+    event_base_free(base);
+  }
+
+  return 0;
+}
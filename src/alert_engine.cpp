@@ -0,0 +1,138 @@
+#include "alert_engine.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace cryptom {
+
+  alert_engine::crossing::crossing():
+    last(std::numeric_limits<double>::quiet_NaN()) {
+  }
+
+  alert_engine::alert_engine() {
+  }
+
+  void alert_engine::insert(std::vector<threshold>& thresholds, double value, size_t rule) {
+    threshold t{value, rule};
+    thresholds.insert(std::upper_bound(thresholds.begin(), thresholds.end(), t), t);
+  }
+
+  alert_engine::window_series& alert_engine::series_of(symbol_rules& rules, int window) {
+    for (window_series& series: rules.windows) {
+      if (series.window == window) {
+	return series;
+      }
+    }
+    rules.windows.emplace_back(window);
+    return rules.windows.back();
+  }
+
+  size_t alert_engine::add(const alert_rule& rule) {
+    size_t index = rules_.size();
+    rules_.push_back(rule);
+
+    if (rule.symbol >= symbols_.size()) {
+      symbols_.resize(rule.symbol + 1);
+    }
+    symbol_rules& rules = symbols_[rule.symbol];
+
+    switch (rule.type) {
+    case alert_rule::price_above:
+      insert(rules.price.up, rule.threshold, index);
+      break;
+    case alert_rule::price_below:
+      insert(rules.price.down, rule.threshold, index);
+      break;
+    case alert_rule::change_above:
+      insert(series_of(rules, std::max(rule.window, 1)).change.up, rule.threshold, index);
+      break;
+    case alert_rule::change_below:
+      insert(series_of(rules, std::max(rule.window, 1)).change.down, rule.threshold, index);
+      break;
+    case alert_rule::volume_spike:
+      insert(series_of(rules, std::max(rule.window, 1)).volume.up, rule.threshold, index);
+      break;
+    }
+    return index;
+  }
+
+  void alert_engine::cross(crossing& c, double value, int date, std::vector<alert>& out) {
+    double last = c.last;
+    c.last = value;
+    if (std::isnan(last) || std::isnan(value)) {
+      return;
+    }
+
+    // Going up: the thresholds in (last, value]. Going down: in [value, last).
+    if (value > last && !c.up.empty()) {
+      auto from = std::upper_bound(c.up.begin(), c.up.end(), threshold{last, 0});
+      auto to = std::upper_bound(from, c.up.end(), threshold{value, 0});
+      for (auto it = from; it != to; ++it) {
+	out.push_back(alert{it->rule, value, date});
+      }
+    } else if (value < last && !c.down.empty()) {
+      auto from = std::lower_bound(c.down.begin(), c.down.end(), threshold{value, 0});
+      auto to = std::lower_bound(from, c.down.end(), threshold{last, 0});
+      for (auto it = from; it != to; ++it) {
+	out.push_back(alert{it->rule, value, date});
+      }
+    }
+  }
+
+  size_t alert_engine::check(const ticker& t, std::vector<alert>& out) {
+    if (t.symbol >= symbols_.size()) {
+      return 0;
+    }
+    symbol_rules& rules = symbols_[t.symbol];
+    size_t before = out.size();
+
+    if (!rules.price.empty()) {
+      cross(rules.price, t.close, t.date, out);
+    }
+
+    for (window_series& series: rules.windows) {
+      typedef window_series::sample sample;
+      const size_t n = window_series::nb_samples;
+      // Rounded up, so that the window fits in the ring.
+      int spacing = (series.window + window_series::resolution - 1) / window_series::resolution;
+
+      // Sample the ticker, dropping the oldest sample when full.
+      if (series.count == 0 || t.date - series.samples[(series.first + series.count - 1) % n].date >= spacing) {
+	if (series.count == n) {
+	  series.first = (series.first + 1) % n;
+	  --series.count;
+	}
+	series.samples[(series.first + series.count) % n] = sample{t.date, t.close, t.volume};
+	++series.count;
+      }
+
+      // The reference is the last sample at the start of the window or before.
+      int start = t.date - series.window;
+      while (series.count > 1 && series.samples[(series.first + 1) % n].date <= start) {
+	series.first = (series.first + 1) % n;
+	--series.count;
+      }
+      const sample& reference = series.samples[series.first];
+
+      // Not enough history yet.
+      double change = std::numeric_limits<double>::quiet_NaN();
+      double volume = std::numeric_limits<double>::quiet_NaN();
+      if (reference.date <= start + spacing && reference.close > 0) {
+	change = 100.0 * (t.close / reference.close - 1);
+	// The volume of the tickers is over the last 24 hours: its growth is the volume
+	// of the window less the one of the same window a day before, see volume_spike.
+	if (t.volume > 0) {
+	  double traded = std::max(0.0, t.volume - reference.volume);
+	  volume = traded / (t.volume * series.window / 86400.0);
+	}
+      }
+
+      cross(series.change, change, t.date, out);
+      cross(series.volume, volume, t.date, out);
+    }
+
+    return out.size() - before;
+  }
+
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "symbol_table.h"
+#include "ticker.h"
+#include <cstddef>
+#include <vector>
+
+namespace cryptom {
+
+  /*
+    Alert on the tickers of a market. The rules fire when the value they watch crosses
+    their threshold, not as long as it is beyond.
+  */
+  struct alert_rule {
+    enum kind {
+      // The last price goes above / below the threshold.
+      price_above,
+      price_below,
+      // The price changes by more than threshold percent (negative for a drop) over the
+      // window.
+      change_above,
+      change_below,
+      // The volume traded over the window is more than threshold times the average of
+      // the last 24 hours over the same duration. Approximate: the tickers only give the
+      // rolling volume of the last 24 hours, so the volume of the window is taken as the
+      // growth of that volume over the window. This is the volume traded in the window
+      // minus the volume of the same window a day before, which left the 24 hours
+      // meanwhile. A spike shows up fully only if that day-old window was quiet, and it
+      // is underestimated by the day-old volume otherwise.
+      volume_spike
+    };
+
+    kind type;
+    symbol_id symbol;
+    double threshold;
+    // Seconds, for the changes and the volume spikes.
+    int window;
+  };
+
+  /*
+    Rule engine of the alerts, evaluated on each ticker. The rules are compiled by
+    symbol and by watched value (the price, the change and the volume ratio of each
+    window) into arrays of thresholds sorted by value, one for the rules firing when the
+    value goes up, one for when it goes down. A ticker then finds the rules crossed
+    between the previous value and the new one with a binary search, in O(log k) for k
+    rules, instead of evaluating every rule of the symbol.
+
+    The changes over a window are measured against samples of the tickers kept every
+    1/32 of the window, so the window is approximate by that much.
+  */
+  class alert_engine {
+
+  public:
+    struct alert {
+      // Index of the rule, as returned by add.
+      size_t rule;
+      // The watched value which crossed the threshold: price, percent change or volume
+      // ratio.
+      double value;
+      int date;
+    };
+
+    alert_engine();
+
+    // no copy or assignement
+    alert_engine(const alert_engine&) = delete;
+    alert_engine& operator=(const alert_engine&) = delete;
+
+    /**
+       Add a rule, used from the next ticker of its symbol. Return its index.
+     */
+    size_t add(const alert_rule& rule);
+
+    const alert_rule& rule(size_t index) const { return rules_[index]; }
+    size_t size() const { return rules_.size(); }
+
+    /**
+       Check the rules of the symbol of the ticker and append the ones which fire to
+       out. Return the number of alerts.
+     */
+    size_t check(const ticker& t, std::vector<alert>& out);
+
+  private:
+    struct threshold {
+      double value;
+      size_t rule;
+
+      bool operator<(const threshold& other) const { return value < other.value; }
+    };
+
+    // A watched value and the thresholds of its rules.
+    struct crossing {
+      std::vector<threshold> up;
+      std::vector<threshold> down;
+      // NaN until the first ticker.
+      double last;
+
+      crossing();
+      bool empty() const { return up.empty() && down.empty(); }
+    };
+
+    // Samples of the last window of a symbol, to compute the change and the volume ratio.
+    struct window_series {
+      int window;
+      crossing change;
+      crossing volume;
+
+      // Ring of the samples, one every window / 32 seconds (rounded up), with room for
+      // the newest sample and the one at the start of the window.
+      static const int resolution = 32;
+      static const size_t nb_samples = resolution + 4;
+      struct sample {
+	int date;
+	double close;
+	double volume;
+      };
+      sample samples[nb_samples];
+      size_t first = 0;
+      size_t count = 0;
+
+      explicit window_series(int window): window(window) {}
+    };
+
+    struct symbol_rules {
+      crossing price;
+      std::vector<window_series> windows;
+    };
+
+    std::vector<alert_rule> rules_;
+
+    // Indexed by symbol_id.
+    std::vector<symbol_rules> symbols_;
+
+    static void insert(std::vector<threshold>& thresholds, double value, size_t rule);
+    static window_series& series_of(symbol_rules& rules, int window);
+
+    // Add the rules crossed from the last value to value.
+    static void cross(crossing& c, double value, int date, std::vector<alert>& out);
+  };
+
+}
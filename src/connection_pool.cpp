@@ -0,0 +1,232 @@
+#include "connection_pool.h"
+#include "ticker.h"
+#include <event2/bufferevent_ssl.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <openssl/err.h>
+
+namespace cryptom {
+
+  connection_pool::connection_pool(event_base *base, tls_context *tls, dns_cache *dns,
+				   const request_timeouts& timeouts):
+    base_(base),
+    tls_(tls),
+    dns_(dns),
+    timeouts_(timeouts) {
+  }
+
+  connection_pool::~connection_pool() {
+  }
+
+  connection_pool::host_entry::~host_entry() {
+    // Also free the bufferevent, which frees the SSL object (BEV_OPT_CLOSE_ON_FREE).
+    if (evcon != nullptr)
+      evhttp_connection_free(evcon);
+  }
+
+  evhttp_connection* connection_pool::acquire(const evhttp_uri *uri, stage_histograms *metrics,
+					      bool spare) {
+
+    const char *scheme = evhttp_uri_get_scheme(uri);
+    if (scheme == NULL || (strcasecmp(scheme, "https") != 0 &&
+			   strcasecmp(scheme, "http") != 0)) {
+      fputs("url must be http or https", stderr);
+      return nullptr;
+    }
+
+    const char *host = evhttp_uri_get_host(uri);
+    if (host == NULL) {
+      fputs("url must have a host", stderr);
+      return nullptr;
+    }
+
+    int port = evhttp_uri_get_port(uri);
+    if (port == -1) {
+      port = (strcasecmp(scheme, "http") == 0) ? 80 : 443;
+    }
+
+    // Never blocks. When the cache has no address yet, libevent resolves the host
+    // asynchronously for this connection while the cache gets it for the next ones.
+    const char *address = dns_ != nullptr ? dns_->lookup(host, metrics) : nullptr;
+
+    std::string key = std::string(scheme) + "://" + host + ":" + std::to_string(port);
+    if (spare) {
+      key += " spare";
+    }
+    auto it = entries_.find(key);
+
+    // libevent does not call the close callback of a connection which failed before
+    // being established, its socket is gone though.
+    if (it != entries_.end() && it->second->connected &&
+	bufferevent_getfd(evhttp_connection_get_bufferevent(it->second->evcon)) < 0) {
+      it->second->connected = false;
+    }
+
+    // A closed and unused connection is replaced when the host moved (or when it was
+    // created before the host was resolved), and always on https: libevent would
+    // reconnect with the SSL object of the closed connection, which cannot do another
+    // handshake. The new SSL object resumes the session of the host.
+    if (it != entries_.end() && !it->second->connected && it->second->in_flight == 0 &&
+	(it->second->ssl != nullptr || (address != nullptr && it->second->address != address))) {
+      entries_.erase(it);
+      it = entries_.end();
+    }
+
+    host_entry *entry;
+    if (it == entries_.end()) {
+      entry = create_entry(scheme, host, port, address);
+      if (entry == nullptr) {
+	return nullptr;
+      }
+      entries_[key] = std::unique_ptr<host_entry>(entry);
+    } else {
+      entry = it->second.get();
+    }
+
+    ++entry->in_flight;
+    if (metrics != nullptr) {
+      entry->metrics = metrics;
+    }
+
+    ++stats_.requests;
+    if (entry->connected) {
+      ++stats_.reused;
+    } else {
+      ++stats_.handshakes;
+      entry->connected = true;
+      entry->connecting = receive_time();
+      entry->handshaking = 0;
+      // Used by libevent for the connection, and for the handshake until it starts.
+      evhttp_connection_set_timeout_tv(entry->evcon, &entry->timeouts->connect);
+    }
+
+    return entry->evcon;
+  }
+
+  void connection_pool::release(evhttp_connection *evcon, evhttp_request *req) {
+    for (auto& entry: entries_) {
+      if (entry.second->evcon == evcon) {
+	if (req != nullptr && closes_connection(req)) {
+	  entry.second->connected = false;
+	}
+	// Back to the timeouts of libevent for the idle connection, which only tell
+	// when to close it.
+	if (--entry.second->in_flight == 0) {
+	  evhttp_connection_set_timeout_tv(evcon, NULL);
+	}
+	return;
+      }
+    }
+  }
+
+  bool connection_pool::closes_connection(evhttp_request *req) {
+    // A body without length nor chunks is read up to the end of the connection
+    // (HTTP/1.0 servers). libevent keeps such a connection as if it were idle.
+    const evkeyvalq *headers = evhttp_request_get_input_headers(req);
+    const char *connection = evhttp_find_header(headers, "Connection");
+    const char *encoding = evhttp_find_header(headers, "Transfer-Encoding");
+    return (connection != NULL && strcasecmp(connection, "close") == 0) ||
+      (evhttp_find_header(headers, "Content-Length") == NULL &&
+       (encoding == NULL || strcasecmp(encoding, "chunked") != 0));
+  }
+
+  int64_t connection_pool::last_write(evhttp_connection *evcon) const {
+    for (const auto& entry: entries_) {
+      if (entry.second->evcon == evcon) {
+	return entry.second->written;
+      }
+    }
+    return 0;
+  }
+
+  void connection_pool::libevent_output(evbuffer *buffer, const evbuffer_cb_info *info, void *ctx) {
+    if (info->n_deleted == 0) {
+      return;
+    }
+
+    host_entry *entry = static_cast<host_entry*>(ctx);
+    entry->written = receive_time();
+    evhttp_connection_set_timeout_tv(entry->evcon, &entry->timeouts->response);
+
+    // On https the handshake tells when the connection is established.
+    if (entry->connecting != 0 && entry->ssl == nullptr) {
+      if (entry->metrics != nullptr)
+	entry->metrics->record(stage::connect, entry->written - entry->connecting);
+      entry->connecting = 0;
+    }
+  }
+
+  void connection_pool::host_entry::handshake_started() {
+    // Also called for the messages after the handshake (TLS 1.3 session tickets).
+    if (connecting == 0) {
+      return;
+    }
+    handshaking = receive_time();
+    evhttp_connection_set_timeout_tv(evcon, &timeouts->tls_handshake);
+    if (metrics != nullptr)
+      metrics->record(stage::connect, handshaking - connecting);
+    connecting = 0;
+  }
+
+  void connection_pool::host_entry::handshake_done() {
+    if (handshaking == 0) {
+      return;
+    }
+    if (metrics != nullptr)
+      metrics->record(stage::tls_handshake, receive_time() - handshaking);
+    handshaking = 0;
+  }
+
+  connection_pool::host_entry* connection_pool::create_entry(const char *scheme, const char *host, int port,
+							     const char *address) {
+    std::unique_ptr<host_entry> entry(new host_entry);
+    entry->host = host;
+    entry->timeouts = &timeouts_;
+    entry->address = address != nullptr ? address : host;
+
+    bufferevent *bev;
+    if (strcasecmp(scheme, "http") == 0) {
+      bev = bufferevent_socket_new(base_, -1, BEV_OPT_CLOSE_ON_FREE);
+    } else {
+      SSL *ssl = tls_->new_ssl(host);
+      if (ssl == NULL) {
+	return nullptr;
+      }
+
+      bev = bufferevent_openssl_socket_new(base_, -1, ssl,
+					   BUFFEREVENT_SSL_CONNECTING,
+					   BEV_OPT_CLOSE_ON_FREE|BEV_OPT_DEFER_CALLBACKS);
+      if (bev != NULL) {
+	bufferevent_openssl_set_allow_dirty_shutdown(bev, 1);
+	entry->ssl = ssl;
+	tls_->watch_handshakes(ssl, entry.get());
+      } else {
+	SSL_free(ssl);
+      }
+    }
+
+    if (bev == NULL) {
+      fprintf(stderr, "bufferevent_openssl_socket_new() failed\n");
+      return nullptr;
+    }
+
+    // The SNI and the certificate check use the host name, we only connect to the
+    // address. Without address, libevent resolves the host without blocking.
+    evdns_base *dns_base = address == nullptr && dns_ != nullptr ? dns_->get_dns_base() : NULL;
+    entry->evcon = evhttp_connection_base_bufferevent_new(base_, dns_base, bev,
+							  entry->address.c_str(), port);
+    if (entry->evcon == NULL) {
+      fprintf(stderr, "evhttp_connection_base_bufferevent_new() failed\n");
+      bufferevent_free(bev);
+      return nullptr;
+    }
+
+    evhttp_connection_set_closecb(entry->evcon, &connection_pool::libevent_connection_closed,
+				  (void*) entry.get());
+    evbuffer_add_cb(bufferevent_get_output(bev), &connection_pool::libevent_output, entry.get());
+
+    return entry.release();
+  }
+
+}
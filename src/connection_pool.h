@@ -0,0 +1,157 @@
+#pragma once
+
+#include <openssl/ssl.h>
+#include <event2/event.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/http.h>
+#include "dns_cache.h"
+#include "metrics.h"
+#include "tls_context.h"
+#include <map>
+#include <memory>
+#include <string>
+
+namespace cryptom {
+
+  /*
+    Longest time each phase of a request may take. A request which takes longer fails,
+    and its connection is closed.
+  */
+  struct request_timeouts {
+    timeval connect = {3, 0};
+    timeval tls_handshake = {5, 0};
+    // From the request written to the response. libevent counts the time without any
+    // data, so a response arriving slowly but steadily does not time out.
+    timeval response = {10, 0};
+  };
+
+  /*
+    Keeps one keep-alive evhttp_connection per exchange host. All the clients
+    polling the same host send their requests on the same connection, so the
+    TCP and TLS handshakes are only paid when the server closes the connection.
+  */
+  class connection_pool {
+
+  public:
+
+    struct stats {
+      // Number of requests sent through the pool.
+      unsigned long requests = 0;
+      // Number of requests which had to open a new connection (TCP + TLS handshake).
+      unsigned long handshakes = 0;
+      // Number of requests sent on an already opened connection.
+      unsigned long reused = 0;
+
+      double hit_rate() const {
+	return requests == 0 ? 0.0 : static_cast<double>(reused) / requests;
+      }
+    };
+
+    // dns can be NULL, then libevent resolves the hosts itself at each connection.
+    connection_pool(event_base *base, tls_context *tls, dns_cache *dns,
+		    const request_timeouts& timeouts = request_timeouts());
+    ~connection_pool();
+
+    // no copy or assignement. The connections keep a pointer to their pool entry.
+    connection_pool(const connection_pool&) = delete;
+    connection_pool& operator=(const connection_pool&) = delete;
+
+    /*
+      Return the connection to use for the given uri. It is created on first use.
+      Return NULL on error. The connection is owned by the pool. Call release once the
+      request made on the connection is done.
+      The resolution of the host, the connection and the TLS handshake are timed in
+      metrics if given.
+      The spare connection of the host is a second one, for the requests which must not
+      wait behind the others (see hedged requests in basic_scheduled_client).
+    */
+    evhttp_connection* acquire(const evhttp_uri *uri, stage_histograms *metrics = nullptr,
+			       bool spare = false);
+
+    /*
+      The request on the connection is done. With its response, if any, the pool knows
+      whether the server closed the connection.
+    */
+    void release(evhttp_connection *evcon, evhttp_request *req = nullptr);
+
+    /*
+      When the last request on the connection was written to the socket, see
+      receive_time. 0 if unknown.
+    */
+    int64_t last_write(evhttp_connection *evcon) const;
+
+    // Limits of the phases of the requests from now on.
+    void set_timeouts(const request_timeouts& timeouts) { timeouts_ = timeouts; }
+
+    const stats& get_stats() const { return stats_; }
+
+  private:
+
+    struct host_entry: public tls_context::handshake_listener {
+      ~host_entry();
+
+      void handshake_started();
+      void handshake_done();
+
+      std::string host;
+      // Limits of the phases. Not owned by this object
+      const request_timeouts *timeouts = nullptr;
+      // Owned by the bufferevent of the connection. NULL for plain http.
+      SSL *ssl = nullptr;
+      evhttp_connection *evcon = nullptr;
+      // Address we connect to: the IP from the DNS cache, or the host name when the
+      // cache had none and libevent resolves it.
+      std::string address;
+      // false until the first request, and after each time the server closed the connection.
+      bool connected = false;
+      // Requests sent and not released yet.
+      int in_flight = 0;
+
+      // Where to record the connections, NULL if they are not timed.
+      stage_histograms *metrics = nullptr;
+      // Start of the connection and of the TLS handshake in progress, 0 if none.
+      int64_t connecting = 0;
+      int64_t handshaking = 0;
+      // See last_write.
+      int64_t written = 0;
+    };
+
+    // pointer to the event loop of libevent.
+    event_base *base_;
+
+    // Shared TLS configuration and session cache. Not owned by this object
+    tls_context *tls_;
+
+    // Addresses of the hosts. Not owned by this object, can be NULL.
+    dns_cache *dns_;
+
+    request_timeouts timeouts_;
+
+    // key is scheme://host:port, followed by " spare" for the spare connections.
+    std::map<std::string, std::unique_ptr<host_entry>> entries_;
+
+    stats stats_;
+
+    // The server closes the connection after this response.
+    static bool closes_connection(evhttp_request *req);
+
+    host_entry* create_entry(const char *scheme, const char *host, int port, const char *address);
+
+    /*
+      Callback for when the connection is closed (by the server or after an error).
+      libevent will reconnect automatically on the next request.
+    */
+    static void libevent_connection_closed(evhttp_connection *evcon, void *ctx) {
+      static_cast<host_entry*>(ctx)->connected = false;
+    }
+
+    /*
+      Callback for when the output buffer of a connection is drained: the request is
+      written to the socket (once connected and, on https, after the handshake). From
+      there the response must come within its timeout.
+    */
+    static void libevent_output(evbuffer *buffer, const evbuffer_cb_info *info, void *ctx);
+  };
+
+}
@@ -0,0 +1,172 @@
+#include "currency_graph.h"
+
+#include <deque>
+
+namespace cryptom {
+
+  const size_t currency_graph::none;
+
+  currency_graph::currency_graph(symbol_id target):
+    stale_(false) {
+    target_ = node_for(target);
+  }
+
+  void currency_graph::set_index(std::vector<size_t>& index, symbol_id id, size_t value) {
+    if (id >= index.size()) {
+      index.resize(id + 1, none);
+    }
+    index[id] = value;
+  }
+
+  size_t currency_graph::node_for(symbol_id asset) {
+    if (asset < node_of_.size() && node_of_[asset] != none) {
+      return node_of_[asset];
+    }
+    nodes_.push_back(node{asset, {}});
+    set_index(node_of_, asset, nodes_.size() - 1);
+    return nodes_.size() - 1;
+  }
+
+  void currency_graph::add_market(symbol_id symbol, symbol_id base, symbol_id quote) {
+    if (symbol < market_of_.size() && market_of_[symbol] != none) {
+      return;
+    }
+
+    market m;
+    m.symbol = symbol;
+    m.base = node_for(base);
+    m.quote = node_for(quote);
+    markets_.push_back(std::move(m));
+
+    size_t index = markets_.size() - 1;
+    set_index(market_of_, symbol, index);
+    nodes_[markets_[index].base].markets.push_back(index);
+    nodes_[markets_[index].quote].markets.push_back(index);
+  }
+
+  void currency_graph::add_coin(symbol_id asset) {
+    size_t n = node_for(asset);
+    for (const coin& c: coins_) {
+      if (c.node == n) {
+	return;
+      }
+    }
+
+    coin c;
+    c.node = n;
+    coins_.push_back(std::move(c));
+    stale_ = true;
+  }
+
+  void currency_graph::remove_coin(symbol_id asset) {
+    if (asset >= node_of_.size() || node_of_[asset] == none) {
+      return;
+    }
+    size_t n = node_of_[asset];
+    for (size_t i = 0; i < coins_.size(); i++) {
+      if (coins_[i].node == n) {
+	coins_.erase(coins_.begin() + i);
+	// The dependents are indexes of coins_, they are found again at the next ticker.
+	for (market& m: markets_) {
+	  m.dependents.clear();
+	}
+	stale_ = true;
+	return;
+      }
+    }
+  }
+
+  void currency_graph::update(const ticker& t, std::vector<quote>& out) {
+    if (t.symbol >= market_of_.size() || market_of_[t.symbol] == none || t.close <= 0) {
+      return;
+    }
+    market& m = markets_[market_of_[t.symbol]];
+    m.price = t.close;
+
+    if (!m.live || stale_) {
+      // A new edge, the shortest routes may go through it. Or a new coin.
+      m.live = true;
+      stale_ = false;
+      route(out);
+      return;
+    }
+
+    for (size_t index: m.dependents) {
+      out.push_back(price(coins_[index]));
+    }
+  }
+
+  void currency_graph::route(std::vector<quote>& out) {
+    // Breadth first search from the target over the live markets: the market by which
+    // each node was reached is the first leg of its route.
+    std::vector<size_t> via(nodes_.size(), none);
+    std::vector<bool> seen(nodes_.size(), false);
+    std::deque<size_t> queue;
+    seen[target_] = true;
+    queue.push_back(target_);
+    while (!queue.empty()) {
+      size_t n = queue.front();
+      queue.pop_front();
+      for (size_t index: nodes_[n].markets) {
+	const market& m = markets_[index];
+	if (!m.live) {
+	  continue;
+	}
+	size_t next = m.base == n ? m.quote : m.base;
+	if (!seen[next]) {
+	  seen[next] = true;
+	  via[next] = index;
+	  queue.push_back(next);
+	}
+      }
+    }
+
+    for (market& m: markets_) {
+      m.dependents.clear();
+    }
+
+    for (size_t i = 0; i < coins_.size(); i++) {
+      coin& c = coins_[i];
+      c.route.clear();
+      c.priced = c.node == target_ || seen[c.node];
+      if (!c.priced) {
+	continue;
+      }
+
+      for (size_t n = c.node; n != target_; ) {
+	size_t index = via[n];
+	market& m = markets_[index];
+	// From base to quote multiply by the price, from quote to base divide.
+	bool inverse = m.quote == n;
+	c.route.push_back(leg{index, inverse});
+	m.dependents.push_back(i);
+	n = inverse ? m.base : m.quote;
+      }
+
+      out.push_back(price(c));
+    }
+  }
+
+  currency_graph::quote currency_graph::price(const coin& c) const {
+    double p = 1.0;
+    for (const leg& l: c.route) {
+      const market& m = markets_[l.market];
+      p = l.inverse ? p / m.price : p * m.price;
+    }
+    return quote{nodes_[c.node].asset, p, c.route.size()};
+  }
+
+  std::vector<symbol_id> currency_graph::route_of(symbol_id asset) const {
+    std::vector<symbol_id> markets;
+    for (const coin& c: coins_) {
+      if (nodes_[c.node].asset == asset) {
+	for (const leg& l: c.route) {
+	  markets.push_back(markets_[l.market].symbol);
+	}
+	break;
+      }
+    }
+    return markets;
+  }
+
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "symbol_table.h"
+#include "ticker.h"
+#include <cstddef>
+#include <vector>
+
+namespace cryptom {
+
+  /*
+    Graph of the assets (nodes) and the markets between them (edges), to price the
+    coins in a target currency when they have no direct market, e.g. FUN -> ETH -> BTC
+    -> USDT.
+
+    A market counts once it received a ticker. The route of each coin is the path with
+    the fewest markets to the target. The routes are computed with one breadth first
+    search from the target, and cached until a new market comes alive. Each market
+    knows the routes going through it, so a ticker only reprices the coins which depend
+    on its market.
+
+    The assets and the markets are interned symbols (ETH, ETHBTC). Not thread safe,
+    meant for the thread reading the ticker channel.
+  */
+  class currency_graph {
+
+  public:
+    // Price of a coin in the target currency.
+    struct quote {
+      symbol_id coin;
+      double price;
+      // Number of markets on the route.
+      size_t legs;
+    };
+
+    explicit currency_graph(symbol_id target);
+
+    // Market symbol where base is priced in quote (ETHBTC: ETH in BTC).
+    void add_market(symbol_id symbol, symbol_id base, symbol_id quote);
+
+    /**
+       Price this coin in the target currency. Coins may be added at any time, the route
+       of a late one is found at the next ticker.
+     */
+    void add_coin(symbol_id coin);
+
+    /**
+       Stop pricing this coin. Its markets stay in the graph, the routes of the other
+       coins may go through them.
+     */
+    void remove_coin(symbol_id coin);
+
+    /**
+       Update the price of the market of the ticker and append the new prices of the
+       coins whose route goes through it to out. Tickers of other markets are ignored.
+     */
+    void update(const ticker& t, std::vector<quote>& out);
+
+    // Markets on the route of the coin, from the coin to the target. Empty if the coin
+    // cannot be priced yet.
+    std::vector<symbol_id> route_of(symbol_id coin) const;
+
+  private:
+    static const size_t none = static_cast<size_t>(-1);
+
+    struct market {
+      symbol_id symbol;
+      size_t base;
+      size_t quote;
+      double price = 0;
+      bool live = false;
+      // Coins whose route goes through this market.
+      std::vector<size_t> dependents;
+    };
+
+    struct leg {
+      size_t market;
+      // Going from the quote to the base of the market: divide by its price.
+      bool inverse;
+    };
+
+    struct node {
+      symbol_id asset;
+      // Markets of the asset.
+      std::vector<size_t> markets;
+    };
+
+    struct coin {
+      size_t node;
+      std::vector<leg> route;
+      bool priced = false;
+    };
+
+    std::vector<node> nodes_;
+    std::vector<market> markets_;
+    std::vector<coin> coins_;
+
+    // Index of the node and of the market of each symbol_id, none if not in the graph.
+    std::vector<size_t> node_of_;
+    std::vector<size_t> market_of_;
+
+    size_t target_;
+
+    // A coin was added or removed since the routes were computed.
+    bool stale_;
+
+    size_t node_for(symbol_id asset);
+    static void set_index(std::vector<size_t>& index, symbol_id id, size_t value);
+
+    // Compute the routes of all the coins again, and append their prices to out.
+    void route(std::vector<quote>& out);
+    // Price of the coin along its route.
+    quote price(const coin& c) const;
+  };
+
+}
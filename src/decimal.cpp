@@ -0,0 +1,210 @@
+#include "decimal.h"
+#include "rapidjson/internal/strtod.h"
+
+namespace cryptom {
+
+  // Powers of 10 which are exact in a double.
+  static const double exact_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+    1e21, 1e22
+  };
+
+  static inline bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+  }
+
+  /*
+    Slow path of parse_decimal, for more than 19 significant digits or large exponents.
+    Collect the significant digits of [begin, end) (the number without sign and exponent)
+    and let rapidjson compute the correctly rounded result of digits * 10^exp10.
+  */
+  static double parse_decimal_digits(const char* begin, const char* end, int exp10) {
+    // More than 768 digits do not change the result (see rapidjson's StrtodFullPrecision).
+    const int max_digits = 768;
+    char digits[max_digits];
+    int nb_digits = 0;
+
+    // The first 19 significant digits always fit in 64 bits.
+    uint64_t mantissa = 0;
+    int mantissa_digits = 0;
+
+    for (const char *p = begin; p != end; ++p) {
+      if (*p == '.' || (nb_digits == 0 && *p == '0')) {
+	continue;
+      }
+
+      if (mantissa_digits < 19) {
+	mantissa = mantissa * 10 + (*p - '0');
+	++mantissa_digits;
+      }
+      if (nb_digits < max_digits) {
+	digits[nb_digits++] = *p;
+      } else {
+	// The digits we keep are the number divided by 10 for each dropped digit.
+	++exp10;
+      }
+    }
+
+    // exp10 is the exponent of the digits we kept; the mantissa has the first
+    // mantissa_digits of them.
+    return rapidjson::internal::StrtodFullPrecision(static_cast<double>(mantissa),
+						    exp10 + nb_digits - mantissa_digits,
+						    digits,
+						    static_cast<size_t>(nb_digits),
+						    static_cast<size_t>(nb_digits),
+						    exp10);
+  }
+
+  bool parse_decimal(const char* str, size_t length, double& value) {
+    const char *p = str;
+    const char *end = str + length;
+
+    bool negative = false;
+    if (p != end && (*p == '-' || *p == '+')) {
+      negative = *p == '-';
+      ++p;
+    }
+    const char *digits_begin = p;
+
+    // The leading zeros are skipped once, then the loops only accumulate: the digits
+    // are counted from the pointers. The mantissa wraps beyond 19 digits, those numbers
+    // take the slow path which collects the digits again.
+    while (p != end && *p == '0') {
+      ++p;
+    }
+    bool any_digit = p != digits_begin;
+
+    uint64_t mantissa = 0;
+    const char *significant = p;
+    for (; p != end && is_digit(*p); ++p) {
+      mantissa = mantissa * 10 + (*p - '0');
+    }
+    int nb_digits = static_cast<int>(p - significant);
+    any_digit = any_digit || nb_digits > 0;
+
+    // value = significant digits * 10^exp10
+    int exp10 = 0;
+    if (p != end && *p == '.') {
+      ++p;
+      const char *fraction = p;
+      if (nb_digits == 0) {
+	while (p != end && *p == '0') {
+	  ++p;
+	}
+      }
+      significant = p;
+      for (; p != end && is_digit(*p); ++p) {
+	mantissa = mantissa * 10 + (*p - '0');
+      }
+      nb_digits += static_cast<int>(p - significant);
+      exp10 = -static_cast<int>(p - fraction);
+      any_digit = any_digit || p != fraction;
+    }
+    const char *digits_end = p;
+
+    if (!any_digit) {
+      return false;
+    }
+
+    if (p != end && (*p == 'e' || *p == 'E')) {
+      ++p;
+      bool negative_exp = false;
+      if (p != end && (*p == '-' || *p == '+')) {
+	negative_exp = *p == '-';
+	++p;
+      }
+
+      if (p == end || !is_digit(*p)) {
+	return false;
+      }
+
+      int exp = 0;
+      for (; p != end && is_digit(*p); ++p) {
+	// Large enough to give 0 or infinity anyway.
+	if (exp < 100000) {
+	  exp = exp * 10 + (*p - '0');
+	}
+      }
+      exp10 += negative_exp ? -exp : exp;
+    }
+
+    if (p != end) {
+      return false;
+    }
+
+    double result;
+    if (nb_digits == 0) {
+      result = 0.0;
+    } else if (nb_digits <= 19 &&
+	       mantissa <= (UINT64_C(1) << 53) &&
+	       exp10 >= -22 && exp10 <= 22) {
+      // Fast path: both the mantissa and the power of 10 are exact doubles, so the
+      // multiplication or division is correctly rounded. This is the case of all the
+      // prices and volumes of the exchanges.
+      result = static_cast<double>(mantissa);
+      result = exp10 < 0 ? result / exact_pow10[-exp10] : result * exact_pow10[exp10];
+    } else {
+      result = parse_decimal_digits(digits_begin, digits_end, exp10);
+    }
+
+    value = negative ? -result : result;
+    return true;
+  }
+
+  bool parse_fixed(const char* str, size_t length, fixed_decimal& value) {
+    const char *p = str;
+    const char *end = str + length;
+
+    bool negative = false;
+    if (p != end && (*p == '-' || *p == '+')) {
+      negative = *p == '-';
+      ++p;
+    }
+
+    const int64_t max_integer = INT64_MAX / fixed_decimal::scale;
+
+    bool any_digit = false;
+    int64_t integer = 0;
+    for (; p != end && is_digit(*p); ++p) {
+      any_digit = true;
+      integer = integer * 10 + (*p - '0');
+      if (integer > max_integer) {
+	return false;
+      }
+    }
+
+    int64_t fraction = 0;
+    int fraction_digits = 0;
+    if (p != end && *p == '.') {
+      ++p;
+      for (; p != end && is_digit(*p); ++p) {
+	any_digit = true;
+	if (fraction_digits < fixed_decimal::decimals) {
+	  fraction = fraction * 10 + (*p - '0');
+	  ++fraction_digits;
+	} else if (*p != '0') {
+	  // Cannot be represented exactly.
+	  return false;
+	}
+      }
+    }
+
+    if (!any_digit || p != end) {
+      return false;
+    }
+
+    for (; fraction_digits < fixed_decimal::decimals; ++fraction_digits) {
+      fraction *= 10;
+    }
+
+    if (integer == max_integer && fraction > INT64_MAX % fixed_decimal::scale) {
+      return false;
+    }
+
+    int64_t units = integer * fixed_decimal::scale + fraction;
+    value.units = negative ? -units : units;
+    return true;
+  }
+
+}
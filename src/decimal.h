@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cryptom {
+
+  /**
+     Parse a decimal number as sent by the exchanges ("0.04631749", "-95.960", "1e-5").
+     Unlike std::stod it does not depend on the locale, does not allocate and does not
+     throw. The whole [str, str + length) must be the number.
+     Return true if ok. The result is correctly rounded.
+   */
+  bool parse_decimal(const char* str, size_t length, double& value);
+
+  /**
+     Fixed-point amount with 8 decimals, the precision of the exchanges (1 satoshi).
+     Prices and quantities are kept exactly, without the rounding of double.
+   */
+  struct fixed_decimal {
+    static const int decimals = 8;
+    static const int64_t scale = 100000000;
+
+    // Amount in 1e-8 units.
+    int64_t units;
+
+    double to_double() const { return static_cast<double>(units) / scale; }
+  };
+
+  /**
+     Parse a decimal number in a fixed_decimal. Exponents are not accepted. Return false
+     if the number does not fit in 64 bits or has non zero digits after the 8th decimal.
+   */
+  bool parse_fixed(const char* str, size_t length, fixed_decimal& value);
+
+}
@@ -0,0 +1,375 @@
+#include "depth_feed.h"
+#include "decimal.h"
+
+#include <event2/buffer.h>
+#include <event2/keyvalq_struct.h>
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+
+namespace cryptom {
+
+  namespace {
+
+    // [["0.0024", "10"], ...], the levels may have more fields.
+    bool levels_of(const rapidjson::Value& object, const char *name, std::vector<price_level>& out) {
+      rapidjson::Value::ConstMemberIterator it = object.FindMember(name);
+      if (it == object.MemberEnd() || !it->value.IsArray()) {
+	return false;
+      }
+      out.clear();
+      for (const rapidjson::Value& level: it->value.GetArray()) {
+	if (!level.IsArray() || level.Size() < 2 || !level[0].IsString() || !level[1].IsString()) {
+	  return false;
+	}
+	price_level l;
+	if (!parse_decimal(level[0].GetString(), level[0].GetStringLength(), l.price) ||
+	    !parse_decimal(level[1].GetString(), level[1].GetStringLength(), l.quantity)) {
+	  return false;
+	}
+	out.push_back(l);
+      }
+      return true;
+    }
+
+    bool id_of(const rapidjson::Value& object, const char *name, uint64_t& out) {
+      rapidjson::Value::ConstMemberIterator it = object.FindMember(name);
+      if (it == object.MemberEnd() || !it->value.IsUint64()) {
+	return false;
+      }
+      out = it->value.GetUint64();
+      return true;
+    }
+
+  }
+
+  int depth_snapshot_from_json(const rapidjson::Value& json,
+			       uint64_t& last_update_id,
+			       std::vector<price_level>& bids,
+			       std::vector<price_level>& asks) {
+    if (!json.IsObject() ||
+	!id_of(json, "lastUpdateId", last_update_id) ||
+	!levels_of(json, "bids", bids) ||
+	!levels_of(json, "asks", asks)) {
+      return -1;
+    }
+    return 0;
+  }
+
+  int depth_update_from_json(const rapidjson::Value& event, depth_update& out, const char*& symbol) {
+    rapidjson::Value::ConstMemberIterator s = event.FindMember("s");
+    if (s == event.MemberEnd() || !s->value.IsString() ||
+	!id_of(event, "U", out.first_id) ||
+	!id_of(event, "u", out.last_id) ||
+	!levels_of(event, "b", out.bids) ||
+	!levels_of(event, "a", out.asks)) {
+      return -1;
+    }
+    symbol = s->value.GetString();
+    return 0;
+  }
+
+  int binance_depth_stream::tickers_from_message(char *text, const symbol_map& symbols, std::vector<ticker>& out) {
+    json_arena::document_type& json = arena_.parse_insitu(text);
+    if (json.HasParseError() || !json.IsObject()) {
+      return -1;
+    }
+
+    // Combined streams wrap the event in "data".
+    const rapidjson::Value *event = &json;
+    rapidjson::Value::ConstMemberIterator data = json.FindMember("data");
+    if (data != json.MemberEnd() && data->value.IsObject()) {
+      event = &data->value;
+    }
+
+    // Replies to the subscriptions.
+    rapidjson::Value::ConstMemberIterator type = event->FindMember("e");
+    if (type == event->MemberEnd() || !type->value.IsString() ||
+	strcmp(type->value.GetString(), "depthUpdate") != 0) {
+      return 0;
+    }
+
+    const char *symbol;
+    if (depth_update_from_json(*event, update_, symbol) != 0) {
+      return -1;
+    }
+    feed_->on_update(symbol, update_);
+    return 0;
+  }
+
+  const int depth_feed::snapshot_interval_ms;
+
+  depth_feed::depth_feed(tls_context *tls, const dns_options& dns,
+			 const std::string& rest_url, const std::string& stream_url,
+			 symbol_map symbols):
+    tls_(tls),
+    dns_options_(dns),
+    rest_url_(rest_url),
+    stream_url_(stream_url),
+    symbols_(std::move(symbols)),
+    rest_uri_(evhttp_uri_parse(rest_url.c_str())),
+    base_(event_base_new()),
+    dropped_(0),
+    failures_(0) {
+
+    if (rest_uri_ == nullptr) {
+      std::cerr << "Invalid depth url " << rest_url << "\n";
+    }
+    if (base_ != nullptr) {
+      dns_.reset(new dns_cache(base_, dns_options_));
+      pool_.reset(new connection_pool(base_, tls_, dns_.get()));
+    }
+
+    for (const auto& entry: symbols_) {
+      market *m = new market(this, entry.first);
+      markets_[entry.first].reset(m);
+      by_id_[entry.second] = m;
+    }
+  }
+
+  depth_feed::~depth_feed() {
+    stop();
+
+    // Otherwise libevent would call us back once destroyed.
+    for (auto& entry: markets_) {
+      market& m = *entry.second;
+      if (m.req != nullptr) {
+	evhttp_cancel_request(m.req);
+	pool_->release(m.evcon);
+      }
+    }
+
+    // The stream and the pool use the DNS cache and the event loop.
+    stream_.reset();
+    pool_.reset();
+    dns_.reset();
+
+    if (rest_uri_ != nullptr)
+      evhttp_uri_free(rest_uri_);
+
+    if (base_ != nullptr)
+      event_base_free(base_);
+  }
+
+  void depth_feed::start() {
+    if (base_ == nullptr || thread_.joinable()) {
+      return;
+    }
+
+    std::cout << "Will stream the depth of " << markets_.size() << " markets from " << stream_url_ << std::endl;
+    stream_.reset(new websocket_client(base_, stream_url_.c_str(), tls_, dns_.get(),
+				       std::unique_ptr<stream_protocol>(new binance_depth_stream(this)),
+				       symbols_, nullptr, 0));
+
+    event_base *base = base_;
+    thread_ = std::thread([base]() {
+	event_base_loop(base, EVLOOP_NO_EXIT_ON_EMPTY);
+      });
+  }
+
+  void depth_feed::stop() {
+    if (!thread_.joinable()) {
+      return;
+    }
+    event_base_loopexit(base_, NULL);
+    thread_.join();
+  }
+
+  void depth_feed::set_symbols(symbol_map symbols) {
+    if (!thread_.joinable()) {
+      update_markets(std::move(symbols));
+      return;
+    }
+    auto *arg = new std::pair<depth_feed*, symbol_map>(this, std::move(symbols));
+    if (event_base_once(base_, -1, EV_TIMEOUT, &depth_feed::libevent_update_markets, arg, NULL) != 0) {
+      fprintf(stderr, "event_base_once() failed\n");
+      delete arg;
+    }
+  }
+
+  void depth_feed::libevent_update_markets(evutil_socket_t fd, short what, void *arg) {
+    std::unique_ptr<std::pair<depth_feed*, symbol_map>> change(static_cast<std::pair<depth_feed*, symbol_map>*>(arg));
+    change->first->update_markets(std::move(change->second));
+  }
+
+  void depth_feed::update_markets(symbol_map symbols) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto it = markets_.begin(); it != markets_.end();) {
+	if (symbols.count(it->first) != 0) {
+	  ++it;
+	  continue;
+	}
+	// Otherwise libevent would call back the removed market.
+	market& m = *it->second;
+	if (m.req != nullptr) {
+	  evhttp_cancel_request(m.req);
+	  pool_->release(m.evcon);
+	}
+	by_id_.erase(symbols_[it->first]);
+	it = markets_.erase(it);
+      }
+      for (const auto& entry: symbols) {
+	if (markets_.count(entry.first) == 0) {
+	  market *m = new market(this, entry.first);
+	  markets_[entry.first].reset(m);
+	  by_id_[entry.second] = m;
+	}
+      }
+      symbols_ = std::move(symbols);
+    }
+
+    // The new books are loaded from their first diff on.
+    if (stream_ != nullptr) {
+      stream_->set_symbols(symbols_);
+    }
+  }
+
+  void depth_feed::on_update(const char *symbol, const depth_update& update) {
+    auto it = markets_.find(symbol);
+    if (it == markets_.end()) {
+      return;
+    }
+    market& m = *it->second;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (m.book.synced()) {
+      if (m.book.apply(update) != order_book::gap) {
+	return;
+      }
+      std::cerr << "Gap in the depth updates of " << m.symbol << " before " << update.first_id
+		<< ", loading the book again\n";
+    }
+
+    // Until the snapshot is loaded.
+    if (m.pending.size() == max_pending) {
+      m.pending.erase(m.pending.begin());
+      ++dropped_;
+    }
+    m.pending.push_back(update);
+    request_snapshot(m);
+  }
+
+  void depth_feed::request_snapshot(market& m) {
+    clock::time_point now = clock::now();
+    if (m.req != nullptr || now < m.next_snapshot || rest_uri_ == nullptr) {
+      return;
+    }
+    m.next_snapshot = now + std::chrono::milliseconds(snapshot_interval_ms);
+
+    m.evcon = pool_->acquire(rest_uri_);
+    if (m.evcon == nullptr) {
+      ++failures_;
+      return;
+    }
+
+    evhttp_request *req = evhttp_request_new(&depth_feed::libevent_snapshot_done, &m);
+    if (req == NULL) {
+      fprintf(stderr, "evhttp_request_new() failed\n");
+      pool_->release(m.evcon);
+      return;
+    }
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Host", evhttp_uri_get_host(rest_uri_));
+
+    const char *path = evhttp_uri_get_path(rest_uri_);
+    std::string uri = std::string(strlen(path) > 0 ? path : "/") +
+      "?symbol=" + m.symbol + "&limit=" + std::to_string(snapshot_limit);
+    if (evhttp_make_request(m.evcon, req, EVHTTP_REQ_GET, uri.c_str()) != 0) {
+      // The request is freed by libevent.
+      fprintf(stderr, "evhttp_make_request() failed\n");
+      pool_->release(m.evcon);
+      ++failures_;
+      return;
+    }
+    m.req = req;
+  }
+
+  void depth_feed::on_snapshot(market& m, evhttp_request *req) {
+    // libevent frees the request once we return.
+    m.req = nullptr;
+    pool_->release(m.evcon, req);
+
+    int code = req != NULL ? evhttp_request_get_response_code(req) : 0;
+    if (code != 200) {
+      std::cerr << "Cannot get the depth of " << m.symbol << " (HTTP " << code << ")\n";
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++failures_;
+      return;
+    }
+
+    // Terminated for the in situ parser.
+    evbuffer *input = evhttp_request_get_input_buffer(req);
+    std::vector<char> text(evbuffer_get_length(input) + 1);
+    evbuffer_remove(input, text.data(), text.size() - 1);
+    text.back() = '\0';
+
+    rapidjson::Document json;
+    json.ParseInsitu(text.data());
+    uint64_t last_update_id;
+    std::vector<price_level> bids, asks;
+    if (json.HasParseError() || depth_snapshot_from_json(json, last_update_id, bids, asks) != 0) {
+      std::cerr << "Invalid depth snapshot of " << m.symbol << "\n";
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++failures_;
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    m.book.load_snapshot(last_update_id, bids, asks);
+    apply_pending(m);
+    if (!m.book.synced()) {
+      // The diffs we have start after the snapshot, another one is needed.
+      request_snapshot(m);
+    }
+  }
+
+  void depth_feed::apply_pending(market& m) {
+    size_t n = 0;
+    for (; n < m.pending.size(); n++) {
+      if (m.book.apply(m.pending[n]) == order_book::gap) {
+	break;
+      }
+    }
+    m.pending.erase(m.pending.begin(), m.pending.begin() + n);
+  }
+
+  bool depth_feed::liquidation_value(symbol_id symbol, double quantity, double& value, double& filled) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = by_id_.find(symbol);
+    if (it == by_id_.end()) {
+      return false;
+    }
+    if (!it->second->book.synced()) {
+      return false;
+    }
+    value = it->second->book.sell_value(quantity, filled);
+    return true;
+  }
+
+  double depth_feed::best_bid(symbol_id symbol) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = by_id_.find(symbol);
+    if (it == by_id_.end()) {
+      return 0;
+    }
+    const price_level *best = it->second->book.best(order_book::bid);
+    return it->second->book.synced() && best != nullptr ? best->price : 0;
+  }
+
+  depth_feed::stats depth_feed::get_stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats total;
+    for (const auto& entry: markets_) {
+      const order_book::stats& stats = entry.second->book.get_stats();
+      total.books.snapshots += stats.snapshots;
+      total.books.updates += stats.updates;
+      total.books.levels += stats.levels;
+      total.books.stale += stats.stale;
+      total.books.gaps += stats.gaps;
+    }
+    total.dropped = dropped_;
+    total.failures = failures_;
+    return total;
+  }
+
+}
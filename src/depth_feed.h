@@ -0,0 +1,186 @@
+#pragma once
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include "connection_pool.h"
+#include "dns_cache.h"
+#include "market_stream.h"
+#include "order_book.h"
+#include "tls_context.h"
+#include "websocket_client.h"
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cryptom {
+
+  /**
+     Parse a depth snapshot of binance (GET /api/v1/depth):
+     {"lastUpdateId": 160, "bids": [["0.0024", "10"]], "asks": [["0.0026", "100"]]}
+     Will return 0 if ok.
+   */
+  int depth_snapshot_from_json(const rapidjson::Value& json,
+			       uint64_t& last_update_id,
+			       std::vector<price_level>& bids,
+			       std::vector<price_level>& asks);
+
+  /**
+     Parse a diff depth event of binance:
+     {"e": "depthUpdate", "E": 123456789, "s": "BNBBTC", "U": 157, "u": 160,
+      "b": [["0.0024", "10"]], "a": [["0.0026", "100"]]}
+     The symbol points to the document. Will return 0 if ok.
+   */
+  int depth_update_from_json(const rapidjson::Value& event, depth_update& out, const char*& symbol);
+
+  class depth_feed;
+
+  /*
+    Diff depth streams <symbol>@depth@100ms of binance. The diffs go to the books of
+    the feed, the messages give no ticker.
+  */
+  class binance_depth_stream: public binance_stream {
+  public:
+    explicit binance_depth_stream(depth_feed *feed):
+      binance_stream("binance depth", "depth@100ms"), feed_(feed) {}
+
+    int tickers_from_message(char *text, const symbol_map& symbols, std::vector<ticker>& out);
+
+  private:
+    depth_feed *feed_;
+    // Diff being parsed, kept to reuse the memory.
+    depth_update update_;
+  };
+
+  /*
+    Order books of the markets of binance, kept up to date in an event loop of their
+    own: the diffs come from the WebSocket stream, and the book of a market is
+    (re)loaded from the REST snapshot when the stream starts and after a gap in the
+    sequence of the updates. The diffs received while the snapshot is on its way are
+    kept and applied once it is loaded.
+
+    The books are read from other threads, under a lock.
+  */
+  class depth_feed {
+
+  public:
+    struct stats {
+      // Sum of the statistics of the books.
+      order_book::stats books;
+      // Diffs dropped as the buffer of a market waiting for its snapshot was full.
+      unsigned long dropped = 0;
+      // Failed snapshot requests.
+      unsigned long failures = 0;
+    };
+
+    /*
+      rest_url: endpoint of the snapshots (https://api.binance.com/api/v1/depth),
+      stream_url: raw stream endpoint (wss://stream.binance.com:9443/ws).
+    */
+    depth_feed(tls_context *tls, const dns_options& dns,
+	       const std::string& rest_url, const std::string& stream_url,
+	       symbol_map symbols);
+    ~depth_feed();
+
+    // no copy or assignement. The callbacks of libevent hold the address of the feed.
+    depth_feed(const depth_feed&) = delete;
+    depth_feed& operator=(const depth_feed&) = delete;
+
+    // Start the thread of the event loop.
+    void start();
+
+    // Stop the event loop and wait for the thread.
+    void stop();
+
+    /**
+       Follow the books of these markets instead, from any thread. The books of the
+       markets kept stay synced, the new ones are subscribed on the open stream and
+       loaded from their snapshot.
+     */
+    void set_symbols(symbol_map symbols);
+
+    /**
+       What selling quantity of the market at once would give, with the slippage of the
+       bids, in the quote currency. Return false if the book is not synced. filled is
+       the quantity the book can take.
+     */
+    bool liquidation_value(symbol_id symbol, double quantity, double& value, double& filled) const;
+
+    // Best bid of the market, 0 if the book is not synced.
+    double best_bid(symbol_id symbol) const;
+
+    stats get_stats() const;
+
+    // From the stream, in the thread of the loop.
+    void on_update(const char *symbol, const depth_update& update);
+
+  private:
+
+    typedef std::chrono::steady_clock clock;
+
+    // Diffs kept for a market waiting for its snapshot.
+    static const size_t max_pending = 4096;
+    // Depth of the snapshots, and shortest delay between two snapshots of a market
+    // (the exchange counts 10 times the weight of a ticker for them).
+    static const int snapshot_limit = 1000;
+    static const int snapshot_interval_ms = 1000;
+
+    struct market {
+      depth_feed *feed;
+      std::string symbol;
+      order_book book;
+      std::vector<depth_update> pending;
+      // Snapshot request in flight. Owned by libevent.
+      evhttp_request *req = nullptr;
+      evhttp_connection *evcon = nullptr;
+      clock::time_point next_snapshot;
+
+      market(depth_feed *feed, const std::string& symbol): feed(feed), symbol(symbol) {}
+    };
+
+    tls_context *tls_;
+    dns_options dns_options_;
+    std::string rest_url_;
+    std::string stream_url_;
+    symbol_map symbols_;
+
+    // Endpoint of the snapshots.
+    evhttp_uri *rest_uri_;
+
+    event_base *base_;
+    std::unique_ptr<dns_cache> dns_;
+    std::unique_ptr<connection_pool> pool_;
+    std::unique_ptr<websocket_client> stream_;
+    std::thread thread_;
+
+    // Books by symbol name, as in the messages. Changed by the thread of the loop under
+    // the mutex, the books are protected by the mutex too.
+    std::map<std::string, std::unique_ptr<market>, std::less<>> markets_;
+    std::map<symbol_id, market*> by_id_;
+    mutable std::mutex mutex_;
+
+    // Counters of the feed, the books have their own. Protected by the mutex.
+    unsigned long dropped_;
+    unsigned long failures_;
+
+    // Called with the lock.
+    void request_snapshot(market& m);
+
+    static void libevent_snapshot_done(evhttp_request *req, void *ctx) {
+      market *m = static_cast<market*>(ctx);
+      m->feed->on_snapshot(*m, req);
+    }
+    void on_snapshot(market& m, evhttp_request *req);
+
+    // Apply the diffs kept while waiting for the snapshot. Called with the lock.
+    void apply_pending(market& m);
+
+    // Markets of set_symbols, in the thread of the loop once started.
+    static void libevent_update_markets(evutil_socket_t fd, short what, void *arg);
+    void update_markets(symbol_map symbols);
+  };
+
+}
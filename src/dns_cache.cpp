@@ -0,0 +1,191 @@
+#include "dns_cache.h"
+#include <event2/util.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+namespace cryptom {
+
+  const int dns_cache::min_ttl;
+  const int dns_cache::max_ttl;
+  const int dns_cache::default_ttl;
+  const int dns_cache::failure_ttl;
+
+  dns_cache::dns_cache(event_base *base, const dns_options& options):
+    base_(base),
+    use_hosts_file_(!options.hosts_file.empty()),
+    prefetch_(options.prefetch),
+    prefetch_timer_(nullptr) {
+
+    if (options.nameserver.empty()) {
+      dns_base_ = evdns_base_new(base, EVDNS_BASE_INITIALIZE_NAMESERVERS);
+    } else {
+      dns_base_ = evdns_base_new(base, 0);
+      if (dns_base_ != NULL && evdns_base_nameserver_ip_add(dns_base_, options.nameserver.c_str()) != 0) {
+	fprintf(stderr, "Invalid nameserver %s\n", options.nameserver.c_str());
+      }
+    }
+
+    if (dns_base_ == NULL) {
+      fprintf(stderr, "evdns_base_new() failed\n");
+      return;
+    }
+
+    if (use_hosts_file_ && evdns_base_load_hosts(dns_base_, options.hosts_file.c_str()) != 0) {
+      fprintf(stderr, "Cannot load hosts file %s\n", options.hosts_file.c_str());
+    }
+
+    if (prefetch_) {
+      timeval interval{1, 0};
+      prefetch_timer_ = event_new(base, -1, EV_PERSIST, &dns_cache::libevent_prefetch, this);
+      evtimer_add(prefetch_timer_, &interval);
+    }
+  }
+
+  dns_cache::~dns_cache() {
+    if (prefetch_timer_ != nullptr)
+      event_free(prefetch_timer_);
+
+    // Fails the pending requests, their callbacks free their context.
+    if (dns_base_ != nullptr)
+      evdns_base_free(dns_base_, 1);
+  }
+
+  const char* dns_cache::lookup(const std::string& host, stage_histograms *metrics) {
+    auto it = entries_.find(host);
+    if (it == entries_.end()) {
+      ++stats_.misses;
+      if (metrics != nullptr) {
+	entries_[host].metrics = metrics;
+      }
+      resolve(host);
+      return nullptr;
+    }
+
+    entry& e = it->second;
+    e.used = true;
+    if (metrics != nullptr) {
+      e.metrics = metrics;
+    }
+    if (e.address.empty() || clock::now() >= e.expires) {
+      ++stats_.misses;
+      if (!e.resolving) {
+	resolve(host);
+      }
+      return nullptr;
+    }
+
+    ++stats_.hits;
+    return e.address.c_str();
+  }
+
+  void dns_cache::resolve(const std::string& host) {
+    if (dns_base_ == nullptr) {
+      return;
+    }
+
+    // Numeric addresses need no resolution.
+    in_addr numeric;
+    if (inet_pton(AF_INET, host.c_str(), &numeric) == 1) {
+      resolved(host, host.c_str(), max_ttl);
+      return;
+    }
+
+    entry& e = entries_[host];
+    e.resolving = true;
+    e.used = false;
+    e.started = clock::now();
+    ++stats_.resolutions;
+
+    request *req = new request{this, host};
+    if (use_hosts_file_) {
+      // evdns_getaddrinfo looks at the hosts file first. No TTL, and the callback can
+      // be called before it returns.
+      evutil_addrinfo hints;
+      memset(&hints, 0, sizeof(hints));
+      hints.ai_family = AF_INET;
+      hints.ai_socktype = SOCK_STREAM;
+      evdns_getaddrinfo(dns_base_, host.c_str(), NULL, &hints,
+			&dns_cache::evdns_getaddrinfo_resolved, req);
+    } else if (evdns_base_resolve_ipv4(dns_base_, host.c_str(), 0,
+				       &dns_cache::evdns_resolved, req) == NULL) {
+      delete req;
+      resolved(host, nullptr, failure_ttl);
+    }
+  }
+
+  void dns_cache::resolved(const std::string& host, const char *address, int ttl) {
+    entry& e = entries_[host];
+    clock::time_point now = clock::now();
+    if (e.resolving && e.metrics != nullptr) {
+      e.metrics->record(stage::dns, std::chrono::duration_cast<std::chrono::nanoseconds>(now - e.started).count());
+    }
+    e.resolving = false;
+
+    if (address == nullptr) {
+      // Keep the previous address if any, and try again later.
+      ++stats_.failures;
+      e.refresh = now + std::chrono::seconds(failure_ttl);
+      return;
+    }
+
+    if (ttl < min_ttl)
+      ttl = min_ttl;
+    if (ttl > max_ttl)
+      ttl = max_ttl;
+
+    e.address = address;
+    e.expires = now + std::chrono::seconds(ttl);
+    // Refresh at 80% of the TTL.
+    e.refresh = now + std::chrono::milliseconds(ttl * 800);
+  }
+
+  void dns_cache::prefetch() {
+    clock::time_point now = clock::now();
+    for (auto& it: entries_) {
+      entry& e = it.second;
+      if (e.resolving || !e.used || now < e.refresh) {
+	continue;
+      }
+
+      ++stats_.prefetches;
+      resolve(it.first);
+    }
+  }
+
+  void dns_cache::evdns_resolved(int result, char type, int count, int ttl, void *addresses, void *arg) {
+    request *req = static_cast<request*>(arg);
+    if (result == DNS_ERR_SHUTDOWN || result == DNS_ERR_CANCEL) {
+      delete req;
+      return;
+    }
+
+    char address[INET_ADDRSTRLEN];
+    bool ok = result == DNS_ERR_NONE && type == DNS_IPv4_A && count > 0 &&
+      evutil_inet_ntop(AF_INET, addresses, address, sizeof(address)) != NULL;
+
+    req->cache->resolved(req->host, ok ? address : nullptr, ok ? ttl : failure_ttl);
+    delete req;
+  }
+
+  void dns_cache::evdns_getaddrinfo_resolved(int result, evutil_addrinfo *res, void *arg) {
+    request *req = static_cast<request*>(arg);
+    if (result == EVUTIL_EAI_CANCEL) {
+      delete req;
+      return;
+    }
+
+    char address[INET_ADDRSTRLEN];
+    bool ok = result == 0 && res != NULL && res->ai_family == AF_INET &&
+      evutil_inet_ntop(AF_INET, &reinterpret_cast<sockaddr_in*>(res->ai_addr)->sin_addr,
+		       address, sizeof(address)) != NULL;
+
+    req->cache->resolved(req->host, ok ? address : nullptr, ok ? default_ttl : failure_ttl);
+    if (res != NULL)
+      evutil_freeaddrinfo(res);
+    delete req;
+  }
+
+}
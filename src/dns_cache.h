@@ -0,0 +1,113 @@
+#pragma once
+
+#include <event2/event.h>
+#include <event2/dns.h>
+#include "metrics.h"
+#include <chrono>
+#include <map>
+#include <string>
+
+namespace cryptom {
+
+  /*
+    Where and how to resolve the exchange hosts.
+  */
+  struct dns_options {
+    // "ip[:port]" of the nameserver to use instead of the ones of /etc/resolv.conf.
+    // Useful to test offline against a local stub resolver.
+    std::string nameserver;
+    // Hosts file to look at before the nameservers. The addresses of this file get
+    // default_ttl as they have no TTL.
+    std::string hosts_file;
+    // Resolve the hosts again before their TTL expires, if they were used since the
+    // last resolution, so that a connection never waits for the resolver.
+    bool prefetch = true;
+  };
+
+  /*
+    Non blocking resolution of the exchange hosts with evdns, and cache of the IPv4
+    addresses which respects the TTL of the answers. One cache per event loop, shared
+    by all the connections of the loop.
+  */
+  class dns_cache {
+
+  public:
+    dns_cache(event_base *base, const dns_options& options);
+    ~dns_cache();
+
+    // no copy or assignement
+    dns_cache(const dns_cache&) = delete;
+    dns_cache& operator=(const dns_cache&) = delete;
+
+    /*
+      Return the cached address of the host ("1.2.3.4"), or NULL if there is no valid
+      one. In that case a resolution is started, the address will be in the cache once
+      it completes. The pointer is valid until the next call.
+      The resolutions of the host are timed in metrics if given (stage::dns).
+    */
+    const char* lookup(const std::string& host, stage_histograms *metrics = nullptr);
+
+    // For the connections which must resolve by themselves (cache miss).
+    evdns_base* get_dns_base() const { return dns_base_; }
+
+    struct stats {
+      unsigned long hits = 0;
+      unsigned long misses = 0;
+      unsigned long resolutions = 0;
+      unsigned long prefetches = 0;
+      unsigned long failures = 0;
+    };
+
+    const stats& get_stats() const { return stats_; }
+
+  private:
+    typedef std::chrono::steady_clock clock;
+
+    struct entry {
+      std::string address;
+      clock::time_point expires;
+      // When to resolve again to refresh the address before it expires.
+      clock::time_point refresh;
+      bool resolving = false;
+      bool used = false;
+      // Start of the resolution in progress, and where to record its duration.
+      clock::time_point started;
+      stage_histograms *metrics = nullptr;
+    };
+
+    // Context of one resolution, freed by its callback.
+    struct request {
+      dns_cache *cache;
+      std::string host;
+    };
+
+    // Bounds of the TTLs we accept, and TTL of the hosts file and of the failures.
+    static const int min_ttl = 5;
+    static const int max_ttl = 3600;
+    static const int default_ttl = 60;
+    static const int failure_ttl = 5;
+
+    event_base *base_;
+    evdns_base *dns_base_;
+    bool use_hosts_file_;
+    bool prefetch_;
+
+    std::map<std::string, entry> entries_;
+
+    // Checks the entries to refresh.
+    event *prefetch_timer_;
+
+    stats stats_;
+
+    void resolve(const std::string& host);
+    void resolved(const std::string& host, const char *address, int ttl);
+    void prefetch();
+
+    static void evdns_resolved(int result, char type, int count, int ttl, void *addresses, void *arg);
+    static void evdns_getaddrinfo_resolved(int result, evutil_addrinfo *res, void *arg);
+    static void libevent_prefetch(evutil_socket_t fd, short what, void *arg) {
+      static_cast<dns_cache*>(arg)->prefetch();
+    }
+  };
+
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <event2/buffer.h>
+#include <cassert>
+#include <cstddef>
+
+namespace cryptom {
+
+  /*
+    rapidjson input stream reading the segments of an evbuffer in place (evbuffer_peek),
+    so a response can be parsed without copying it in a contiguous buffer.
+    The evbuffer must not be modified while the stream is used.
+  */
+  class evbuffer_stream {
+
+  public:
+    typedef char Ch;
+
+    explicit evbuffer_stream(evbuffer *buffer):
+      buffer_(buffer),
+      nb_vec_(0),
+      vec_index_(0),
+      cur_(nullptr),
+      end_(nullptr),
+      count_(0),
+      peeked_(0) {
+      peek_segments();
+    }
+
+    Ch Peek() const { return cur_ != end_ ? *cur_ : '\0'; }
+
+    Ch Take() {
+      if (cur_ == end_) {
+	return '\0';
+      }
+
+      Ch c = *cur_++;
+      ++count_;
+      if (cur_ == end_) {
+	next_segment();
+      }
+      return c;
+    }
+
+    size_t Tell() const { return count_; }
+
+    // Not an output stream.
+    Ch* PutBegin() { assert(false); return 0; }
+    void Put(Ch) { assert(false); }
+    void Flush() { assert(false); }
+    size_t PutEnd(Ch*) { assert(false); return 0; }
+
+  private:
+    // Number of segments we look at in one evbuffer_peek call.
+    static const int max_vec = 16;
+
+    evbuffer *buffer_;
+    evbuffer_iovec vec_[max_vec];
+    int nb_vec_;
+    int vec_index_;
+
+    const Ch *cur_;
+    const Ch *end_;
+
+    // Number of characters taken from the stream.
+    size_t count_;
+
+    // Number of bytes covered by the segments peeked so far.
+    size_t peeked_;
+
+    void next_segment() {
+      ++vec_index_;
+      if (vec_index_ < nb_vec_) {
+	set_segment();
+      } else if (nb_vec_ == max_vec) {
+	// There might be more segments after the ones we peeked.
+	peek_segments();
+      } else {
+	cur_ = end_ = nullptr;
+      }
+    }
+
+    void peek_segments() {
+      evbuffer_ptr start;
+      if (evbuffer_ptr_set(buffer_, &start, peeked_, EVBUFFER_PTR_SET) != 0) {
+	nb_vec_ = 0;
+      } else {
+	nb_vec_ = evbuffer_peek(buffer_, -1, &start, vec_, max_vec);
+	if (nb_vec_ > max_vec) {
+	  nb_vec_ = max_vec;
+	}
+      }
+
+      vec_index_ = 0;
+      if (nb_vec_ > 0) {
+	set_segment();
+      } else {
+	cur_ = end_ = nullptr;
+      }
+    }
+
+    void set_segment() {
+      cur_ = static_cast<const Ch*>(vec_[vec_index_].iov_base);
+      end_ = cur_ + vec_[vec_index_].iov_len;
+      peeked_ += vec_[vec_index_].iov_len;
+      if (cur_ == end_) {
+	next_segment();
+      }
+    }
+  };
+
+}
@@ -0,0 +1,108 @@
+#include "file_watcher.h"
+
+#include <sys/inotify.h>
+#include <limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+namespace cryptom {
+
+  const long file_watcher::settle_ms;
+
+  file_watcher::file_watcher(const std::string& path, std::function<void()> changed):
+    changed_(std::move(changed)),
+    fd_(-1),
+    base_(event_base_new()),
+    read_event_(nullptr),
+    settle_timer_(nullptr) {
+    size_t slash = path.rfind('/');
+    if (slash == std::string::npos) {
+      directory_ = ".";
+      name_ = path;
+    } else {
+      directory_ = slash == 0 ? "/" : path.substr(0, slash);
+      name_ = path.substr(slash + 1);
+    }
+  }
+
+  file_watcher::~file_watcher() {
+    stop();
+
+    if (read_event_ != nullptr)
+      event_free(read_event_);
+
+    if (settle_timer_ != nullptr)
+      event_free(settle_timer_);
+
+    if (fd_ >= 0)
+      close(fd_);
+
+    if (base_ != nullptr)
+      event_base_free(base_);
+  }
+
+  int file_watcher::start() {
+    if (base_ == nullptr || thread_.joinable()) {
+      return -1;
+    }
+
+    if (fd_ < 0) {
+      fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+      if (fd_ < 0) {
+	perror("inotify_init1()");
+	return -1;
+      }
+      if (inotify_add_watch(fd_, directory_.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+	std::cerr << "Cannot watch " << directory_ << ": " << strerror(errno) << "\n";
+	return -1;
+      }
+
+      read_event_ = event_new(base_, fd_, EV_READ | EV_PERSIST, &file_watcher::libevent_read, this);
+      settle_timer_ = evtimer_new(base_, &file_watcher::libevent_settled, this);
+      event_add(read_event_, NULL);
+    }
+
+    event_base *base = base_;
+    thread_ = std::thread([base]() {
+	event_base_loop(base, EVLOOP_NO_EXIT_ON_EMPTY);
+      });
+    return 0;
+  }
+
+  void file_watcher::stop() {
+    if (!thread_.joinable()) {
+      return;
+    }
+    event_base_loopexit(base_, NULL);
+    thread_.join();
+  }
+
+  void file_watcher::on_read() {
+    // Room for at least one event with the longest name.
+    alignas(inotify_event) char buffer[sizeof(inotify_event) + NAME_MAX + 1];
+    bool changed = false;
+    while (true) {
+      ssize_t n = read(fd_, buffer, sizeof(buffer));
+      if (n <= 0) {
+	break;
+      }
+      for (char *p = buffer; p < buffer + n; ) {
+	const inotify_event *e = reinterpret_cast<const inotify_event*>(p);
+	if (e->len > 0 && name_ == e->name) {
+	  changed = true;
+	}
+	p += sizeof(inotify_event) + e->len;
+      }
+    }
+
+    if (changed) {
+      // Wait for the rest of the save before reading the file.
+      timeval settle{0, settle_ms * 1000};
+      evtimer_add(settle_timer_, &settle);
+    }
+  }
+
+}
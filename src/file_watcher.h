@@ -0,0 +1,60 @@
+#pragma once
+
+#include <event2/event.h>
+#include <functional>
+#include <string>
+#include <thread>
+
+namespace cryptom {
+
+  /*
+    Calls a function when a file was written, with inotify. The directory of the file
+    is watched rather than the file itself, so that the editors which save by renaming
+    a new file over the old one are seen too. The events of one save (truncate, write,
+    close, rename) are gathered: the function is called once they stopped for
+    settle_ms.
+
+    Runs its own event loop, the function is called in its thread. Linux only.
+  */
+  class file_watcher {
+
+  public:
+    static const long settle_ms = 100;
+
+    file_watcher(const std::string& path, std::function<void()> changed);
+    ~file_watcher();
+
+    // no copy or assignement
+    file_watcher(const file_watcher&) = delete;
+    file_watcher& operator=(const file_watcher&) = delete;
+
+    /**
+       Watch the file and start the thread of the event loop. Will return 0 if ok.
+     */
+    int start();
+
+    // Stop the event loop and wait for the thread.
+    void stop();
+
+  private:
+    std::string directory_;
+    std::string name_;
+    std::function<void()> changed_;
+
+    int fd_;
+    event_base *base_;
+    event *read_event_;
+    event *settle_timer_;
+    std::thread thread_;
+
+    void on_read();
+
+    static void libevent_read(evutil_socket_t fd, short what, void *arg) {
+      static_cast<file_watcher*>(arg)->on_read();
+    }
+    static void libevent_settled(evutil_socket_t fd, short what, void *arg) {
+      static_cast<file_watcher*>(arg)->changed_();
+    }
+  };
+
+}
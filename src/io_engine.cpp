@@ -0,0 +1,500 @@
+#include "io_engine.h"
+#include <event2/thread.h>
+
+#include <stdio.h>
+#include <algorithm>
+#include <iostream>
+
+namespace cryptom {
+
+  io_engine::shard::shard(size_t index, tls_context *tls, const dns_options& dns):
+    index(index),
+    base(event_base_new()),
+    wheel(base != nullptr ? new timer_wheel(base) : nullptr),
+    dns(base != nullptr ? new dns_cache(base, dns) : nullptr),
+    pool(new connection_pool(base, tls, this->dns.get())),
+    lag_timer(nullptr),
+    lag_us(0) {
+  }
+
+  io_engine::shard::~shard() {
+    // The clients use the schedulers, the pool and the event loop, the schedulers use
+    // the wheel, the pool uses the DNS cache and the event loop.
+    clients.clear();
+    streams.clear();
+    schedulers.clear();
+    wheel.reset();
+    pool.reset();
+    dns.reset();
+
+    if (lag_timer != nullptr)
+      event_free(lag_timer);
+
+    if (base != nullptr)
+      event_base_free(base);
+  }
+
+  io_engine::io_engine(size_t nb_loops, tls_context *tls, const dns_options& dns,
+		       ticker_channel *out_queue):
+    tls_(tls),
+    out_queue_(out_queue),
+    rebalance_timer_(nullptr),
+    rebalance_cooldown_(0),
+    started_(false) {
+
+    // The loops talk to each other (event_base_once, event_base_loopexit) from
+    // other threads.
+    evthread_use_pthreads();
+
+    nb_loops = loops_for(nb_loops);
+    for (size_t i = 0; i < nb_loops; i++) {
+      shards_.emplace_back(new shard(i, tls, dns));
+      if (shards_.back()->base == nullptr) {
+	perror("event_base_new()");
+	exit(1);
+      }
+    }
+  }
+
+  io_engine::~io_engine() {
+    stop();
+
+    if (rebalance_timer_ != nullptr)
+      event_free(rebalance_timer_);
+  }
+
+  size_t io_engine::loops_for(size_t configured) {
+    if (configured > 0) {
+      return configured;
+    }
+
+    size_t cores = std::thread::hardware_concurrency();
+    return cores > 0 ? cores : 1;
+  }
+
+  bool io_engine::host_of(const std::string& url, std::string& host) {
+    evhttp_uri *uri = evhttp_uri_parse(url.c_str());
+    if (uri == NULL) {
+      std::cerr << "Invalid url " << url << "\n";
+      return false;
+    }
+    host = evhttp_uri_get_host(uri) != NULL ? evhttp_uri_get_host(uri) : "";
+    evhttp_uri_free(uri);
+    return true;
+  }
+
+  size_t io_engine::place(const std::string& host) {
+    ++host_clients_[host];
+
+    // All the clients of a host go to the same loop. New hosts go to the loop with the
+    // fewest clients.
+    auto it = host_shard_.find(host);
+    if (it != host_shard_.end()) {
+      return it->second;
+    }
+
+    std::vector<size_t> nb_clients(shards_.size(), 0);
+    for (const auto& entry: host_shard_) {
+      nb_clients[entry.second] += host_clients_[entry.first];
+    }
+    size_t index = 0;
+    for (size_t i = 1; i < shards_.size(); i++) {
+      if (nb_clients[i] < nb_clients[index]) {
+	index = i;
+      }
+    }
+    host_shard_[host] = index;
+    return index;
+  }
+
+  void io_engine::add_client(client_spec spec) {
+    std::string host;
+    if (!host_of(spec.url, host)) {
+      return;
+    }
+
+    if (!started_) {
+      shards_[place(host)]->specs[host].push_back(std::move(spec));
+      return;
+    }
+
+    // The hosts are placed by the first loop, then the client is created by its loop.
+    run_in_loop(shards_[0]->base, [this, host, spec]() {
+	when_placed(host, [this, host, spec]() {
+	    shard *s = shards_[place(host)].get();
+	    run_in_loop(s->base, [this, s, host, spec]() {
+		s->specs[host].push_back(spec);
+		create_clients(*s, host, {spec});
+	      });
+	  });
+      });
+  }
+
+  void io_engine::remove_client(const std::string& url) {
+    std::string host;
+    if (!host_of(url, host)) {
+      return;
+    }
+
+    auto remove = [this, host, url](bool started) {
+      auto it = host_shard_.find(host);
+      if (it == host_shard_.end() || host_clients_[host] == 0) {
+	std::cerr << "No client for " << url << "\n";
+	return;
+      }
+      // The host keeps its loop and its scheduler, for the clients to come.
+      --host_clients_[host];
+      shard *s = shards_[it->second].get();
+      if (!started) {
+	remove_client(*s, host, url);
+	return;
+      }
+      run_in_loop(s->base, [this, s, host, url]() {
+	  remove_client(*s, host, url);
+	});
+    };
+
+    if (!started_) {
+      remove(false);
+    } else {
+      run_in_loop(shards_[0]->base, [this, host, remove]() {
+	  when_placed(host, [remove]() { remove(true); });
+	});
+    }
+  }
+
+  void io_engine::remove_client(shard& s, const std::string& host, const std::string& url) {
+    std::vector<client_spec>& specs = s.specs[host];
+    auto spec = std::find_if(specs.begin(), specs.end(),
+			     [&url](const client_spec& spec) { return spec.url == url; });
+    if (spec == specs.end()) {
+      // Moved to another loop meanwhile.
+      std::cerr << "No client for " << url << " in loop " << s.index << "\n";
+      return;
+    }
+    specs.erase(spec);
+
+    auto client = s.clients[host].find(url);
+    if (client != s.clients[host].end()) {
+      s.clients[host].erase(client);
+    } else {
+      auto stream = s.streams[host].find(url);
+      if (stream != s.streams[host].end()) {
+	s.streams[host].erase(stream);
+      }
+    }
+    std::cout << "Removed client for " << url << " in loop " << s.index << std::endl;
+  }
+
+  void io_engine::update_client(client_spec spec) {
+    std::string host;
+    if (!host_of(spec.url, host)) {
+      return;
+    }
+
+    if (!started_) {
+      auto it = host_shard_.find(host);
+      if (it != host_shard_.end()) {
+	update_client(*shards_[it->second], host, spec);
+      }
+      return;
+    }
+    run_in_loop(shards_[0]->base, [this, host, spec]() {
+	when_placed(host, [this, host, spec]() {
+	    auto it = host_shard_.find(host);
+	    if (it == host_shard_.end()) {
+	      std::cerr << "No client for " << spec.url << "\n";
+	      return;
+	    }
+	    shard *s = shards_[it->second].get();
+	    run_in_loop(s->base, [this, s, host, spec]() {
+		update_client(*s, host, spec);
+	      });
+	  });
+      });
+  }
+
+  void io_engine::update_client(shard& s, const std::string& host, const client_spec& spec) {
+    std::vector<client_spec>& specs = s.specs[host];
+    auto running = std::find_if(specs.begin(), specs.end(),
+				[&spec](const client_spec& other) { return other.url == spec.url; });
+    if (running == specs.end()) {
+      std::cerr << "No client for " << spec.url << " in loop " << s.index << "\n";
+      return;
+    }
+    running->symbols = spec.symbols;
+
+    // Not created yet before start().
+    auto client = s.clients[host].find(spec.url);
+    if (client != s.clients[host].end()) {
+      client->second->set_symbols(spec.symbols);
+    } else {
+      auto stream = s.streams[host].find(spec.url);
+      if (stream != s.streams[host].end()) {
+	stream->second->set_symbols(spec.symbols);
+      }
+    }
+    std::cout << "Updated the " << spec.symbols.size() << " symbols of " << spec.url
+	      << " in loop " << s.index << std::endl;
+  }
+
+  void io_engine::create_clients(shard& s, const std::string& host, const std::vector<client_spec>& specs) {
+    std::multimap<std::string, std::unique_ptr<scheduled_client>>& clients = s.clients[host];
+    std::multimap<std::string, std::unique_ptr<websocket_client>>& streams = s.streams[host];
+    for (const client_spec& spec: specs) {
+      stage_histograms *&metrics = s.metrics[spec.exchange];
+      if (metrics == nullptr) {
+	metrics = metrics_registry::global().add_writer(spec.exchange);
+      }
+
+      if (spec.streaming) {
+	std::unique_ptr<stream_protocol> protocol = make_stream_protocol(spec.exchange);
+	if (protocol == nullptr) {
+	  std::cerr << "Unknown exchange " << spec.exchange << "\n";
+	  continue;
+	}
+
+	std::cout << "Will stream from " << spec.url << " in loop " << s.index << std::endl;
+	streams.emplace(spec.url, std::unique_ptr<websocket_client>(
+			  new websocket_client(s.base, spec.url.c_str(), tls_, s.dns.get(),
+					       std::move(protocol), spec.symbols,
+					       out_queue_, s.index, metrics)));
+	continue;
+      }
+
+      // One scheduler for all the clients of the host, with the limits of its exchange.
+      std::unique_ptr<request_scheduler>& scheduler = s.schedulers[host];
+      if (scheduler == nullptr) {
+	auto limit = rate_limits_.find(host);
+	scheduler.reset(new request_scheduler(s.wheel.get(),
+					      limit != rate_limits_.end() ? limit->second : rate_limit_of(spec.exchange),
+					      host));
+      }
+
+      std::unique_ptr<scheduled_client> client =
+	make_scheduled_client(spec.exchange, s.base, spec.url.c_str(), spec.duration,
+			      scheduler.get(), s.pool.get(), spec.symbols, out_queue_, s.index, metrics,
+			      spec.hedge);
+      if (client == nullptr) {
+	std::cerr << "Unknown exchange " << spec.exchange << "\n";
+	continue;
+      }
+
+      std::cout << "Will create client for " << spec.url << " in loop " << s.index << std::endl;
+      clients.emplace(spec.url, std::move(client));
+    }
+  }
+
+  void io_engine::set_timeouts(const request_timeouts& timeouts) {
+    for (auto& s: shards_) {
+      s->pool->set_timeouts(timeouts);
+    }
+  }
+
+  void io_engine::start() {
+    if (started_) {
+      return;
+    }
+    started_ = true;
+
+    for (auto& s: shards_) {
+      for (const auto& entry: s->specs) {
+	create_clients(*s, entry.first, entry.second);
+      }
+
+      timeval interval{0, lag_interval_us};
+      s->lag_timer = event_new(s->base, -1, EV_PERSIST, &io_engine::libevent_lag_tick, s.get());
+      s->last_tick = std::chrono::steady_clock::now();
+      evtimer_add(s->lag_timer, &interval);
+    }
+
+    if (shards_.size() > 1) {
+      timeval interval{1, 0};
+      rebalance_timer_ = event_new(shards_[0]->base, -1, EV_PERSIST, &io_engine::libevent_rebalance, this);
+      evtimer_add(rebalance_timer_, &interval);
+    }
+
+    for (auto& s: shards_) {
+      event_base *base = s->base;
+      s->thread = std::thread([base]() {
+	  event_base_dispatch(base);
+	});
+    }
+  }
+
+  void io_engine::stop() {
+    if (!started_) {
+      return;
+    }
+    started_ = false;
+
+    for (auto& s: shards_) {
+      event_base_loopexit(s->base, NULL);
+    }
+
+    for (auto& s: shards_) {
+      if (s->thread.joinable())
+	s->thread.join();
+    }
+  }
+
+  connection_pool::stats io_engine::pool_stats() const {
+    connection_pool::stats total;
+    for (const auto& s: shards_) {
+      const connection_pool::stats& stats = s->pool->get_stats();
+      total.requests += stats.requests;
+      total.handshakes += stats.handshakes;
+      total.reused += stats.reused;
+    }
+    return total;
+  }
+
+  dns_cache::stats io_engine::dns_stats() const {
+    dns_cache::stats total;
+    for (const auto& s: shards_) {
+      const dns_cache::stats& stats = s->dns->get_stats();
+      total.hits += stats.hits;
+      total.misses += stats.misses;
+      total.resolutions += stats.resolutions;
+      total.prefetches += stats.prefetches;
+      total.failures += stats.failures;
+    }
+    return total;
+  }
+
+  request_scheduler::stats io_engine::scheduler_stats() const {
+    request_scheduler::stats total;
+    for (const auto& s: shards_) {
+      for (const auto& entry: s->schedulers) {
+	const request_scheduler::stats& stats = entry.second->get_stats();
+	total.requests += stats.requests;
+	total.throttled += stats.throttled;
+	total.skipped += stats.skipped;
+	total.pauses += stats.pauses;
+	total.failures += stats.failures;
+	total.timeouts += stats.timeouts;
+	total.retries += stats.retries;
+	total.breaker_opens += stats.breaker_opens;
+	total.hedges += stats.hedges;
+	total.hedges_won += stats.hedges_won;
+	total.hedges_throttled += stats.hedges_throttled;
+      }
+    }
+    return total;
+  }
+
+  void io_engine::libevent_lag_tick(evutil_socket_t fd, short what, void *arg) {
+    shard *s = static_cast<shard*>(arg);
+
+    auto now = std::chrono::steady_clock::now();
+    long elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - s->last_tick).count();
+    s->last_tick = now;
+
+    // How late the timer fired, smoothed over the last ticks.
+    long late = elapsed > lag_interval_us ? elapsed - lag_interval_us : 0;
+    long lag = s->lag_us.load(std::memory_order_relaxed);
+    s->lag_us.store((lag * 7 + late) / 8, std::memory_order_relaxed);
+  }
+
+  void io_engine::rebalance() {
+    if (rebalance_cooldown_ > 0) {
+      --rebalance_cooldown_;
+      return;
+    }
+
+    // Number of hosts in each loop.
+    std::vector<size_t> nb_hosts(shards_.size(), 0);
+    for (const auto& entry: host_shard_) {
+      ++nb_hosts[entry.second];
+    }
+
+    size_t slowest = 0, fastest = 0;
+    for (size_t i = 1; i < shards_.size(); i++) {
+      if (shards_[i]->lag_us.load() > shards_[slowest]->lag_us.load())
+	slowest = i;
+      if (shards_[i]->lag_us.load() < shards_[fastest]->lag_us.load())
+	fastest = i;
+    }
+
+    // Moving the only host of a loop would just move the lag.
+    if (shards_[slowest]->lag_us.load() < lag_threshold_us ||
+	shards_[fastest]->lag_us.load() > lag_threshold_us / 2 ||
+	nb_hosts[slowest] < 2) {
+      return;
+    }
+
+    // Move the first host of the slow loop.
+    std::string host;
+    for (const auto& entry: host_shard_) {
+      if (entry.second == slowest && moving_.count(entry.first) == 0) {
+	host = entry.first;
+	break;
+      }
+    }
+
+    std::cerr << "Loop " << slowest << " lags by " << shards_[slowest]->lag_us.load()
+	      << "us, moving " << host << " to loop " << fastest << "\n";
+
+    if (host.empty()) {
+      return;
+    }
+
+    // The clients of the host are asked to the new loop from now on, once it has them.
+    host_shard_[host] = fastest;
+    moving_[host];
+    rebalance_cooldown_ = 5;
+
+    shard *from = shards_[slowest].get();
+    shard *to = shards_[fastest].get();
+    run_in_loop(from->base, [this, from, to, host]() {
+	// Requests in flight are cancelled with the clients. The budget of the host
+	// starts again in the new loop.
+	from->clients.erase(host);
+	from->streams.erase(host);
+	from->schedulers.erase(host);
+	std::vector<client_spec> specs = std::move(from->specs[host]);
+	from->specs.erase(host);
+
+	run_in_loop(to->base, [this, to, host, specs]() {
+	    std::vector<client_spec>& running = to->specs[host];
+	    running.insert(running.end(), specs.begin(), specs.end());
+	    create_clients(*to, host, specs);
+	    run_in_loop(shards_[0]->base, [this, host]() { moved(host); });
+	  });
+      });
+  }
+
+  void io_engine::when_placed(const std::string& host, std::function<void()> function) {
+    auto it = moving_.find(host);
+    if (it != moving_.end()) {
+      it->second.push_back(std::move(function));
+      return;
+    }
+    function();
+  }
+
+  void io_engine::moved(const std::string& host) {
+    auto it = moving_.find(host);
+    if (it == moving_.end()) {
+      return;
+    }
+    std::vector<std::function<void()>> waiting = std::move(it->second);
+    moving_.erase(it);
+    for (auto& function: waiting) {
+      function();
+    }
+  }
+
+  void io_engine::run_in_loop(event_base *base, std::function<void()> function) {
+    std::function<void()> *arg = new std::function<void()>(std::move(function));
+    if (event_base_once(base, -1, EV_TIMEOUT, &io_engine::libevent_run, arg, NULL) != 0) {
+      delete arg;
+    }
+  }
+
+  void io_engine::libevent_run(evutil_socket_t fd, short what, void *arg) {
+    std::unique_ptr<std::function<void()>> function(static_cast<std::function<void()>*>(arg));
+    (*function)();
+  }
+
+}
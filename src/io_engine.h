@@ -0,0 +1,199 @@
+#pragma once
+
+#include <event2/event.h>
+#include "connection_pool.h"
+#include "dns_cache.h"
+#include "metrics.h"
+#include "request_scheduler.h"
+#include "timer_wheel.h"
+#include "scheduled_client.h"
+#include "ticker_channel.h"
+#include "tls_context.h"
+#include "websocket_client.h"
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cryptom {
+
+  /*
+    What is needed to create a scheduled_client, in any event loop.
+  */
+  struct client_spec {
+    std::string url;
+    // "binance" or "kucoin", see make_scheduled_client.
+    std::string exchange;
+    symbol_map symbols;
+    timeval duration;
+    // Stream the tickers from a WebSocket url (ws:// or wss://) instead of polling the
+    // url every duration.
+    bool streaming = false;
+    // Send a slow request again on a second connection, see basic_scheduled_client.
+    bool hedge = false;
+  };
+
+  /*
+    Runs the scheduled clients on N event loops, each in its own thread. The clients
+    are sharded by exchange host: all the clients of a host run in the same loop and
+    share its connection pool and the request_scheduler of the host, which keeps them
+    within the rate limits of the exchange. Each loop publishes on its own lane of the
+    channel, and times the stages of its requests in histograms of its own.
+
+    A monitor measures how late the timers of each loop fire. When a loop lags, one of
+    its hosts is moved to the loop with the least lag.
+  */
+  class io_engine {
+
+  public:
+    // nb_loops = 0 means one loop per core. The channel must have one lane per loop.
+    io_engine(size_t nb_loops, tls_context *tls, const dns_options& dns, ticker_channel *out_queue);
+    ~io_engine();
+
+    // no copy or assignement
+    io_engine(const io_engine&) = delete;
+    io_engine& operator=(const io_engine&) = delete;
+
+    size_t size() const { return shards_.size(); }
+
+    // Number of loops to use for the given configuration value (0 = number of cores).
+    static size_t loops_for(size_t configured);
+
+    /**
+       Add a client. Once started, the client is created in its loop a moment later,
+       without disturbing the other clients. Can be called from any thread.
+     */
+    void add_client(client_spec spec);
+
+    /**
+       Remove a client of the url (one of them if several were added), with its request
+       in flight. The connections of the host stay in the pool. Can be called from any
+       thread.
+     */
+    void remove_client(const std::string& url);
+
+    /**
+       Give the symbols of the spec to the running client of its url, in its loop. The
+       client keeps its connection: a stream only subscribes to the symbols added and
+       unsubscribes from the ones removed. Can be called from any thread.
+     */
+    void update_client(client_spec spec);
+
+    /**
+       Use the given limits for the requests to a host instead of the ones of its
+       exchange, e.g. for a mock exchange. Must be called before start().
+     */
+    void set_rate_limit(const std::string& host, const rate_limit& limit) { rate_limits_[host] = limit; }
+
+    // Timeouts of the requests of all the loops. Must be called before start().
+    void set_timeouts(const request_timeouts& timeouts);
+
+    // Start the threads of the event loops.
+    void start();
+
+    // Stop the event loops and wait for the threads.
+    void stop();
+
+    // Sum of the statistics of the connection pools. Only once the engine is stopped.
+    connection_pool::stats pool_stats() const;
+
+    // Sum of the statistics of the DNS caches. Only once the engine is stopped.
+    dns_cache::stats dns_stats() const;
+
+    // Sum of the statistics of the request schedulers. Only once the engine is stopped.
+    request_scheduler::stats scheduler_stats() const;
+
+  private:
+
+    struct shard {
+      shard(size_t index, tls_context *tls, const dns_options& dns);
+      ~shard();
+
+      size_t index;
+      event_base *base;
+      std::thread thread;
+
+      // Timers of the request schedulers of this loop.
+      std::unique_ptr<timer_wheel> wheel;
+
+      // Addresses of the hosts of this loop.
+      std::unique_ptr<dns_cache> dns;
+
+      // Connections of the clients of this loop.
+      std::unique_ptr<connection_pool> pool;
+
+      // Clients of each host running in this loop, by url, and what is needed to
+      // recreate them in another loop. Only used by the thread of the loop once started.
+      std::map<std::string, std::vector<client_spec>> specs;
+      std::map<std::string, std::unique_ptr<request_scheduler>> schedulers;
+      std::map<std::string, std::multimap<std::string, std::unique_ptr<scheduled_client>>> clients;
+      std::map<std::string, std::multimap<std::string, std::unique_ptr<websocket_client>>> streams;
+
+      // Histograms of the stages of the clients of each exchange, written by the thread
+      // of this loop. Owned by metrics_registry::global().
+      std::map<std::string, stage_histograms*> metrics;
+
+      // Timer measuring the lag of the loop.
+      event *lag_timer;
+      std::chrono::steady_clock::time_point last_tick;
+      // Smoothed lag of the timers of this loop, in microseconds.
+      std::atomic<long> lag_us;
+    };
+
+    // How often the lag is measured, and how late a loop must be to move a host.
+    static const long lag_interval_us = 100000;
+    static const long lag_threshold_us = 20000;
+
+    tls_context *tls_;
+    ticker_channel *out_queue_;
+    std::vector<std::unique_ptr<shard>> shards_;
+
+    // Limits set for some hosts, instead of rate_limit_of their exchange.
+    std::map<std::string, rate_limit> rate_limits_;
+
+    // Loop and number of clients of each host. Only used by the thread of the first
+    // loop once started.
+    std::map<std::string, size_t> host_shard_;
+    std::map<std::string, size_t> host_clients_;
+
+    // Hosts being moved to another loop, with the additions and removals of their
+    // clients asked meanwhile. They are run once the clients exist in the new loop.
+    // Only used by the thread of the first loop.
+    std::map<std::string, std::vector<std::function<void()>>> moving_;
+
+    // Rebalancing check, run in the first loop. After a move, we wait for the lag of
+    // the loops to be measured again before moving another host.
+    event *rebalance_timer_;
+    int rebalance_cooldown_;
+
+    bool started_;
+
+    // Host of the url, false if the url is invalid.
+    static bool host_of(const std::string& url, std::string& host);
+    // Loop of the host, chosen for a new host. Counts a new client of the host.
+    size_t place(const std::string& host);
+
+    void create_clients(shard& s, const std::string& host, const std::vector<client_spec>& specs);
+    void remove_client(shard& s, const std::string& host, const std::string& url);
+    void update_client(shard& s, const std::string& host, const client_spec& spec);
+    void rebalance();
+    // Run the function in the first loop now, or once the host has moved.
+    void when_placed(const std::string& host, std::function<void()> function);
+    // The clients of the host were created in their new loop.
+    void moved(const std::string& host);
+
+    // Run the function in the thread of the event loop.
+    static void run_in_loop(event_base *base, std::function<void()> function);
+    static void libevent_run(evutil_socket_t fd, short what, void *arg);
+
+    static void libevent_lag_tick(evutil_socket_t fd, short what, void *arg);
+    static void libevent_rebalance(evutil_socket_t fd, short what, void *arg) {
+      static_cast<io_engine*>(arg)->rebalance();
+    }
+  };
+
+}
@@ -0,0 +1,154 @@
+#include "json_arena.h"
+
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <set>
+
+namespace cryptom {
+
+  namespace {
+
+    // All the arenas of the process, for usage_by_label.
+    std::mutex& registry_mutex() {
+      static std::mutex mutex;
+      return mutex;
+    }
+
+    std::set<const json_arena*>& registry() {
+      static std::set<const json_arena*> arenas;
+      return arenas;
+    }
+
+    // First capacity of the parse stack, the default of rapidjson.
+    const size_t initial_stack_size = 1024;
+
+    // Capacity to give to a buffer which needed used bytes, with some margin.
+    size_t grown(size_t capacity, size_t used) {
+      size_t wanted = used + used / 4;
+      return std::max(capacity, (wanted + 4095) & ~static_cast<size_t>(4095));
+    }
+
+  }
+
+  json_arena::json_arena(const char *label, size_t capacity, size_t stack_capacity):
+    label_(label),
+    capacity_(capacity),
+    stack_capacity_(stack_capacity),
+    peak_(0),
+    stack_peak_(0),
+    parses_(0),
+    overflows_(0),
+    pullups_(0),
+    usable_(0),
+    stack_usable_(0),
+    grow_(false),
+    parsed_at_(0) {
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    registry().insert(this);
+  }
+
+  json_arena::~json_arena() {
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    registry().erase(this);
+  }
+
+  void json_arena::allocate() {
+    // The document uses the allocators, which use the buffers.
+    document_.reset();
+    allocator_.reset();
+    stack_allocator_.reset();
+
+    if (grow_) {
+      capacity_.store(grown(capacity_.load(std::memory_order_relaxed), peak_.load(std::memory_order_relaxed)),
+		      std::memory_order_relaxed);
+      stack_capacity_.store(grown(stack_capacity_.load(std::memory_order_relaxed),
+				  stack_peak_.load(std::memory_order_relaxed)),
+			    std::memory_order_relaxed);
+      grow_ = false;
+    }
+
+    size_t capacity = capacity_.load(std::memory_order_relaxed);
+    size_t stack_capacity = stack_capacity_.load(std::memory_order_relaxed);
+    buffer_.reset(new char[capacity]);
+    stack_buffer_.reset(new char[stack_capacity]);
+    allocator_.reset(new allocator_type(buffer_.get(), capacity));
+    stack_allocator_.reset(new allocator_type(stack_buffer_.get(), stack_capacity));
+    document_.reset(new document_type(allocator_.get(), initial_stack_size,
+				      stack_allocator_.get()));
+
+    // What the buffers hold once the headers of rapidjson are taken out. More means
+    // that rapidjson took chunks from the heap.
+    usable_ = allocator_->Capacity();
+    stack_usable_ = stack_allocator_->Capacity();
+  }
+
+  json_arena::document_type& json_arena::parse_insitu(char *text) {
+    if (document_ == nullptr || grow_) {
+      allocate();
+    } else {
+      // The allocators free nothing, so the values of the previous document are only
+      // forgotten before the arenas are reset.
+      document_->SetNull();
+      allocator_->Clear();
+      stack_allocator_->Clear();
+    }
+
+    document_->ParseInsitu(text);
+    parsed_at_ = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    size_t used = allocator_->Size();
+    size_t stack_used = stack_allocator_->Size();
+    parses_.fetch_add(1, std::memory_order_relaxed);
+    if (used > peak_.load(std::memory_order_relaxed)) {
+      peak_.store(used, std::memory_order_relaxed);
+    }
+    if (stack_used > stack_peak_.load(std::memory_order_relaxed)) {
+      stack_peak_.store(stack_used, std::memory_order_relaxed);
+    }
+
+    if (allocator_->Capacity() > usable_ || stack_allocator_->Capacity() > stack_usable_) {
+      overflows_.fetch_add(1, std::memory_order_relaxed);
+      grow_ = true;
+    }
+
+    return *document_;
+  }
+
+  json_arena::usage json_arena::get_usage() const {
+    usage u;
+    u.capacity = capacity_.load(std::memory_order_relaxed);
+    u.stack_capacity = stack_capacity_.load(std::memory_order_relaxed);
+    u.peak = peak_.load(std::memory_order_relaxed);
+    u.stack_peak = stack_peak_.load(std::memory_order_relaxed);
+    u.parses = parses_.load(std::memory_order_relaxed);
+    u.overflows = overflows_.load(std::memory_order_relaxed);
+    u.pullups = pullups_.load(std::memory_order_relaxed);
+    return u;
+  }
+
+  std::map<std::string, json_arena::usage> json_arena::usage_by_label() {
+    std::map<std::string, usage> result;
+
+    std::lock_guard<std::mutex> lock(registry_mutex());
+    for (const json_arena *arena: registry()) {
+      usage u = arena->get_usage();
+      // Arenas which never parsed have no buffers.
+      if (u.parses == 0) {
+	continue;
+      }
+
+      usage& total = result[arena->label_];
+      total.capacity += u.capacity;
+      total.stack_capacity += u.stack_capacity;
+      total.peak = std::max(total.peak, u.peak);
+      total.stack_peak = std::max(total.stack_peak, u.stack_peak);
+      total.parses += u.parses;
+      total.overflows += u.overflows;
+      total.pullups += u.pullups;
+    }
+    return result;
+  }
+
+}
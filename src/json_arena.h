@@ -0,0 +1,113 @@
+#pragma once
+
+#include "rapidjson/document.h"
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+
+namespace cryptom {
+
+  /*
+    Memory of the rapidjson documents of one client, reused from one response to the
+    next: the values go to an arena and the parse stack to a second one, both in
+    buffers allocated once. Once the buffers are large enough for the documents of
+    the exchange, parsing does not call malloc.
+
+    When a document does not fit, rapidjson takes more chunks from the heap. The next
+    parse grows the buffers to the size which was needed, so this only happens while
+    the arena warms up. The usage of the arenas is reported per label (exchange) to
+    choose the initial capacity.
+
+    Not thread safe: one arena per client, used by the thread of its event loop.
+  */
+  class json_arena {
+
+  public:
+    typedef rapidjson::MemoryPoolAllocator<> allocator_type;
+    // The stack allocator frees nothing, the stack is reset with the arena.
+    typedef rapidjson::GenericDocument<rapidjson::UTF8<>, allocator_type, allocator_type> document_type;
+
+    static const size_t default_capacity = 64 * 1024;
+    static const size_t default_stack_capacity = 4 * 1024;
+
+    // The buffers are allocated at the first parse.
+    explicit json_arena(const char *label,
+			size_t capacity = default_capacity,
+			size_t stack_capacity = default_stack_capacity);
+    ~json_arena();
+
+    // no copy or assignement
+    json_arena(const json_arena&) = delete;
+    json_arena& operator=(const json_arena&) = delete;
+
+    /*
+      Parse the text in situ (it is modified and the strings of the document point to
+      it). The previous document of the arena is dropped. The document is valid until
+      the next parse, check HasParseError.
+    */
+    document_type& parse_insitu(char *text);
+
+    // When the last parse finished, steady clock in nanoseconds (see receive_time).
+    // 0 before the first parse.
+    int64_t parsed_at() const { return parsed_at_; }
+
+    // The text of the next parse had to be copied into one block first (evbuffer_pullup).
+    void count_pullup() { pullups_.fetch_add(1, std::memory_order_relaxed); }
+
+    struct usage {
+      // Bytes of the buffers of the values and of the stack.
+      size_t capacity = 0;
+      size_t stack_capacity = 0;
+      // Most bytes used by one document.
+      size_t peak = 0;
+      size_t stack_peak = 0;
+      unsigned long parses = 0;
+      // Parses which needed memory from the heap.
+      unsigned long overflows = 0;
+      // Parses of a text which was not contiguous, see count_pullup.
+      unsigned long pullups = 0;
+    };
+
+    usage get_usage() const;
+
+    /*
+      Usage of all the arenas of the process, by label: the capacities, parses and
+      overflows are summed, the peaks are the largest. Can be called from any thread.
+    */
+    static std::map<std::string, usage> usage_by_label();
+
+  private:
+    std::string label_;
+
+    std::unique_ptr<char[]> buffer_;
+    std::unique_ptr<char[]> stack_buffer_;
+    std::unique_ptr<allocator_type> allocator_;
+    std::unique_ptr<allocator_type> stack_allocator_;
+    std::unique_ptr<document_type> document_;
+
+    // Read by usage_by_label from other threads.
+    std::atomic<size_t> capacity_;
+    std::atomic<size_t> stack_capacity_;
+    std::atomic<size_t> peak_;
+    std::atomic<size_t> stack_peak_;
+    std::atomic<unsigned long> parses_;
+    std::atomic<unsigned long> overflows_;
+    std::atomic<unsigned long> pullups_;
+
+    // Bytes of the buffers rapidjson can use. The allocators have more capacity when
+    // they took chunks from the heap.
+    size_t usable_;
+    size_t stack_usable_;
+
+    // The last document did not fit, grow the buffers before the next one.
+    bool grow_;
+
+    int64_t parsed_at_;
+
+    // (Re)allocate the buffers with the current capacities.
+    void allocate();
+  };
+
+}
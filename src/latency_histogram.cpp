@@ -0,0 +1,70 @@
+#include "latency_histogram.h"
+
+#include <algorithm>
+
+namespace cryptom {
+
+  const int latency_histogram::sub_bucket_bits;
+  const int latency_histogram::sub_buckets;
+  const int latency_histogram::max_exponent;
+  const size_t latency_histogram::nb_buckets;
+
+  latency_histogram::latency_histogram():
+    sum_(0),
+    max_(0) {
+    for (std::atomic<uint64_t>& bucket: buckets_) {
+      bucket.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  uint64_t latency_histogram::upper_bound(size_t bucket) {
+    if (bucket < static_cast<size_t>(sub_buckets)) {
+      return bucket + 1;
+    }
+    int exponent = static_cast<int>(bucket / sub_buckets) + sub_bucket_bits - 1;
+    uint64_t sub = bucket % sub_buckets;
+    uint64_t width = uint64_t(1) << (exponent - sub_bucket_bits);
+    return (sub_buckets + sub + 1) * width;
+  }
+
+  void latency_histogram::snapshot::merge(const latency_histogram& h) {
+    for (size_t i = 0; i < nb_buckets; i++) {
+      uint64_t n = h.buckets_[i].load(std::memory_order_relaxed);
+      buckets[i] += n;
+      count += n;
+    }
+    sum += h.sum_.load(std::memory_order_relaxed);
+    uint64_t m = h.max_.load(std::memory_order_relaxed);
+    if (m > max) {
+      max = m;
+    }
+  }
+
+  uint64_t latency_histogram::snapshot::count_at_most(uint64_t ns) const {
+    uint64_t n = 0;
+    for (size_t i = 0; i < nb_buckets && upper_bound(i) <= ns + 1; i++) {
+      n += buckets[i];
+    }
+    return n;
+  }
+
+  uint64_t latency_histogram::snapshot::quantile(double q) const {
+    if (count == 0) {
+      return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * count);
+    if (rank >= count) {
+      rank = count - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t i = 0; i < nb_buckets; i++) {
+      seen += buckets[i];
+      if (seen > rank) {
+	// No more than the largest value, which is known exactly.
+	return std::min(upper_bound(i), max);
+      }
+    }
+    return max;
+  }
+
+}
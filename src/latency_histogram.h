@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace cryptom {
+
+  /*
+    Histogram of durations in nanoseconds, in the manner of HdrHistogram: the buckets
+    are linear within each power of two (16 sub-buckets), so any value is counted
+    within 1/16 of its magnitude, from 1ns to 18 minutes, in a few KiB.
+
+    One thread records, any thread reads. Recording is a few relaxed loads and stores
+    of the owner's counters, never a lock nor a read-modify-write instruction, so it is
+    wait-free. The readers may see a sample in its bucket before it is in the sum.
+  */
+  class latency_histogram {
+
+  public:
+    static const int sub_bucket_bits = 4;
+    static const int sub_buckets = 1 << sub_bucket_bits;
+    // Values of 2^max_exponent ns and more are counted in the last bucket.
+    static const int max_exponent = 40;
+    static const size_t nb_buckets = (max_exponent - sub_bucket_bits + 1) * sub_buckets;
+
+    latency_histogram();
+
+    // no copy or assignement
+    latency_histogram(const latency_histogram&) = delete;
+    latency_histogram& operator=(const latency_histogram&) = delete;
+
+    // Record a duration. Only from the thread which owns the histogram.
+    void record(int64_t ns) {
+      uint64_t value = ns > 0 ? static_cast<uint64_t>(ns) : 0;
+      std::atomic<uint64_t>& bucket = buckets_[bucket_of(value)];
+      bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+      sum_.store(sum_.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+      if (value > max_.load(std::memory_order_relaxed)) {
+	max_.store(value, std::memory_order_relaxed);
+      }
+    }
+
+    /*
+      Counts of a histogram, or of several merged, read from any thread.
+    */
+    struct snapshot {
+      uint64_t buckets[nb_buckets] = {};
+      uint64_t count = 0;
+      uint64_t sum = 0;
+      uint64_t max = 0;
+
+      // Add the counts of the histogram.
+      void merge(const latency_histogram& h);
+
+      // Number of samples of at most ns (within the precision of the buckets).
+      uint64_t count_at_most(uint64_t ns) const;
+
+      // Smallest value at or above the given fraction of the samples (0.99 for the
+      // 99th percentile): the upper bound of its bucket, or the largest value if
+      // smaller. 0 without samples.
+      uint64_t quantile(double q) const;
+    };
+
+    static size_t bucket_of(uint64_t ns) {
+      if (ns < static_cast<uint64_t>(sub_buckets)) {
+	return ns;
+      }
+      int exponent = 63 - __builtin_clzll(ns);
+      if (exponent >= max_exponent) {
+	return nb_buckets - 1;
+      }
+      // The sub-bucket is given by the bits after the highest one.
+      size_t sub = (ns >> (exponent - sub_bucket_bits)) & (sub_buckets - 1);
+      return (exponent - sub_bucket_bits + 1) * sub_buckets + sub;
+    }
+
+    // First value after the bucket.
+    static uint64_t upper_bound(size_t bucket);
+
+  private:
+    std::atomic<uint64_t> buckets_[nb_buckets];
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> max_;
+  };
+
+}
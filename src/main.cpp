@@ -1,7 +1,17 @@
 #include <iostream>
-#include "scheduled_client.h"
+#include "alert_engine.h"
+#include "currency_graph.h"
+#include "depth_feed.h"
+#include "file_watcher.h"
+#include "io_engine.h"
+#include "metrics.h"
+#include "portfolio.h"
+#include "rcu_pointer.h"
+#include "tick_log.h"
+#include "tick_store.h"
 #include <openssl/err.h>
 #include "rapidjson/document.h"
+#include <algorithm>
 #include <map>
 #include <iostream>
 #include <string>
@@ -9,17 +19,34 @@
 #include <sstream>
 #include <vector>
 #include <thread>
+#include <atomic>
+#include <csignal>
+#include <cstring>
 
 
-const std::string kucoin_base_url = "https://api.kucoin.com/v1/open/tick?symbol=";
-const std::string binance_base_url = "https://api.binance.com/api/v1/ticker/24hr?symbol=";
+const std::string kucoin_base_url = "https://api.kucoin.com/v1/open/tick";
+const std::string binance_base_url = "https://api.binance.com/api/v1/ticker/24hr";
+// The url of the kucoin feed has a token given by its bullet-public endpoint, so it
+// must be in the configuration.
+const std::string binance_stream_url = "wss://stream.binance.com:9443/ws";
+const std::string binance_depth_url = "https://api.binance.com/api/v1/depth";
+
+// Symbol of the market coin/base_coin on each exchange.
+std::string kucoin_symbol(std::string coin, std::string base_coin) {
+  return coin + "-" + base_coin;
+}
+
+std::string binance_symbol(std::string coin, std::string base_coin) {
+  return coin + base_coin;
+}
+
 std::string create_kurl(std::string coin, std::string base_coin) {
-  std::string url = kucoin_base_url + coin + "-" + base_coin;
+  std::string url = kucoin_base_url + "?symbol=" + kucoin_symbol(coin, base_coin);
   return url;
 }
 
 std::string create_burl(std::string coin, std::string base_coin) {
-  std::string url = binance_base_url + coin + base_coin;
+  std::string url = binance_base_url + "?symbol=" + binance_symbol(coin, base_coin);
   return url;
 }
 
@@ -29,8 +56,94 @@ std::string create_burl(std::string coin, std::string base_coin) {
 struct config {
   std::map<std::string, double> coins;
   std::string base_currency = "BTC";
+  // "binance" or "kucoin"
+  std::string exchange = "binance";
+  // Request the tickers of all the markets at once instead of one request per coin.
+  bool batch = false;
+  // Number of event loops (threads) for the clients. 0 means one per core.
+  size_t io_threads = 0;
+  // Receive the tickers from the WebSocket feed of the exchange instead of polling.
+  bool streaming = false;
+  // Url of the feed. Default for binance, required for kucoin.
+  std::string stream_url;
+  // Resolver of the exchange hosts. By default the nameservers of /etc/resolv.conf.
+  cryptom::dns_options dns;
+  // Smallest move of a value, in the base currency, shown to the user.
+  double value_epsilon = 1e-8;
+  // Currencies through which a coin without a market against the base currency is
+  // priced, e.g. FUN -> ETH -> BTC -> USDT.
+  std::vector<std::string> quote_assets = {"BTC", "ETH", "USDT", "BNB"};
+  // Directory of the log of the tickers received. Empty for no log.
+  std::string tick_log;
+  // Keep the order books of the markets of the coins against the base currency, to show
+  // what selling the holdings at once would give. binance only.
+  bool depth = false;
+  // Endpoint of the depth snapshots. The diffs come from stream_url.
+  std::string depth_url = binance_depth_url;
+  // Alerts on the market coin/base_coin of each coin. The symbols of the rules are set
+  // once the markets are known.
+  std::vector<std::pair<std::string, cryptom::alert_rule>> alerts;
+  // Local port of the Prometheus metrics (http://127.0.0.1:port/metrics). 0 for none.
+  int metrics_port = 0;
+  // Longest connection, TLS handshake and wait for a response of the polled requests.
+  cryptom::request_timeouts timeouts;
+  // Send the requests slower than usual again on a second connection.
+  bool hedge = false;
+};
+
+// Symbol of the market coin/quote on the exchange of the configuration.
+std::string market_symbol(const config& config, const std::string& coin, const std::string& quote) {
+  return config.exchange == "kucoin" ? kucoin_symbol(coin, quote) : binance_symbol(coin, quote);
+}
+
+struct market_pair {
+  std::string symbol;
+  std::string coin;
+  std::string quote;
 };
 
+/*
+  Markets which may price the coins in the base currency. Polling one market per
+  request, only the markets coin/base_currency. Otherwise, the markets of the coins
+  against the quote assets and the base currency, and the markets between them: the
+  ones which do not exist on the exchange are never updated.
+ */
+std::vector<market_pair> candidate_markets(const config& config) {
+  std::vector<market_pair> markets;
+  auto add = [&config, &markets](const std::string& coin, const std::string& quote) {
+    if (coin != quote) {
+      markets.push_back(market_pair{market_symbol(config, coin, quote), coin, quote});
+    }
+  };
+
+  if (!config.batch && !config.streaming) {
+    for (const auto& entry: config.coins) {
+      add(entry.first, config.base_currency);
+    }
+    return markets;
+  }
+
+  std::vector<std::string> hubs = config.quote_assets;
+  if (std::find(hubs.begin(), hubs.end(), config.base_currency) == hubs.end()) {
+    hubs.push_back(config.base_currency);
+  }
+
+  for (const auto& entry: config.coins) {
+    if (std::find(hubs.begin(), hubs.end(), entry.first) != hubs.end()) {
+      continue;
+    }
+    for (const std::string& quote: hubs) {
+      add(entry.first, quote);
+    }
+  }
+  for (const std::string& coin: hubs) {
+    for (const std::string& quote: hubs) {
+      add(coin, quote);
+    }
+  }
+  return markets;
+}
+
 bool parse_config(const char* input_file, config& configuration) {
   std::ifstream myfile(input_file);
 
@@ -53,6 +166,220 @@ bool parse_config(const char* input_file, config& configuration) {
       configuration.base_currency = json["base_coin"].GetString();
     }
 
+    if (json.HasMember("exchange")) {
+      if (!json["exchange"].IsString()) {
+	std::cerr << "exchange should be a string\n";
+	return false;
+      }
+      configuration.exchange = json["exchange"].GetString();
+      if (configuration.exchange != "binance" && configuration.exchange != "kucoin") {
+	std::cerr << "exchange should be binance or kucoin\n";
+	return false;
+      }
+    }
+
+    if (json.HasMember("batch")) {
+      if (!json["batch"].IsBool()) {
+	std::cerr << "batch should be a boolean\n";
+	return false;
+      }
+      configuration.batch = json["batch"].GetBool();
+    }
+
+    if (json.HasMember("io_threads")) {
+      if (!json["io_threads"].IsUint()) {
+	std::cerr << "io_threads should be a positive integer\n";
+	return false;
+      }
+      configuration.io_threads = json["io_threads"].GetUint();
+    }
+
+    if (json.HasMember("streaming")) {
+      if (!json["streaming"].IsBool()) {
+	std::cerr << "streaming should be a boolean\n";
+	return false;
+      }
+      configuration.streaming = json["streaming"].GetBool();
+    }
+
+    if (json.HasMember("stream_url")) {
+      if (!json["stream_url"].IsString()) {
+	std::cerr << "stream_url should be a string\n";
+	return false;
+      }
+      configuration.stream_url = json["stream_url"].GetString();
+    }
+
+    if (configuration.streaming && configuration.exchange == "kucoin" && configuration.stream_url.empty()) {
+      std::cerr << "stream_url with the token of kucoin is needed to stream from kucoin\n";
+      return false;
+    }
+
+    if (json.HasMember("dns_nameserver")) {
+      if (!json["dns_nameserver"].IsString()) {
+	std::cerr << "dns_nameserver should be a string\n";
+	return false;
+      }
+      configuration.dns.nameserver = json["dns_nameserver"].GetString();
+    }
+
+    if (json.HasMember("dns_hosts_file")) {
+      if (!json["dns_hosts_file"].IsString()) {
+	std::cerr << "dns_hosts_file should be a string\n";
+	return false;
+      }
+      configuration.dns.hosts_file = json["dns_hosts_file"].GetString();
+    }
+
+    if (json.HasMember("dns_prefetch")) {
+      if (!json["dns_prefetch"].IsBool()) {
+	std::cerr << "dns_prefetch should be a boolean\n";
+	return false;
+      }
+      configuration.dns.prefetch = json["dns_prefetch"].GetBool();
+    }
+
+    if (json.HasMember("value_epsilon")) {
+      if (!json["value_epsilon"].IsNumber() || json["value_epsilon"].GetDouble() < 0) {
+	std::cerr << "value_epsilon should be a positive number\n";
+	return false;
+      }
+      configuration.value_epsilon = json["value_epsilon"].GetDouble();
+    }
+
+    if (json.HasMember("tick_log")) {
+      if (!json["tick_log"].IsString()) {
+	std::cerr << "tick_log should be the path of a directory\n";
+	return false;
+      }
+      configuration.tick_log = json["tick_log"].GetString();
+    }
+
+    if (json.HasMember("depth")) {
+      if (!json["depth"].IsBool()) {
+	std::cerr << "depth should be a boolean\n";
+	return false;
+      }
+      configuration.depth = json["depth"].GetBool();
+    }
+
+    if (json.HasMember("depth_url")) {
+      if (!json["depth_url"].IsString()) {
+	std::cerr << "depth_url should be a string\n";
+	return false;
+      }
+      configuration.depth_url = json["depth_url"].GetString();
+    }
+
+    if (configuration.depth && configuration.exchange != "binance") {
+      std::cerr << "depth is only available on binance\n";
+      return false;
+    }
+
+    if (json.HasMember("metrics_port")) {
+      if (!json["metrics_port"].IsUint() || json["metrics_port"].GetUint() > 65535) {
+	std::cerr << "metrics_port should be a port number\n";
+	return false;
+      }
+      configuration.metrics_port = json["metrics_port"].GetUint();
+    }
+
+    // "timeouts": {"connect": 3000, "tls_handshake": 5000, "response": 10000}, in ms.
+    if (json.HasMember("timeouts")) {
+      const rapidjson::Value& timeouts = json["timeouts"];
+      if (!timeouts.IsObject()) {
+	std::cerr << "timeouts should be an object\n";
+	return false;
+      }
+      std::pair<const char*, timeval*> phases[] = {{"connect", &configuration.timeouts.connect},
+						   {"tls_handshake", &configuration.timeouts.tls_handshake},
+						   {"response", &configuration.timeouts.response}};
+      for (const auto& phase: phases) {
+	if (!timeouts.HasMember(phase.first)) {
+	  continue;
+	}
+	if (!timeouts[phase.first].IsUint() || timeouts[phase.first].GetUint() == 0) {
+	  std::cerr << "the timeouts should be numbers of milliseconds\n";
+	  return false;
+	}
+	unsigned ms = timeouts[phase.first].GetUint();
+	*phase.second = timeval{static_cast<time_t>(ms / 1000), static_cast<suseconds_t>(ms % 1000 * 1000)};
+      }
+    }
+
+    if (json.HasMember("hedge")) {
+      if (!json["hedge"].IsBool()) {
+	std::cerr << "hedge should be a boolean\n";
+	return false;
+      }
+      configuration.hedge = json["hedge"].GetBool();
+    }
+
+    if (json.HasMember("quote_assets")) {
+      const rapidjson::Value& quote_assets = json["quote_assets"];
+      if (!quote_assets.IsArray()) {
+	std::cerr << "quote_assets should be an array of coins\n";
+	return false;
+      }
+      configuration.quote_assets.clear();
+      for (rapidjson::SizeType i = 0; i < quote_assets.Size(); i++) {
+	if (!quote_assets[i].IsString()) {
+	  std::cerr << "quote_assets should be an array of coins\n";
+	  return false;
+	}
+	configuration.quote_assets.push_back(quote_assets[i].GetString());
+      }
+    }
+
+    /*
+      "alerts": [{"coin": "ETH", "above": 0.05}, {"coin": "ETH", "below": 0.03},
+                 {"coin": "FUN", "change": -5, "window": 600},
+                 {"coin": "FUN", "volume_spike": 3, "window": 3600}]
+      change is in percent, window in seconds (1 hour by default).
+    */
+    if (json.HasMember("alerts")) {
+      const rapidjson::Value& alerts = json["alerts"];
+      if (!alerts.IsArray()) {
+	std::cerr << "alerts should be an array of rules\n";
+	return false;
+      }
+      for (const rapidjson::Value& alert: alerts.GetArray()) {
+	if (!alert.IsObject() || !alert.HasMember("coin") || !alert["coin"].IsString()) {
+	  std::cerr << "each alert should have a coin\n";
+	  return false;
+	}
+	cryptom::alert_rule rule{cryptom::alert_rule::price_above, 0, 0, 3600};
+	const char *field = nullptr;
+	if (alert.HasMember("above")) {
+	  field = "above";
+	} else if (alert.HasMember("below")) {
+	  rule.type = cryptom::alert_rule::price_below;
+	  field = "below";
+	} else if (alert.HasMember("change")) {
+	  field = "change";
+	} else if (alert.HasMember("volume_spike")) {
+	  rule.type = cryptom::alert_rule::volume_spike;
+	  field = "volume_spike";
+	}
+	if (field == nullptr || !alert[field].IsNumber()) {
+	  std::cerr << "an alert should have a number above, below, change or volume_spike\n";
+	  return false;
+	}
+	rule.threshold = alert[field].GetDouble();
+	if (strcmp(field, "change") == 0) {
+	  rule.type = rule.threshold < 0 ? cryptom::alert_rule::change_below : cryptom::alert_rule::change_above;
+	}
+	if (alert.HasMember("window")) {
+	  if (!alert["window"].IsUint() || alert["window"].GetUint() == 0) {
+	    std::cerr << "the window of an alert should be a number of seconds\n";
+	    return false;
+	  }
+	  rule.window = alert["window"].GetUint();
+	}
+	configuration.alerts.emplace_back(alert["coin"].GetString(), rule);
+      }
+    }
+
     // Now add all the coins from the portfolio
     // ----------------------------------------
     if (!json.HasMember("portfolio")) {
@@ -111,94 +438,503 @@ bool parse_config(const char* input_file, config& configuration) {
 }
 
 
-int io_thread(const config &config, event_base* base, boost::lockfree::queue<cryptom::ticker> *queue) {
-
-#if (OPENSSL_VERSION_NUMBER < 0x10100000L) ||				\
-  (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20700000L)
-  // Initialize OpenSSL
-  SSL_library_init();
-  ERR_load_crypto_strings();
-  SSL_load_error_strings();
-  OpenSSL_add_all_algorithms();
-#endif
-
-
-  if (!base) {
-    perror("event_base_new()");
-    return -1;
-  }
-
+/*
+  Clients of the portfolio, for the IO engine.
+ */
+std::vector<cryptom::client_spec> client_specs(const config &config) {
   timeval duration{2,0};
 
-  // Create all the clients
-  std::vector<cryptom::scheduled_client> clients;
-  clients.reserve(2);
+  bool kucoin = config.exchange == "kucoin";
+  std::vector<cryptom::client_spec> specs;
+
+  // The base currency has no market, its value is its quantity.
+  cryptom::symbol_table& symbol_table = cryptom::symbol_table::global();
+  if (config.streaming || config.batch) {
+    // One client requests all the markets and keeps the ones which may price the
+    // portfolio, or subscribes to their tickers.
+    cryptom::symbol_map symbols;
+    for (const market_pair& market: candidate_markets(config)) {
+      symbols[market.symbol] = symbol_table.intern(market.symbol);
+    }
 
-  for (const auto& entry: config.coins) {
-    std::string url = create_burl(entry.first, config.base_currency);
-    std::cout << "Will create client for " << url << std::endl;
-    clients.emplace_back(base, url.c_str(), duration, queue);
+    if (config.streaming) {
+      const std::string& url = config.stream_url.empty() ? binance_stream_url : config.stream_url;
+      cryptom::client_spec spec{url, config.exchange, std::move(symbols), duration};
+      spec.streaming = true;
+      specs.push_back(std::move(spec));
+    } else {
+      const std::string& url = kucoin ? kucoin_base_url : binance_base_url;
+      cryptom::client_spec spec{url, config.exchange, std::move(symbols), duration};
+      spec.hedge = config.hedge;
+      specs.push_back(std::move(spec));
+    }
+  } else {
+    for (const auto& entry: config.coins) {
+      if (entry.first == config.base_currency) {
+	continue;
+      }
+      std::string url = kucoin ?
+	create_kurl(entry.first, config.base_currency) :
+	create_burl(entry.first, config.base_currency);
+      std::string symbol = market_symbol(config, entry.first, config.base_currency);
+      cryptom::client_spec spec{url, config.exchange,
+	  cryptom::symbol_map{{symbol, symbol_table.intern(symbol)}}, duration};
+      spec.hedge = config.hedge;
+      specs.push_back(std::move(spec));
+    }
   }
+  return specs;
+}
 
-  event_base_dispatch(base);
-  event_base_free(base);
-
-#if (OPENSSL_VERSION_NUMBER < 0x10100000L) ||				\
-  (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20700000L)
-  EVP_cleanup();
-  ERR_free_strings();
+/*
+  Same coin, kind, threshold and window. The symbols are only interned at startup.
+ */
+bool same_alerts(const std::vector<std::pair<std::string, cryptom::alert_rule>>& a,
+		 const std::vector<std::pair<std::string, cryptom::alert_rule>>& b) {
+  return a.size() == b.size() &&
+    std::equal(a.begin(), a.end(), b.begin(),
+	       [](const std::pair<std::string, cryptom::alert_rule>& x,
+		  const std::pair<std::string, cryptom::alert_rule>& y) {
+		 return x.first == y.first && x.second.type == y.second.type &&
+		   x.second.threshold == y.second.threshold && x.second.window == y.second.window;
+	       });
+}
 
-#if OPENSSL_VERSION_NUMBER < 0x10000000L
-  ERR_remove_state(0);
-#else
-  ERR_remove_thread_state(NULL);
-#endif
+/*
+  Settings which are only read at startup: a reload keeps the running ones.
+ */
+bool same_settings(const config& a, const config& b) {
+  return a.base_currency == b.base_currency && a.exchange == b.exchange && a.batch == b.batch &&
+    a.io_threads == b.io_threads && a.streaming == b.streaming && a.stream_url == b.stream_url &&
+    a.value_epsilon == b.value_epsilon && a.quote_assets == b.quote_assets &&
+    a.tick_log == b.tick_log && a.depth == b.depth && a.depth_url == b.depth_url &&
+    same_alerts(a.alerts, b.alerts) && a.metrics_port == b.metrics_port && a.hedge == b.hedge &&
+    timercmp(&a.timeouts.connect, &b.timeouts.connect, ==) &&
+    timercmp(&a.timeouts.tls_handshake, &b.timeouts.tls_handshake, ==) &&
+    timercmp(&a.timeouts.response, &b.timeouts.response, ==);
+}
 
-  CRYPTO_cleanup_all_ex_data();
+/*
+  Apply the portfolio of a new configuration to the running clients: the clients which
+  are not needed anymore are removed and the new ones added. A client whose url stays
+  takes the new symbols in place: a batch client keeps its connections, a stream only
+  subscribes to the new coins and unsubscribes from the removed ones. A change of
+  quantities gives the same clients, and does nothing.
+ */
+void update_clients(const std::vector<cryptom::client_spec>& running,
+		    const std::vector<cryptom::client_spec>& next, cryptom::io_engine &engine) {
+  auto find = [](const std::vector<cryptom::client_spec>& specs, const cryptom::client_spec& spec) {
+    return std::find_if(specs.begin(), specs.end(), [&spec](const cryptom::client_spec& other) {
+	return other.url == spec.url;
+      });
+  };
+
+  for (const cryptom::client_spec& spec: running) {
+    if (find(next, spec) == next.end()) {
+      engine.remove_client(spec.url);
+    }
+  }
+  for (const cryptom::client_spec& spec: next) {
+    auto it = find(running, spec);
+    if (it == running.end()) {
+      engine.add_client(spec);
+    } else if (it->symbols != spec.symbols) {
+      engine.update_client(spec);
+    }
+  }
+}
 
-  sk_SSL_COMP_free(SSL_COMP_get_compression_methods());
-#endif /* (OPENSSL_VERSION_NUMBER < 0x10100000L) ||			\
-	  (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20700000L) */
+// Set by SIGINT and SIGTERM, the consumer stops at its next wake up.
+static std::atomic<bool> stop_requested(false);
 
-  return 0;
+static void on_stop_signal(int) {
+  stop_requested.store(true);
 }
 
 int main(int argc, char **argv) {
 
+  if (argc < 2) {
+    std::cerr << "usage: " << argv[0] << " portfolio.json [--replay | --replay-realtime]\n";
+    return 1;
+  }
   const char *config_path = argv[1];
 
-  // Queue for communication between backend and GUI
-  // We are going to request tickers every few seconds so 128 should be large enough.
-  boost::lockfree::queue<cryptom::ticker> queue(128);
+  // Replay the tickers of the log instead of asking the exchanges, as fast as possible
+  // or at the pace they were received.
+  bool replay = argc > 2 && (strcmp(argv[2], "--replay") == 0 || strcmp(argv[2], "--replay-realtime") == 0);
+  bool realtime = argc > 2 && strcmp(argv[2], "--replay-realtime") == 0;
 
   config conf;
   if (parse_config(config_path, conf)) {
+    if (replay && conf.tick_log.empty()) {
+      std::cerr << "tick_log is needed in " << config_path << " to replay\n";
+      return 1;
+    }
+
     for (const auto& entry: conf.coins) {
       std::cout << entry.first << " -> " << entry.second << std::endl;
     }
 
-    event_base *base = event_base_new();
-    std::thread communication_thread(io_thread, conf, base, &queue);
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L) ||				\
+  (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20700000L)
+    // Initialize OpenSSL
+    SSL_library_init();
+    ERR_load_crypto_strings();
+    SSL_load_error_strings();
+    OpenSSL_add_all_algorithms();
+#endif
+
+    size_t nb_loops = cryptom::io_engine::loops_for(conf.io_threads);
+
+    // Queue for communication between backend and GUI, one lane per event loop.
+    // We are going to request tickers every few seconds so 1024 should be large enough,
+    // even for a portfolio polled with the endpoint of all the markets.
+    cryptom::ticker_channel queue(nb_loops, 1024);
+
+    {
+      // One TLS context for the whole process: trust store and session cache.
+      cryptom::tls_context tls;
+
+      cryptom::io_engine engine(nb_loops, &tls, conf.dns, &queue);
+      engine.set_timeouts(conf.timeouts);
+      // Clients of the portfolio, as last given to the engine.
+      std::vector<cryptom::client_spec> specs;
+      if (!replay) {
+	specs = client_specs(conf);
+	for (const cryptom::client_spec& spec: specs) {
+	  engine.add_client(spec);
+	}
+      }
 
-    // wait for 5 tickers
-    int nb_ticker = 0;
-    while (nb_ticker < 5) {
-      cryptom::ticker t;
-      while (queue.pop(t)) {
-	++nb_ticker;
-	std::cout << "From GUI thread\n";
+      // The stages of the IO threads, and the ones of this thread.
+      cryptom::metrics_registry& registry = cryptom::metrics_registry::global();
+      cryptom::stage_histograms *metrics = registry.add_writer("");
+      std::unique_ptr<cryptom::metrics_server> metrics_server;
+      if (conf.metrics_port > 0) {
+	metrics_server.reset(new cryptom::metrics_server(registry));
+	if (metrics_server->start("127.0.0.1", conf.metrics_port) != 0) {
+	  return 1;
+	}
+      }
 
-	std::cout << "Symbol: " << t.symbol << "\n";
-	std::cout << "close: " << t.close << "\n";
-	std::cout << "high: " << t.high << "\n";
-	std::cout << "low: " << t.low << "\n";
-	std::cout << "volume: " << t.volume << "\n";
+      // Prices of the coins in the base currency and valuation of the holdings, in the
+      // GUI thread.
+      cryptom::symbol_table& symbol_table = cryptom::symbol_table::global();
+      cryptom::currency_graph graph(symbol_table.intern(conf.base_currency));
+      for (const market_pair& market: candidate_markets(conf)) {
+	graph.add_market(symbol_table.intern(market.symbol), symbol_table.intern(market.coin),
+			 symbol_table.intern(market.quote));
+      }
+
+      cryptom::portfolio holdings(conf.value_epsilon);
+      for (const auto& entry: conf.coins) {
+	if (entry.first == conf.base_currency) {
+	  holdings.set_base_quantity(entry.second);
+	} else {
+	  graph.add_coin(symbol_table.intern(entry.first));
+	  holdings.set_quantity(symbol_table.intern(entry.first), entry.second);
+	}
+      }
+      std::vector<cryptom::currency_graph::quote> quotes;
+
+      // Order books of the markets coin/base, by coin.
+      std::unique_ptr<cryptom::depth_feed> depth;
+      std::map<cryptom::symbol_id, cryptom::symbol_id> depth_markets;
+      if (conf.depth && !replay) {
+	cryptom::symbol_map symbols;
+	for (const auto& entry: conf.coins) {
+	  if (entry.first != conf.base_currency) {
+	    std::string symbol = market_symbol(conf, entry.first, conf.base_currency);
+	    symbols[symbol] = symbol_table.intern(symbol);
+	    depth_markets[symbol_table.intern(entry.first)] = symbols[symbol];
+	  }
+	}
+	depth.reset(new cryptom::depth_feed(&tls, conf.dns, conf.depth_url,
+					    conf.stream_url.empty() ? binance_stream_url : conf.stream_url,
+					    std::move(symbols)));
+	depth->start();
+      }
+
+      // Portfolio of the configuration, reloaded when the file changes. Read by this
+      // thread between the tickers, without lock.
+      cryptom::rcu_pointer<config> current(std::unique_ptr<config>(new config(conf)));
+      uint64_t applied = current.version();
+      std::map<std::string, double> held = conf.coins;
+      auto apply = [&](const config& next) {
+	for (const market_pair& market: candidate_markets(next)) {
+	  graph.add_market(symbol_table.intern(market.symbol), symbol_table.intern(market.coin),
+			   symbol_table.intern(market.quote));
+	}
+	for (const auto& entry: held) {
+	  if (next.coins.count(entry.first) != 0) {
+	    continue;
+	  }
+	  if (entry.first == conf.base_currency) {
+	    holdings.set_base_quantity(0);
+	  } else {
+	    graph.remove_coin(symbol_table.intern(entry.first));
+	    holdings.remove(symbol_table.intern(entry.first));
+	    // The alerts are settings, read at startup.
+	    for (const auto& alert: conf.alerts) {
+	      if (alert.first == entry.first) {
+		std::cerr << "The alerts of " << entry.first << " stay until a restart\n";
+		break;
+	      }
+	    }
+	  }
+	}
+	for (const auto& entry: next.coins) {
+	  if (entry.first == conf.base_currency) {
+	    holdings.set_base_quantity(entry.second);
+	  } else {
+	    graph.add_coin(symbol_table.intern(entry.first));
+	    holdings.set_quantity(symbol_table.intern(entry.first), entry.second);
+	  }
+	}
+	held = next.coins;
+
+	// The books of the coins of the new portfolio.
+	if (depth != nullptr) {
+	  cryptom::symbol_map symbols;
+	  depth_markets.clear();
+	  for (const auto& entry: next.coins) {
+	    if (entry.first != conf.base_currency) {
+	      std::string symbol = market_symbol(next, entry.first, conf.base_currency);
+	      symbols[symbol] = symbol_table.intern(symbol);
+	      depth_markets[symbol_table.intern(entry.first)] = symbols[symbol];
+	    }
+	  }
+	  depth->set_symbols(std::move(symbols));
+	}
+	std::cout << "portfolio: " << holdings.total() << " " << conf.base_currency
+		  << (holdings.complete() ? "" : " (some prices are missing)") << "\n";
+      };
+
+      cryptom::alert_engine alerts;
+      for (const auto& entry: conf.alerts) {
+	cryptom::alert_rule rule = entry.second;
+	rule.symbol = symbol_table.intern(market_symbol(conf, entry.first, conf.base_currency));
+	alerts.add(rule);
+      }
+      std::vector<cryptom::alert_engine::alert> fired;
+
+      // History of the tickers: 4096 samples, and 512 bars of each resolution, per symbol.
+      cryptom::tick_store history(4096, 512);
+
+      // The tickers received are kept in the log, not the replayed ones.
+      std::unique_ptr<cryptom::tick_log> log;
+      if (!conf.tick_log.empty() && !replay) {
+	log.reset(new cryptom::tick_log(conf.tick_log));
+	if (log->open() != 0) {
+	  std::cerr << "Cannot open the tick log " << conf.tick_log << "\n";
+	  return 1;
+	}
+      }
+
+      auto consume = [&](const cryptom::ticker& t) {
+	int64_t start = cryptom::receive_time();
+	if (t.queued != 0) {
+	  metrics->record(cryptom::stage::queue_dwell, start - t.queued);
+	}
+
+	history.append(t);
+	if (log != nullptr) {
+	  log->append(t);
+	}
+
+	fired.clear();
+	alerts.check(t, fired);
+	for (const cryptom::alert_engine::alert& alert: fired) {
+	  const cryptom::alert_rule& rule = alerts.rule(alert.rule);
+	  static const char *kinds[] = {"above", "below", "changed by more than", "changed by less than",
+					"volume spike over"};
+	  std::cout << "ALERT " << symbol_table.name(rule.symbol) << " " << kinds[rule.type] << " "
+		    << rule.threshold;
+	  if (rule.type != cryptom::alert_rule::price_above && rule.type != cryptom::alert_rule::price_below) {
+	    std::cout << " in " << rule.window << "s";
+	  }
+	  std::cout << ": " << alert.value << "\n";
+	}
+
+	quotes.clear();
+	graph.update(t, quotes);
+	for (const cryptom::currency_graph::quote& quote: quotes) {
+	  cryptom::portfolio::change change;
+	  if (holdings.update(quote.coin, quote.price, change)) {
+	    std::cout << "value of " << symbol_table.name(change.coin) << ": " << change.quantity
+		      << " x " << change.price << " = " << change.value << " " << conf.base_currency
+		      << " (" << quote.legs << " markets)\n";
+
+	    // What the book would really give for the whole position.
+	    double value, filled;
+	    auto market = depth_markets.find(change.coin);
+	    if (market != depth_markets.end() &&
+		depth->liquidation_value(market->second, change.quantity, value, filled) && filled > 0) {
+	      double best = depth->best_bid(market->second);
+	      std::cout << "  liquidation value: " << value << " " << conf.base_currency
+			<< " (slippage " << 100.0 * (1 - value / (filled * best)) << "%"
+			<< (filled < change.quantity ? ", the book is too thin for the whole quantity" : "")
+			<< ")\n";
+	    }
+	    std::cout << "portfolio: " << change.total << " " << conf.base_currency
+		      << (holdings.complete() ? "" : " (some prices are missing)") << "\n";
+	  }
+	}
+
+	metrics->record(cryptom::stage::consumer, cryptom::receive_time() - start);
+      };
+
+      if (replay) {
+	cryptom::tick_log_reader reader(conf.tick_log);
+	if (reader.open() != 0) {
+	  std::cerr << "Cannot open the tick log " << conf.tick_log << "\n";
+	  return 1;
+	}
+
+	// The replay takes the lane of the first event loop, which is not started.
+	std::atomic<bool> done(false);
+	std::thread replayer([&]() {
+	    reader.replay(&queue, 0, realtime);
+	    done.store(true);
+	  });
+
+	size_t nb_ticker = 0;
+	auto start = std::chrono::steady_clock::now();
+	cryptom::ticker t;
+	while (true) {
+	  if (queue.pop(t, std::chrono::milliseconds(100))) {
+	    consume(t);
+	    ++nb_ticker;
+	  } else if (done.load()) {
+	    break;
+	  }
+	}
+	replayer.join();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	std::cerr << "Replayed " << nb_ticker << " tickers in " << seconds << "s\n";
+      } else {
+	engine.start();
+
+	// Reload the portfolio when the file is saved. Only the clients of the coins added
+	// or removed are touched, in their loops.
+	config loaded = conf;
+	cryptom::file_watcher watcher(config_path, [&]() {
+	    config parsed;
+	    if (!parse_config(config_path, parsed)) {
+	      std::cerr << "Keeping the previous portfolio\n";
+	      return;
+	    }
+	    if (!same_settings(loaded, parsed)) {
+	      std::cerr << "Only the portfolio is reloaded, restart for the other settings\n";
+	    }
+	    std::unique_ptr<config> next(new config(loaded));
+	    next->coins = parsed.coins;
+
+	    std::vector<cryptom::client_spec> next_specs = client_specs(*next);
+	    update_clients(specs, next_specs, engine);
+	    specs = std::move(next_specs);
+	    loaded = *next;
+	    current.publish(std::move(next));
+	  });
+	if (watcher.start() != 0) {
+	  std::cerr << "Cannot watch " << config_path << ", the portfolio will not be reloaded\n";
+	}
+
+	// Run until interrupted. The timeout of pop is how often the flag is checked when
+	// no ticker comes, it also applies a reload without waiting for the next ticker.
+	std::signal(SIGINT, &on_stop_signal);
+	std::signal(SIGTERM, &on_stop_signal);
+	while (!stop_requested.load()) {
+	  cryptom::ticker t;
+	  bool received = queue.pop(t, std::chrono::milliseconds(200));
+	  if (current.version() != applied) {
+	    applied = current.version();
+	    apply(*current.read());
+	  }
+	  if (received) {
+	    consume(t);
+	  }
+	  current.quiescent();
+	}
+	std::signal(SIGINT, SIG_DFL);
+	std::signal(SIGTERM, SIG_DFL);
+	std::cerr << "Stopping\n";
+
+	// No reload while the engine stops.
+	watcher.stop();
+      }
+
+      engine.stop();
+      if (depth != nullptr) {
+	depth->stop();
+      }
+      if (metrics_server != nullptr) {
+	metrics_server->stop();
+      }
+
+      cryptom::connection_pool::stats stats = engine.pool_stats();
+      std::cerr << "Connection pool: " << stats.requests << " requests, "
+		<< stats.handshakes << " handshakes, "
+		<< stats.reused << " handshakes avoided, "
+		<< "reuse hit rate " << 100.0 * stats.hit_rate() << "%\n";
+      std::cerr << "TLS: " << tls.get_stats().full_handshakes << " full handshakes, "
+		<< tls.get_stats().resumed_handshakes << " resumed sessions\n";
+      cryptom::dns_cache::stats dns = engine.dns_stats();
+      std::cerr << "DNS: " << dns.hits << " hits, " << dns.misses << " misses, "
+		<< dns.resolutions << " resolutions (" << dns.prefetches << " prefetched), "
+		<< dns.failures << " failures\n";
+      cryptom::request_scheduler::stats scheduler = engine.scheduler_stats();
+      std::cerr << "Scheduler: " << scheduler.requests << " requests, "
+		<< scheduler.throttled << " throttled, "
+		<< scheduler.skipped << " skipped (still in flight), "
+		<< scheduler.pauses << " pauses asked by the exchanges\n";
+      std::cerr << "Failures: " << scheduler.failures << " (" << scheduler.timeouts << " timeouts), "
+		<< scheduler.retries << " retries, "
+		<< scheduler.breaker_opens << " hosts unavailable for a while, "
+		<< scheduler.hedges << " hedged requests (" << scheduler.hedges_won << " answered first, "
+		<< scheduler.hedges_throttled << " not sent for lack of budget)\n";
+
+      if (depth != nullptr) {
+	cryptom::depth_feed::stats books = depth->get_stats();
+	std::cerr << "Depth: " << books.books.snapshots << " snapshots, "
+		  << books.books.updates << " updates of " << books.books.levels << " levels, "
+		  << books.books.gaps << " gaps, " << books.books.stale << " stale, "
+		  << books.dropped << " dropped, " << books.failures << " failed snapshots\n";
+      }
+
+      std::cerr << "History: " << history.memory() / 1024 << " KiB\n";
+      if (log != nullptr) {
+	std::cerr << "Tick log: " << log->size() << " tickers, " << log->rejected()
+		  << " not logged as their symbol is too long\n";
+      }
+
+      // To size the arenas of the documents of each exchange.
+      for (const auto& entry: cryptom::json_arena::usage_by_label()) {
+	const cryptom::json_arena::usage& usage = entry.second;
+	std::cerr << "JSON arena " << entry.first << ": peak " << usage.peak << " bytes"
+		  << " (stack " << usage.stack_peak << "), capacity " << usage.capacity
+		  << " (stack " << usage.stack_capacity << "), " << usage.overflows
+		  << " overflows in " << usage.parses << " parses, " << usage.pullups << " pullups\n";
       }
     }
-    timeval onesec = {1, 0};
-    event_base_loopexit(base, &onesec);
 
-    communication_thread.join();
+#if (OPENSSL_VERSION_NUMBER < 0x10100000L) ||				\
+  (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20700000L)
+    EVP_cleanup();
+    ERR_free_strings();
+
+#if OPENSSL_VERSION_NUMBER < 0x10000000L
+    ERR_remove_state(0);
+#else
+    ERR_remove_thread_state(NULL);
+#endif
+
+    CRYPTO_cleanup_all_ex_data();
+
+    sk_SSL_COMP_free(SSL_COMP_get_compression_methods());
+#endif /* (OPENSSL_VERSION_NUMBER < 0x10100000L) ||			\
+	  (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x20700000L) */
   } else {
     std::cout << "Error parsing the configuration\n";
   }
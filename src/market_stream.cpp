@@ -0,0 +1,220 @@
+#include "market_stream.h"
+#include "decimal.h"
+
+#include <cctype>
+#include <cstring>
+
+namespace cryptom {
+
+  namespace {
+
+    // Symbols in one subscription message, to stay under the limits of the exchanges.
+    const size_t symbols_per_message = 100;
+
+    // The feeds give the numbers either as JSON numbers or as strings.
+    bool number_of(const rapidjson::Value& object, const char *name, double& out) {
+      rapidjson::Value::ConstMemberIterator it = object.FindMember(name);
+      if (it == object.MemberEnd()) {
+	return false;
+      }
+      if (it->value.IsNumber()) {
+	out = it->value.GetDouble();
+	return true;
+      }
+      if (it->value.IsString()) {
+	return parse_decimal(it->value.GetString(), it->value.GetStringLength(), out);
+      }
+      return false;
+    }
+
+    const char* string_of(const rapidjson::Value& object, const char *name) {
+      rapidjson::Value::ConstMemberIterator it = object.FindMember(name);
+      if (it == object.MemberEnd() || !it->value.IsString()) {
+	return nullptr;
+      }
+      return it->value.GetString();
+    }
+
+  }
+
+  void binance_stream::messages(const char *method, const symbol_map& symbols, std::vector<std::string>& out) {
+    /*
+      {"method": "SUBSCRIBE", "params": ["ethbtc@ticker", "funbtc@ticker"], "id": 1}
+      and the same with "UNSUBSCRIBE".
+    */
+    auto it = symbols.begin();
+    while (it != symbols.end()) {
+      std::string message = std::string("{\"method\":\"") + method + "\",\"params\":[";
+      for (size_t i = 0; i < symbols_per_message && it != symbols.end(); i++, ++it) {
+	if (i > 0) {
+	  message += ',';
+	}
+	message += '"';
+	for (char c: it->first) {
+	  message += static_cast<char>(tolower(static_cast<unsigned char>(c)));
+	}
+	message += '@';
+	message += stream_;
+	message += '"';
+      }
+      message += "],\"id\":" + std::to_string(next_id_++) + "}";
+      out.push_back(std::move(message));
+    }
+  }
+
+  int binance_stream::tickers_from_message(char *text, const symbol_map& symbols, std::vector<ticker>& out) {
+
+    /*
+      {
+      "e": "24hrTicker",  // Event type
+      "E": 123456789,     // Event time
+      "s": "BNBBTC",      // Symbol
+      "c": "0.0025",      // Last price
+      "h": "0.0025",      // High price
+      "l": "0.0010",      // Low price
+      "v": "10000",       // Total traded base asset volume
+      ...
+      }
+
+      The combined streams wrap it in {"stream": "bnbbtc@ticker", "data": {...}}. The
+      replies to the subscriptions are {"result": null, "id": 1}.
+    */
+
+    json_arena::document_type& json = arena_.parse_insitu(text);
+    if (json.HasParseError() || !json.IsObject()) {
+      return -1;
+    }
+
+    const rapidjson::Value *event = &json;
+    rapidjson::Value::ConstMemberIterator data = json.FindMember("data");
+    if (data != json.MemberEnd() && data->value.IsObject()) {
+      event = &data->value;
+    }
+
+    const char *type = string_of(*event, "e");
+    if (type == nullptr || strcmp(type, "24hrTicker") != 0) {
+      return 0;
+    }
+
+    const char *symbol = string_of(*event, "s");
+    if (symbol == nullptr) {
+      return -1;
+    }
+    auto it = symbols.find(symbol);
+    if (it == symbols.end()) {
+      return 0;
+    }
+
+    ticker t;
+    if (!number_of(*event, "h", t.high) ||
+	!number_of(*event, "l", t.low) ||
+	!number_of(*event, "c", t.close) ||
+	!number_of(*event, "v", t.volume)) {
+      return -1;
+    }
+
+    double time;
+    t.date = number_of(*event, "E", time) ? static_cast<int>(time / 1000) : 0;
+    t.symbol = it->second;
+    out.push_back(t);
+    return 0;
+  }
+
+  void kucoin_stream::messages(const char *type, const symbol_map& symbols, std::vector<std::string>& out) {
+    /*
+      {"id": 1, "type": "subscribe", "topic": "/market/snapshot:ETH-BTC,FUN-BTC",
+       "privateChannel": false, "response": true}
+      and the same with "unsubscribe".
+    */
+    auto it = symbols.begin();
+    while (it != symbols.end()) {
+      std::string message = "{\"id\":" + std::to_string(next_id_++) +
+	",\"type\":\"" + type + "\",\"topic\":\"/market/snapshot:";
+      for (size_t i = 0; i < symbols_per_message && it != symbols.end(); i++, ++it) {
+	if (i > 0) {
+	  message += ',';
+	}
+	message += it->first;
+      }
+      message += "\",\"privateChannel\":false,\"response\":true}";
+      out.push_back(std::move(message));
+    }
+  }
+
+  std::string kucoin_stream::ping_message() {
+    return "{\"id\":" + std::to_string(next_id_++) + ",\"type\":\"ping\"}";
+  }
+
+  int kucoin_stream::tickers_from_message(char *text, const symbol_map& symbols, std::vector<ticker>& out) {
+
+    /*
+      {"type": "message",
+       "topic": "/market/snapshot:ETH-BTC",
+       "subject": "trade.snapshot",
+       "data": {"sequence": "1545896669291",
+                "data": {"symbol": "ETH-BTC",
+		         "high": 0.04652,
+			 "low": 0.045,
+			 "vol": 2645.902635,
+			 "lastTradedPrice": 0.04631749,
+			 "datetime": 1548847913001,
+			 ...}}}
+
+      The other types are welcome, ack and pong.
+    */
+
+    json_arena::document_type& json = arena_.parse_insitu(text);
+    if (json.HasParseError() || !json.IsObject()) {
+      return -1;
+    }
+
+    const char *type = string_of(json, "type");
+    if (type == nullptr || strcmp(type, "message") != 0) {
+      return 0;
+    }
+
+    rapidjson::Value::ConstMemberIterator data = json.FindMember("data");
+    if (data == json.MemberEnd() || !data->value.IsObject()) {
+      return -1;
+    }
+    rapidjson::Value::ConstMemberIterator snapshot = data->value.FindMember("data");
+    if (snapshot == data->value.MemberEnd() || !snapshot->value.IsObject()) {
+      return -1;
+    }
+    const rapidjson::Value& object = snapshot->value;
+
+    const char *symbol = string_of(object, "symbol");
+    if (symbol == nullptr) {
+      return -1;
+    }
+    auto it = symbols.find(symbol);
+    if (it == symbols.end()) {
+      return 0;
+    }
+
+    ticker t;
+    if (!number_of(object, "high", t.high) ||
+	!number_of(object, "low", t.low) ||
+	!number_of(object, "lastTradedPrice", t.close) ||
+	!number_of(object, "vol", t.volume)) {
+      return -1;
+    }
+
+    double time;
+    t.date = number_of(object, "datetime", time) ? static_cast<int>(time / 1000) : 0;
+    t.symbol = it->second;
+    out.push_back(t);
+    return 0;
+  }
+
+  std::unique_ptr<stream_protocol> make_stream_protocol(const std::string& exchange) {
+    if (exchange == "binance") {
+      return std::unique_ptr<stream_protocol>(new binance_stream());
+    }
+    if (exchange == "kucoin") {
+      return std::unique_ptr<stream_protocol>(new kucoin_stream());
+    }
+    return nullptr;
+  }
+
+}
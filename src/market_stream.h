@@ -0,0 +1,109 @@
+#pragma once
+
+#include "json_arena.h"
+#include "ticker.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace cryptom {
+
+  /*
+    What an exchange expects on its WebSocket market data feed: how to subscribe to
+    the tickers, how to keep the connection alive and how to read the updates.
+  */
+  class stream_protocol {
+  public:
+    // The label names the arena of the protocol in json_arena::usage_by_label. The
+    // messages hold one ticker, so the arena starts small.
+    explicit stream_protocol(const char *label): arena_(label, 4 * 1024) {}
+    virtual ~stream_protocol() {}
+
+    /**
+       Messages to send once connected to receive the tickers of the symbols. Sent
+       again after each reconnection.
+     */
+    virtual void subscribe_messages(const symbol_map& symbols, std::vector<std::string>& out) = 0;
+
+    // Messages to stop receiving the tickers of the symbols, on an open connection.
+    virtual void unsubscribe_messages(const symbol_map& symbols, std::vector<std::string>& out) = 0;
+
+    /**
+       Application level ping to send every ping_interval seconds. Empty if the ping
+       frames of the WebSocket protocol are enough.
+     */
+    virtual std::string ping_message() { return std::string(); }
+
+    virtual int ping_interval() const { return 20; }
+
+    /**
+       Parse a text message, in situ. Tickers of the given symbols are appended to out.
+       Messages which are not tickers (replies, pongs, welcome) are ignored.
+       Will return 0 if ok.
+     */
+    virtual int tickers_from_message(char *text, const symbol_map& symbols, std::vector<ticker>& out) = 0;
+
+    // When the last message was parsed, see json_arena::parsed_at.
+    int64_t parsed_at() const { return arena_.parsed_at(); }
+
+  protected:
+    // Memory of the documents, reused from one message to the next.
+    json_arena arena_;
+  };
+
+  /*
+    Individual symbol ticker streams <symbol>@ticker of binance, subscribed on the raw
+    stream endpoint (wss://stream.binance.com:9443/ws). Subclasses subscribe to other
+    streams of the symbols, <symbol>@<stream>.
+  */
+  class binance_stream: public stream_protocol {
+  public:
+    explicit binance_stream(const char *label = "binance stream", const char *stream = "ticker"):
+      stream_protocol(label), stream_(stream), next_id_(1) {}
+
+    void subscribe_messages(const symbol_map& symbols, std::vector<std::string>& out) {
+      messages("SUBSCRIBE", symbols, out);
+    }
+    void unsubscribe_messages(const symbol_map& symbols, std::vector<std::string>& out) {
+      messages("UNSUBSCRIBE", symbols, out);
+    }
+    int tickers_from_message(char *text, const symbol_map& symbols, std::vector<ticker>& out);
+
+  private:
+    const char *stream_;
+    int next_id_;
+
+    void messages(const char *method, const symbol_map& symbols, std::vector<std::string>& out);
+  };
+
+  /*
+    Snapshot topic /market/snapshot:<symbol> of kucoin. The url must hold the token
+    given by the bullet-public endpoint.
+  */
+  class kucoin_stream: public stream_protocol {
+  public:
+    kucoin_stream(): stream_protocol("kucoin stream"), next_id_(1) {}
+
+    void subscribe_messages(const symbol_map& symbols, std::vector<std::string>& out) {
+      messages("subscribe", symbols, out);
+    }
+    void unsubscribe_messages(const symbol_map& symbols, std::vector<std::string>& out) {
+      messages("unsubscribe", symbols, out);
+    }
+    std::string ping_message();
+    // kucoin closes the connection without a ping in the interval of the welcome message.
+    int ping_interval() const { return 15; }
+    int tickers_from_message(char *text, const symbol_map& symbols, std::vector<ticker>& out);
+
+  private:
+    int next_id_;
+
+    void messages(const char *type, const symbol_map& symbols, std::vector<std::string>& out);
+  };
+
+  /**
+     Create the stream protocol of an exchange ("binance" or "kucoin"). NULL if unknown.
+   */
+  std::unique_ptr<stream_protocol> make_stream_protocol(const std::string& exchange);
+
+}
@@ -0,0 +1,186 @@
+#include "metrics.h"
+#include <event2/buffer.h>
+#include <event2/keyvalq_struct.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <iostream>
+#include <map>
+
+namespace cryptom {
+
+  namespace {
+
+    // Bounds of the buckets of the Prometheus histogram, in seconds. The quantiles
+    // come from the finer buckets of the histograms.
+    const double bucket_bounds[] = {
+      1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+      1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+    };
+
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+    void append(std::string& out, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+    void append(std::string& out, const char *format, ...) {
+      char line[256];
+      va_list args;
+      va_start(args, format);
+      int n = vsnprintf(line, sizeof(line), format, args);
+      va_end(args);
+      if (n > 0) {
+	out.append(line, std::min(static_cast<size_t>(n), sizeof(line) - 1));
+      }
+    }
+
+    std::string labels_of(const std::string& exchange, stage s) {
+      std::string labels = std::string("stage=\"") + stage_name(s) + "\"";
+      if (!exchange.empty()) {
+	labels += ",exchange=\"" + exchange + "\"";
+      }
+      return labels;
+    }
+
+  }
+
+  const char* stage_name(stage s) {
+    static const char *names[] = {
+      "dns", "connect", "tls_handshake", "first_byte", "body_read",
+      "json_parse", "conversion", "queue_dwell", "consumer"
+    };
+    return names[static_cast<size_t>(s)];
+  }
+
+  metrics_registry& metrics_registry::global() {
+    static metrics_registry registry;
+    return registry;
+  }
+
+  stage_histograms* metrics_registry::add_writer(const std::string& exchange) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    writers_.emplace_back(new stage_histograms(exchange));
+    return writers_.back().get();
+  }
+
+  void metrics_registry::write_prometheus(std::string& out) const {
+    // Merged by exchange, then by stage.
+    std::map<std::string, std::vector<latency_histogram::snapshot>> merged;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const auto& writer: writers_) {
+	std::vector<latency_histogram::snapshot>& snapshots = merged[writer->exchange()];
+	snapshots.resize(nb_stages);
+	for (size_t s = 0; s < nb_stages; s++) {
+	  snapshots[s].merge(writer->histogram(static_cast<stage>(s)));
+	}
+      }
+    }
+
+    out += "# HELP cryptom_stage_duration_seconds Duration of the stages of the tickers.\n";
+    out += "# TYPE cryptom_stage_duration_seconds histogram\n";
+    std::string labels;
+    for (const auto& entry: merged) {
+      for (size_t s = 0; s < nb_stages; s++) {
+	const latency_histogram::snapshot& snapshot = entry.second[s];
+	if (snapshot.count == 0) {
+	  continue;
+	}
+	labels = labels_of(entry.first, static_cast<stage>(s));
+	for (double bound: bucket_bounds) {
+	  append(out, "cryptom_stage_duration_seconds_bucket{%s,le=\"%g\"} %llu\n", labels.c_str(), bound,
+		 static_cast<unsigned long long>(snapshot.count_at_most(static_cast<uint64_t>(bound * 1e9))));
+	}
+	append(out, "cryptom_stage_duration_seconds_bucket{%s,le=\"+Inf\"} %llu\n", labels.c_str(),
+	       static_cast<unsigned long long>(snapshot.count));
+	append(out, "cryptom_stage_duration_seconds_sum{%s} %.9f\n", labels.c_str(), snapshot.sum / 1e9);
+	append(out, "cryptom_stage_duration_seconds_count{%s} %llu\n", labels.c_str(),
+	       static_cast<unsigned long long>(snapshot.count));
+      }
+    }
+
+    out += "# HELP cryptom_stage_duration_quantile_seconds Quantiles of the duration of the stages, within 1/16.\n";
+    out += "# TYPE cryptom_stage_duration_quantile_seconds gauge\n";
+    for (const auto& entry: merged) {
+      for (size_t s = 0; s < nb_stages; s++) {
+	const latency_histogram::snapshot& snapshot = entry.second[s];
+	if (snapshot.count == 0) {
+	  continue;
+	}
+	labels = labels_of(entry.first, static_cast<stage>(s));
+	for (double q: quantiles) {
+	  append(out, "cryptom_stage_duration_quantile_seconds{%s,quantile=\"%g\"} %.9f\n", labels.c_str(), q,
+		 snapshot.quantile(q) / 1e9);
+	}
+	append(out, "cryptom_stage_duration_quantile_seconds{%s,quantile=\"1\"} %.9f\n", labels.c_str(),
+	       snapshot.max / 1e9);
+      }
+    }
+  }
+
+  metrics_server::metrics_server(metrics_registry& registry):
+    registry_(registry),
+    base_(event_base_new()),
+    http_(nullptr) {
+    if (base_ != nullptr) {
+      http_ = evhttp_new(base_);
+    }
+  }
+
+  metrics_server::~metrics_server() {
+    stop();
+
+    if (http_ != nullptr)
+      evhttp_free(http_);
+
+    if (base_ != nullptr)
+      event_base_free(base_);
+  }
+
+  int metrics_server::start(const char *address, int port) {
+    if (http_ == nullptr || thread_.joinable()) {
+      return -1;
+    }
+
+    if (evhttp_bind_socket(http_, address, port) != 0) {
+      std::cerr << "Cannot listen on " << address << ":" << port << " for the metrics\n";
+      return -1;
+    }
+    evhttp_set_allowed_methods(http_, EVHTTP_REQ_GET);
+    evhttp_set_gencb(http_, &metrics_server::libevent_request, this);
+
+    std::cout << "Metrics on http://" << address << ":" << port << "/metrics" << std::endl;
+    event_base *base = base_;
+    thread_ = std::thread([base]() {
+	event_base_loop(base, EVLOOP_NO_EXIT_ON_EMPTY);
+      });
+    return 0;
+  }
+
+  void metrics_server::stop() {
+    if (!thread_.joinable()) {
+      return;
+    }
+    event_base_loopexit(base_, NULL);
+    thread_.join();
+  }
+
+  void metrics_server::on_request(evhttp_request *req) {
+    const char *path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+    if (path == NULL || strcmp(path, "/metrics") != 0) {
+      evhttp_send_error(req, HTTP_NOTFOUND, NULL);
+      return;
+    }
+
+    std::string text;
+    registry_.write_prometheus(text);
+
+    evhttp_add_header(evhttp_request_get_output_headers(req), "Content-Type", "text/plain; version=0.0.4");
+    evbuffer *reply = evbuffer_new();
+    evbuffer_add(reply, text.data(), text.size());
+    evhttp_send_reply(req, HTTP_OK, "OK", reply);
+    evbuffer_free(reply);
+  }
+
+}
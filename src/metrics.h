@@ -0,0 +1,150 @@
+#pragma once
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include "latency_histogram.h"
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace cryptom {
+
+  /*
+    Stages of a ticker, from the resolution of the exchange host to the consumer.
+  */
+  enum class stage {
+    // Resolution of the host by the DNS cache.
+    dns,
+    // TCP connection, up to the start of the TLS handshake on https.
+    connect,
+    tls_handshake,
+    // From the request written to the socket to the headers of the response.
+    first_byte,
+    // From the headers to the end of the response.
+    body_read,
+    // Building the JSON document. Includes the conversion when both are done in one
+    // pass (the SAX reader of binance).
+    json_parse,
+    // From the document to the tickers.
+    conversion,
+    // In the ticker_channel, from the push to the pop.
+    queue_dwell,
+    // What the consumer does with a ticker.
+    consumer
+  };
+
+  static const size_t nb_stages = static_cast<size_t>(stage::consumer) + 1;
+
+  // Name of the stage in the metrics, "json_parse".
+  const char* stage_name(stage s);
+
+  /*
+    Histograms of the stages recorded by one thread, for one exchange. See
+    metrics_registry::add_writer.
+  */
+  class stage_histograms {
+
+  public:
+    explicit stage_histograms(const std::string& exchange): exchange_(exchange) {}
+
+    // no copy or assignement
+    stage_histograms(const stage_histograms&) = delete;
+    stage_histograms& operator=(const stage_histograms&) = delete;
+
+    // Only from the thread which writes the histograms.
+    void record(stage s, int64_t ns) { stages_[static_cast<size_t>(s)].record(ns); }
+
+    /**
+       Record the parse and the conversion of a document, from start to end, split at
+       parsed (see json_arena::parsed_at). Without that time, both go to json_parse.
+     */
+    void record_parse(int64_t start, int64_t parsed, int64_t end) {
+      if (parsed >= start && parsed <= end) {
+	record(stage::json_parse, parsed - start);
+	record(stage::conversion, end - parsed);
+      } else {
+	record(stage::json_parse, end - start);
+      }
+    }
+
+    const std::string& exchange() const { return exchange_; }
+    const latency_histogram& histogram(stage s) const { return stages_[static_cast<size_t>(s)]; }
+
+  private:
+    std::string exchange_;
+    latency_histogram stages_[nb_stages];
+  };
+
+  /*
+    All the stage histograms of the process. Each thread records into histograms of
+    its own, so the hot path never contends; the histograms of an exchange are merged
+    when the metrics are read.
+  */
+  class metrics_registry {
+
+  public:
+    static metrics_registry& global();
+
+    // no copy or assignement
+    metrics_registry(const metrics_registry&) = delete;
+    metrics_registry& operator=(const metrics_registry&) = delete;
+
+    /**
+       New histograms of the stages of the exchange, to be written by one thread. Empty
+       exchange for the stages which are not tied to one (the consumer). They are kept
+       until the end of the process.
+     */
+    stage_histograms* add_writer(const std::string& exchange);
+
+    /**
+       Append the histograms in the Prometheus text format: one histogram
+       cryptom_stage_duration_seconds{stage, exchange} and its quantiles. The stages
+       without sample are left out. Can be called from any thread.
+     */
+    void write_prometheus(std::string& out) const;
+
+  private:
+    metrics_registry() {}
+
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<stage_histograms>> writers_;
+  };
+
+  /*
+    HTTP server of the metrics (GET /metrics) for Prometheus, on a local port. Runs
+    its own event loop so that a scrape never delays the clients.
+  */
+  class metrics_server {
+
+  public:
+    explicit metrics_server(metrics_registry& registry);
+    ~metrics_server();
+
+    // no copy or assignement
+    metrics_server(const metrics_server&) = delete;
+    metrics_server& operator=(const metrics_server&) = delete;
+
+    /**
+       Listen on address:port and start the thread of the event loop. Will return 0 if
+       ok.
+     */
+    int start(const char *address, int port);
+
+    // Stop the event loop and wait for the thread.
+    void stop();
+
+  private:
+    metrics_registry& registry_;
+    event_base *base_;
+    evhttp *http_;
+    std::thread thread_;
+
+    static void libevent_request(evhttp_request *req, void *ctx) {
+      static_cast<metrics_server*>(ctx)->on_request(req);
+    }
+    void on_request(evhttp_request *req);
+  };
+
+}
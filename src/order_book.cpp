@@ -0,0 +1,106 @@
+#include "order_book.h"
+
+#include <algorithm>
+
+namespace cryptom {
+
+  order_book::order_book(size_t depth):
+    last_update_id_(0),
+    synced_(false) {
+    bids_.reserve(depth);
+    asks_.reserve(depth);
+  }
+
+  void order_book::load_snapshot(uint64_t last_update_id,
+				 const std::vector<price_level>& bids,
+				 const std::vector<price_level>& asks) {
+    bids_.assign(bids.begin(), bids.end());
+    asks_.assign(asks.begin(), asks.end());
+    std::sort(bids_.begin(), bids_.end(),
+	      [](const price_level& a, const price_level& b) { return a.price < b.price; });
+    std::sort(asks_.begin(), asks_.end(),
+	      [](const price_level& a, const price_level& b) { return a.price > b.price; });
+
+    // The snapshots do not list empty levels, but who knows.
+    auto empty = [](const price_level& l) { return l.quantity == 0; };
+    bids_.erase(std::remove_if(bids_.begin(), bids_.end(), empty), bids_.end());
+    asks_.erase(std::remove_if(asks_.begin(), asks_.end(), empty), asks_.end());
+
+    last_update_id_ = last_update_id;
+    synced_ = true;
+    ++stats_.snapshots;
+  }
+
+  order_book::status order_book::apply(const depth_update& update) {
+    if (!synced_) {
+      return unsynced;
+    }
+    if (update.last_id <= last_update_id_) {
+      ++stats_.stale;
+      return stale;
+    }
+    if (update.first_id > last_update_id_ + 1) {
+      ++stats_.gaps;
+      synced_ = false;
+      return gap;
+    }
+
+    for (const price_level& l: update.bids) {
+      set(bid, l.price, l.quantity);
+    }
+    for (const price_level& l: update.asks) {
+      set(ask, l.price, l.quantity);
+    }
+    last_update_id_ = update.last_id;
+    ++stats_.updates;
+    stats_.levels += update.bids.size() + update.asks.size();
+    return applied;
+  }
+
+  void order_book::set(side s, double price, double quantity) {
+    std::vector<price_level>& l = s == bid ? bids_ : asks_;
+
+    // First level at this price or better. The updates are mostly near the best price,
+    // at the end, so the insertions and removals move few levels.
+    auto it = std::lower_bound(l.begin(), l.end(), price,
+			       [s](const price_level& level, double p) { return better(s, p, level.price); });
+    bool found = it != l.end() && it->price == price;
+
+    if (quantity == 0) {
+      if (found) {
+	l.erase(it);
+      }
+    } else if (found) {
+      it->quantity = quantity;
+    } else {
+      l.insert(it, price_level{price, quantity});
+    }
+  }
+
+  double order_book::take(const std::vector<price_level>& levels, double quantity, double& filled) {
+    double value = 0;
+    filled = 0;
+    for (auto it = levels.rbegin(); it != levels.rend() && filled < quantity; ++it) {
+      double taken = std::min(it->quantity, quantity - filled);
+      value += taken * it->price;
+      filled += taken;
+    }
+    return value;
+  }
+
+  double order_book::sell_value(double quantity, double& filled) const {
+    return take(bids_, quantity, filled);
+  }
+
+  double order_book::buy_cost(double quantity, double& filled) const {
+    return take(asks_, quantity, filled);
+  }
+
+  void order_book::clear() {
+    bids_.clear();
+    asks_.clear();
+    last_update_id_ = 0;
+    synced_ = false;
+  }
+
+}
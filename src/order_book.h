@@ -0,0 +1,134 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace cryptom {
+
+  struct price_level {
+    double price;
+    // 0 in an update removes the level.
+    double quantity;
+  };
+
+  /*
+    Diff of the book of a market: the levels changed by the updates first_id to
+    last_id of the exchange.
+  */
+  struct depth_update {
+    uint64_t first_id = 0;
+    uint64_t last_id = 0;
+    std::vector<price_level> bids;
+    std::vector<price_level> asks;
+  };
+
+  /*
+    Level 2 order book of a market, bootstrapped from a snapshot and kept up to date by
+    the diffs. The levels of each side are in a contiguous array sorted from the worst
+    price to the best, so the best level is the last one: reading the top of the book
+    is O(1), and the updates, which mostly touch the levels near the top, only move a
+    few levels. Once the arrays have grown to the depth of the book, the updates do not
+    allocate.
+
+    Not thread safe.
+  */
+  class order_book {
+
+  public:
+    enum side { bid, ask };
+
+    enum status {
+      applied,
+      // Older than the snapshot, ignored.
+      stale,
+      // Updates were missed: the book is out of sync until the next snapshot.
+      gap,
+      // No snapshot yet.
+      unsynced
+    };
+
+    struct stats {
+      unsigned long snapshots = 0;
+      unsigned long updates = 0;
+      // Levels changed by the updates.
+      unsigned long levels = 0;
+      unsigned long stale = 0;
+      unsigned long gaps = 0;
+    };
+
+    // Room for depth levels on each side, the arrays grow if needed.
+    explicit order_book(size_t depth = 1024);
+
+    /**
+       Replace the book with a snapshot, taken after the update last_update_id. The
+       levels can be in any order.
+     */
+    void load_snapshot(uint64_t last_update_id,
+		       const std::vector<price_level>& bids,
+		       const std::vector<price_level>& asks);
+
+    /**
+       Apply a diff. It must hold the update after the last one applied (the first diff
+       after the snapshot may start before it), otherwise updates were missed and the
+       book is out of sync (gap).
+     */
+    status apply(const depth_update& update);
+
+    // Set the quantity of a level, remove it if 0. Does not check the sequence.
+    void set(side s, double price, double quantity);
+
+    bool synced() const { return synced_; }
+    uint64_t last_update_id() const { return last_update_id_; }
+
+    // Number of levels of a side.
+    size_t size(side s) const { return levels(s).size(); }
+
+    // The nth best level of a side, from 0. n < size(s).
+    const price_level& level(side s, size_t n) const {
+      const std::vector<price_level>& l = levels(s);
+      return l[l.size() - 1 - n];
+    }
+
+    // Best level of a side, NULL if empty.
+    const price_level* best(side s) const {
+      const std::vector<price_level>& l = levels(s);
+      return l.empty() ? nullptr : &l.back();
+    }
+
+    /**
+       What selling quantity at market would give, taking the bids from the best one.
+       filled is the quantity the bids could take, less than quantity if the book is
+       not deep enough.
+     */
+    double sell_value(double quantity, double& filled) const;
+
+    // What buying quantity at market would cost, taking the asks from the best one.
+    double buy_cost(double quantity, double& filled) const;
+
+    void clear();
+
+    const stats& get_stats() const { return stats_; }
+
+  private:
+    // From the worst price to the best: bids by increasing prices, asks by decreasing
+    // prices.
+    std::vector<price_level> bids_;
+    std::vector<price_level> asks_;
+
+    uint64_t last_update_id_;
+    bool synced_;
+
+    stats stats_;
+
+    const std::vector<price_level>& levels(side s) const { return s == bid ? bids_ : asks_; }
+
+    // Price of a side is better than the other.
+    static bool better(side s, double price, double other) {
+      return s == bid ? price > other : price < other;
+    }
+
+    static double take(const std::vector<price_level>& levels, double quantity, double& filled);
+  };
+
+}
@@ -0,0 +1,111 @@
+#include "portfolio.h"
+
+#include <cmath>
+
+namespace cryptom {
+
+  const unsigned portfolio::resum_interval;
+
+  portfolio::portfolio(double epsilon):
+    epsilon_(epsilon),
+    base_quantity_(0),
+    total_(0),
+    reported_total_(0),
+    held_(0),
+    priced_(0),
+    revalued_(0) {
+  }
+
+  void portfolio::set_quantity(symbol_id coin, double quantity) {
+    // The ids are dense, the array grows up to the largest symbol held.
+    if (coin >= positions_.size()) {
+      positions_.resize(coin + 1);
+    }
+
+    position& p = positions_[coin];
+    if (!p.held) {
+      p.held = true;
+      ++held_;
+    }
+    p.quantity = quantity;
+    if (p.priced) {
+      revalue(p, quantity * p.price);
+    }
+  }
+
+  void portfolio::remove(symbol_id coin) {
+    if (coin >= positions_.size() || !positions_[coin].held) {
+      return;
+    }
+
+    position& p = positions_[coin];
+    revalue(p, 0);
+    --held_;
+    if (p.priced) {
+      --priced_;
+    }
+    p = position();
+  }
+
+  void portfolio::set_base_quantity(double quantity) {
+    total_ += quantity - base_quantity_;
+    base_quantity_ = quantity;
+  }
+
+  double portfolio::value_of(symbol_id coin) const {
+    return coin < positions_.size() ? positions_[coin].value : 0.0;
+  }
+
+  void portfolio::revalue(position& p, double value) {
+    total_ += value - p.value;
+    p.value = value;
+    if (++revalued_ == resum_interval) {
+      resum();
+    }
+  }
+
+  void portfolio::resum() {
+    // Sparse rows, but O(largest symbol held) every resum_interval updates is noise.
+    double total = base_quantity_;
+    for (const position& p: positions_) {
+      total += p.value;
+    }
+    total_ = total;
+    revalued_ = 0;
+  }
+
+  bool portfolio::update(symbol_id coin, double price, change& out) {
+    if (coin >= positions_.size()) {
+      return false;
+    }
+    position& p = positions_[coin];
+    if (!p.held) {
+      return false;
+    }
+
+    p.price = price;
+    bool first = !p.priced;
+    if (first) {
+      p.priced = true;
+      ++priced_;
+    }
+    revalue(p, p.quantity * p.price);
+
+    if (!first &&
+	std::fabs(p.value - p.reported) <= epsilon_ &&
+	std::fabs(total_ - reported_total_) <= epsilon_) {
+      return false;
+    }
+
+    p.reported = p.value;
+    reported_total_ = total_;
+
+    out.coin = coin;
+    out.quantity = p.quantity;
+    out.price = p.price;
+    out.value = p.value;
+    out.total = total_;
+    return true;
+  }
+
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include "symbol_table.h"
+#include <vector>
+
+namespace cryptom {
+
+  /*
+    Value of the portfolio in the base currency, updated with the prices of the coins
+    in the base currency (see currency_graph). Each price updates the row of its coin and
+    the running total in O(1). The rounding errors of the running total add up, so it is
+    summed again from the rows every resum_interval updates.
+
+    The rows are in a flat array indexed by symbol_id. A change is reported only when
+    the value of the row, or the total, moved by more than epsilon since it was last
+    reported, so the GUI is not flooded by the tiny moves of the prices.
+
+    Not thread safe, meant for the thread reading the ticker channel.
+  */
+  class portfolio {
+
+  public:
+    // What the GUI is told when a value moves.
+    struct change {
+      symbol_id coin;
+      double quantity;
+      double price;
+      // quantity * price, in the base currency.
+      double value;
+      double total;
+    };
+
+    // epsilon is in the base currency.
+    explicit portfolio(double epsilon);
+
+    /**
+       Hold quantity of the coin (e.g. 2.42 ETH). Replaces the previous quantity. Its
+       value is counted once its price is known.
+     */
+    void set_quantity(symbol_id coin, double quantity);
+
+    // Stop holding the coin: its row leaves the total.
+    void remove(symbol_id coin);
+
+    // Hold quantity of the base currency itself.
+    void set_base_quantity(double quantity);
+
+    /**
+       Update the row of the coin with its price in the base currency. Return true and
+       fill the change if it must be reported. Coins not held are ignored.
+     */
+    bool update(symbol_id coin, double price, change& out);
+
+    double total() const { return total_; }
+
+    // Value of the row of the coin, 0 if not held or not priced yet.
+    double value_of(symbol_id coin) const;
+
+    // All the coins held have a price: the total is the value of the whole portfolio.
+    bool complete() const { return priced_ == held_; }
+
+  private:
+    static const unsigned resum_interval = 1024;
+
+    struct position {
+      double quantity = 0;
+      double price = 0;
+      double value = 0;
+      // Value when the row was last reported.
+      double reported = 0;
+      bool held = false;
+      bool priced = false;
+    };
+
+    double epsilon_;
+
+    std::vector<position> positions_;
+
+    double base_quantity_;
+    double total_;
+    // Total when last reported.
+    double reported_total_;
+
+    size_t held_;
+    size_t priced_;
+
+    // Updates of the total since it was summed from the rows.
+    unsigned revalued_;
+
+    // Apply the new value of the row to the total.
+    void revalue(position& p, double value);
+    // Sum the total from the rows again.
+    void resum();
+  };
+
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace cryptom {
+
+  /*
+    Pointer to a value replaced by other threads and read by one thread without lock,
+    in the manner of RCU: the writer publishes a new value and retires the old one,
+    which is freed once the reader has announced that it holds no pointer read before
+    (quiescent state).
+
+    The reader never blocks nor waits: read() is one atomic load. The values retired
+    while the reader is busy are kept until its next quiescent(), and freed by the next
+    publish().
+  */
+  template <typename T>
+  class rcu_pointer {
+
+  public:
+    explicit rcu_pointer(std::unique_ptr<T> value):
+      current_(value.release()),
+      version_(1),
+      quiescent_(0) {
+    }
+
+    ~rcu_pointer() {
+      delete current_.load();
+      for (auto& entry: retired_) {
+	delete entry.second;
+      }
+    }
+
+    // no copy or assignement
+    rcu_pointer(const rcu_pointer&) = delete;
+    rcu_pointer& operator=(const rcu_pointer&) = delete;
+
+    /**
+       Current value, for the reader only. It is valid until the next call to
+       quiescent().
+     */
+    const T* read() const { return current_.load(std::memory_order_acquire); }
+
+    // Number of values published, to know cheaply whether the value changed.
+    uint64_t version() const { return version_.load(std::memory_order_acquire); }
+
+    /**
+       The reader holds no pointer read before: the values replaced so far may be freed.
+     */
+    void quiescent() {
+      quiescent_.store(version_.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    // Replace the value. From any thread but the reader.
+    void publish(std::unique_ptr<T> value) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      T *old = current_.exchange(value.release(), std::memory_order_acq_rel);
+      // The old value may be read until the reader has seen this version.
+      uint64_t version = version_.fetch_add(1, std::memory_order_acq_rel) + 1;
+      retired_.emplace_back(version, old);
+
+      uint64_t seen = quiescent_.load(std::memory_order_acquire);
+      auto it = retired_.begin();
+      for (; it != retired_.end() && it->first <= seen; ++it) {
+	delete it->second;
+      }
+      retired_.erase(retired_.begin(), it);
+    }
+
+  private:
+    std::atomic<T*> current_;
+    std::atomic<uint64_t> version_;
+    // Last version seen by the reader in a quiescent state.
+    std::atomic<uint64_t> quiescent_;
+
+    // Serializes the writers.
+    std::mutex mutex_;
+    // Values replaced, with the version which replaced them, oldest first.
+    std::vector<std::pair<uint64_t, T*>> retired_;
+  };
+
+}
@@ -0,0 +1,290 @@
+#include "request_scheduler.h"
+#include <event2/http.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+
+namespace cryptom {
+
+  rate_limit rate_limit_of(const std::string& exchange) {
+    if (exchange == "binance") {
+      // 1200 weight per minute and per IP. The 24hr ticker weighs 1 for a symbol and
+      // 40 for all the markets.
+      return rate_limit{1200, std::chrono::seconds(60), 1, 40, "X-MBX-USED-WEIGHT-1M", nullptr};
+    }
+
+    if (exchange == "kucoin") {
+      // Public pool of 2000 weight per 30 seconds. The ticker weighs 2, all the
+      // tickers 15.
+      return rate_limit{2000, std::chrono::seconds(30), 2, 15, nullptr, "gw-ratelimit-remaining"};
+    }
+
+    return rate_limit{60, std::chrono::seconds(60), 1, 10, nullptr, nullptr};
+  }
+
+  const int request_scheduler::probe_timeout_ms;
+
+  request_scheduler::request_scheduler(timer_wheel *wheel, const rate_limit& limit, const std::string& host):
+    wheel_(wheel),
+    limit_(limit),
+    host_(host),
+    tokens_(limit.budget),
+    refilled_(clock::now()),
+    breaker_(breaker_state::closed),
+    host_failures_(0),
+    breaker_opens_(0),
+    probe_(nullptr),
+    random_(std::random_device()()) {
+  }
+
+  void request_scheduler::add(task *t, timeval period, int weight) {
+    entry& e = entries_[t];
+    e.scheduler = this;
+    e.polled = t;
+    e.period = std::chrono::seconds(period.tv_sec) + std::chrono::microseconds(period.tv_usec);
+    e.weight = weight;
+
+    // The clients of a host are created together, so spreading them again each time
+    // one is added does not delay anything.
+    spread();
+  }
+
+  void request_scheduler::remove(task *t) {
+    // Cancels its timer.
+    entries_.erase(t);
+
+    // Its request is cancelled without answer: let another task probe.
+    if (breaker_ == breaker_state::half_open && probe_ == t) {
+      breaker_ = breaker_state::open;
+      breaker_until_ = clock::now();
+      probe_ = nullptr;
+    }
+  }
+
+  void request_scheduler::spread() {
+    clock::time_point now = clock::now();
+
+    size_t n = entries_.size();
+    size_t i = 0;
+    for (auto& it: entries_) {
+      entry& e = it.second;
+      e.grid = now + e.period * i / n;
+      e.retrying = false;
+      wheel_->schedule(&e, std::max(now, e.grid + jitter(e)));
+      ++i;
+    }
+  }
+
+  request_scheduler::clock::duration request_scheduler::jitter(const entry& e) {
+    // At most a quarter of the gap between two tasks, so they never swap, and at most
+    // a tenth of the period.
+    clock::duration bound = std::min(e.period / (4 * static_cast<long>(entries_.size())), e.period / 10);
+    long us = std::chrono::duration_cast<std::chrono::microseconds>(bound).count();
+    if (us <= 0) {
+      return clock::duration::zero();
+    }
+    std::uniform_int_distribution<long> distribution(-us, us);
+    return std::chrono::microseconds(distribution(random_));
+  }
+
+  request_scheduler::clock::duration request_scheduler::backoff(int base_ms, int max_ms, int n) {
+    long ms = base_ms;
+    for (int i = 1; i < n && ms < max_ms; i++) {
+      ms *= 2;
+    }
+    ms = std::min(ms, static_cast<long>(max_ms));
+    // Never all at once after a failure of the host.
+    std::uniform_int_distribution<long> distribution(ms / 2, ms);
+    return std::chrono::milliseconds(distribution(random_));
+  }
+
+  void request_scheduler::refill(clock::time_point now) {
+    double elapsed = std::chrono::duration<double>(now - refilled_).count();
+    double rate = static_cast<double>(limit_.budget) / limit_.window.count();
+    tokens_ = std::min(static_cast<double>(limit_.budget), tokens_ + elapsed * rate);
+    refilled_ = now;
+  }
+
+  bool request_scheduler::try_spend(task *t) {
+    auto it = entries_.find(t);
+    if (it == entries_.end()) {
+      return false;
+    }
+
+    clock::time_point now = clock::now();
+    refill(now);
+    if (now < paused_until_ || breaker_ != breaker_state::closed || tokens_ < it->second.weight) {
+      ++stats_.hedges_throttled;
+      return false;
+    }
+    tokens_ -= it->second.weight;
+    return true;
+  }
+
+  void request_scheduler::run(entry& e) {
+    clock::time_point now = clock::now();
+    if (now < paused_until_) {
+      wheel_->schedule(&e, paused_until_);
+      return;
+    }
+    if (paused_until_ != clock::time_point()) {
+      // All the tasks are late after a pause, resume them spread over their period
+      // rather than in a burst.
+      paused_until_ = clock::time_point();
+      spread();
+      return;
+    }
+
+    if (breaker_ == breaker_state::half_open) {
+      if (now < probe_until_) {
+	// Wait for the answer to the probe.
+	wheel_->schedule(&e, now + e.period);
+	return;
+      }
+      fprintf(stderr, "%s: no answer to the probe, probing again\n", host_.c_str());
+      breaker_ = breaker_state::open;
+      breaker_until_ = now;
+      probe_ = nullptr;
+    }
+    if (breaker_ == breaker_state::open && now < breaker_until_) {
+      wheel_->schedule(&e, breaker_until_);
+      return;
+    }
+    // Once the breaker has been open long enough, the first task probes the host.
+    bool probe = breaker_ == breaker_state::open;
+
+    refill(now);
+
+    if (tokens_ < e.weight) {
+      // Wait until the bucket has refilled enough for this request.
+      ++stats_.throttled;
+      double rate = static_cast<double>(limit_.budget) / limit_.window.count();
+      double wait = (e.weight - tokens_) / rate;
+      wheel_->schedule(&e, now + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(wait)));
+      return;
+    }
+
+    if (e.polled->poll()) {
+      tokens_ -= e.weight;
+      ++stats_.requests;
+      if (e.retrying)
+	++stats_.retries;
+      if (probe) {
+	breaker_ = breaker_state::half_open;
+	probe_ = e.polled;
+	probe_until_ = now + std::chrono::milliseconds(probe_timeout_ms);
+      }
+    } else {
+      ++stats_.skipped;
+    }
+
+    if (e.retrying) {
+      // The retry replaces the slots which passed meanwhile.
+      e.retrying = false;
+      while (e.grid <= now) {
+	e.grid += e.period;
+      }
+    } else {
+      // Next slot on the grid. After a long delay, skip the slots we missed instead of
+      // firing them in a burst.
+      e.grid += e.period;
+      while (e.grid + e.period <= now) {
+	e.grid += e.period;
+      }
+    }
+    wheel_->schedule(&e, std::max(now, e.grid + jitter(e)));
+  }
+
+  void request_scheduler::on_response(task *t, int status, const evkeyvalq *headers) {
+    clock::time_point now = clock::now();
+    refill(now);
+
+    // The exchange counts the weight of all the clients of our IP, trust it when it
+    // says we have used more than we think.
+    if (headers != nullptr && limit_.used_header != nullptr) {
+      const char *used = evhttp_find_header(headers, limit_.used_header);
+      if (used != nullptr) {
+	tokens_ = std::min(tokens_, static_cast<double>(limit_.budget - atoi(used)));
+      }
+    }
+    if (headers != nullptr && limit_.remaining_header != nullptr) {
+      const char *remaining = evhttp_find_header(headers, limit_.remaining_header);
+      if (remaining != nullptr) {
+	tokens_ = std::min(tokens_, static_cast<double>(atoi(remaining)));
+      }
+    }
+
+    // 429: too many requests, 418: banned by binance for not respecting the 429.
+    const char *retry_after = headers != nullptr ? evhttp_find_header(headers, "Retry-After") : nullptr;
+    if (status == 429 || status == 418 || (status == 503 && retry_after != nullptr)) {
+      int seconds = retry_after != nullptr ? atoi(retry_after) : 0;
+      if (seconds <= 0) {
+	seconds = default_pause_seconds;
+      }
+
+      paused_until_ = std::max(paused_until_, now + std::chrono::seconds(seconds));
+      ++stats_.pauses;
+      fprintf(stderr, "%s asks to wait %ds (HTTP %d)\n", host_.c_str(), seconds, status);
+    }
+
+    // The host is unwell, unless it only asked to slow down.
+    if (status >= 500 && !(status == 503 && retry_after != nullptr)) {
+      ++stats_.failures;
+      failed(t);
+    } else {
+      succeeded(t);
+    }
+  }
+
+  void request_scheduler::on_failure(task *t, bool timed_out) {
+    ++stats_.failures;
+    if (timed_out)
+      ++stats_.timeouts;
+    failed(t);
+  }
+
+  void request_scheduler::failed(task *t) {
+    clock::time_point now = clock::now();
+
+    ++host_failures_;
+    probe_ = nullptr;
+    if (breaker_ == breaker_state::half_open ||
+	(breaker_ == breaker_state::closed && host_failures_ >= breaker_threshold)) {
+      breaker_ = breaker_state::open;
+      clock::duration wait = backoff(breaker_base_ms, breaker_max_ms, ++breaker_opens_);
+      breaker_until_ = now + wait;
+      ++stats_.breaker_opens;
+      fprintf(stderr, "%s failed %d times in a row, no request for %ldms\n", host_.c_str(), host_failures_,
+	      static_cast<long>(std::chrono::duration_cast<std::chrono::milliseconds>(wait).count()));
+    }
+
+    // Removed meanwhile.
+    auto it = entries_.find(t);
+    if (it == entries_.end()) {
+      return;
+    }
+    entry& e = it->second;
+    ++e.failures;
+    e.retrying = true;
+    wheel_->schedule(&e, now + backoff(retry_base_ms, retry_max_ms, e.failures));
+  }
+
+  void request_scheduler::succeeded(task *t) {
+    host_failures_ = 0;
+    probe_ = nullptr;
+    auto it = entries_.find(t);
+    if (it != entries_.end()) {
+      it->second.failures = 0;
+    }
+
+    if (breaker_ != breaker_state::closed) {
+      breaker_ = breaker_state::closed;
+      breaker_opens_ = 0;
+      fprintf(stderr, "%s answers again\n", host_.c_str());
+      // Resume the tasks spread over their period rather than in a burst.
+      spread();
+    }
+  }
+
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+#include <event2/keyvalq_struct.h>
+#include "timer_wheel.h"
+#include <chrono>
+#include <map>
+#include <random>
+#include <string>
+
+namespace cryptom {
+
+  /*
+    Request limits of the public REST endpoints of an exchange.
+  */
+  struct rate_limit {
+    // Weight the exchange allows in each window.
+    int budget;
+    std::chrono::seconds window;
+    // Weight of the ticker request of one market, and of all the markets.
+    int market_weight;
+    int all_markets_weight;
+    // Response headers giving the weight used in the current window, or the weight
+    // remaining. NULL when the exchange has none.
+    const char *used_header;
+    const char *remaining_header;
+  };
+
+  /**
+     Limits of an exchange ("binance" or "kucoin"), conservative ones if unknown.
+   */
+  rate_limit rate_limit_of(const std::string& exchange);
+
+  /*
+    Schedules the requests of all the clients of an exchange host, on the timer wheel
+    of its event loop.
+
+    The clients are spread evenly over their period, with some jitter, instead of
+    firing all at once. A token bucket holds the weight budget of the exchange: a
+    request which does not fit waits for the bucket to refill. The bucket follows the
+    used/remaining weight headers of the responses, and Retry-After (or a 429/418)
+    pauses all the requests to the host.
+
+    A task whose request failed (no response, or a 5xx) is retried before its next
+    slot, after an exponential backoff with jitter. After breaker_threshold failures in
+    a row on the host, the circuit breaker opens: no request is sent to the host for a
+    while, then a single one probes it. The breaker closes at the first success,
+    otherwise it stays open twice as long. If the probe never answers (its task was
+    removed, or the answer was lost), another task probes again.
+  */
+  class request_scheduler {
+
+  public:
+    /*
+      What the scheduler polls.
+    */
+    class task {
+    public:
+      virtual ~task() {}
+
+      // Send the request. Return false if it was not sent (e.g. the previous one is
+      // still in flight), then no weight is used.
+      virtual bool poll() = 0;
+    };
+
+    struct stats {
+      unsigned long requests = 0;
+      // Requests delayed because the budget was used.
+      unsigned long throttled = 0;
+      // Polls which sent nothing.
+      unsigned long skipped = 0;
+      // Pauses asked by the exchange.
+      unsigned long pauses = 0;
+      // Requests without response or with a 5xx, and the ones which timed out.
+      unsigned long failures = 0;
+      unsigned long timeouts = 0;
+      unsigned long retries = 0;
+      // Times the circuit breaker of the host opened.
+      unsigned long breaker_opens = 0;
+      // Second requests sent when the first was slow, and the ones answered first.
+      unsigned long hedges = 0;
+      unsigned long hedges_won = 0;
+      // Hedged requests not sent, for lack of budget or while the host is paused or
+      // failing.
+      unsigned long hedges_throttled = 0;
+    };
+
+    request_scheduler(timer_wheel *wheel, const rate_limit& limit, const std::string& host);
+
+    // no copy or assignement
+    request_scheduler(const request_scheduler&) = delete;
+    request_scheduler& operator=(const request_scheduler&) = delete;
+
+    const rate_limit& limit() const { return limit_; }
+
+    // Poll the task every period, using weight of the budget each time.
+    void add(task *t, timeval period, int weight);
+    void remove(task *t);
+
+    // To call with the status and headers of each response to the task.
+    void on_response(task *t, int status, const evkeyvalq *headers);
+
+    // To call when the request of the task got no response.
+    void on_failure(task *t, bool timed_out);
+
+    /**
+       Take the weight of the task from the budget for a request sent outside of its
+       schedule (a hedged request). Return false, and take nothing, if the budget is
+       short or the host paused: the request must not be sent.
+     */
+    bool try_spend(task *t);
+
+    // To call when a hedged request of the task is over.
+    void on_hedge(bool won) {
+      ++stats_.hedges;
+      if (won)
+	++stats_.hedges_won;
+    }
+
+    const stats& get_stats() const { return stats_; }
+
+  private:
+    typedef timer_wheel::clock clock;
+
+    struct entry: timer_wheel::timer {
+      request_scheduler *scheduler;
+      task *polled;
+      clock::duration period;
+      int weight;
+      // Time of the task on the even grid, the timer fires with some jitter around it.
+      clock::time_point grid;
+      // Failures in a row, and whether the timer is set for a retry.
+      int failures = 0;
+      bool retrying = false;
+
+      void expire() { scheduler->run(*this); }
+    };
+
+    // Pause when the exchange complains without saying for how long.
+    static const int default_pause_seconds = 30;
+
+    // Backoff of the retries of a task, doubled at each failure.
+    static const int retry_base_ms = 250;
+    static const int retry_max_ms = 60000;
+
+    // Failures in a row which open the breaker, and for how long, doubled each time
+    // the probe fails.
+    static const int breaker_threshold = 5;
+    static const int breaker_base_ms = 5000;
+    static const int breaker_max_ms = 120000;
+    // Longer than the timeouts of a request, see request_timeouts.
+    static const int probe_timeout_ms = 60000;
+
+    enum class breaker_state {
+      closed,
+      open,
+      // The probe is in flight.
+      half_open
+    };
+
+    timer_wheel *wheel_;
+    rate_limit limit_;
+    std::string host_;
+
+    // The timers of the tasks, cancelled when removed.
+    std::map<task*, entry> entries_;
+
+    // Token bucket of the weight budget.
+    double tokens_;
+    clock::time_point refilled_;
+
+    clock::time_point paused_until_;
+
+    breaker_state breaker_;
+    // Failures in a row of all the tasks.
+    int host_failures_;
+    // Opening of the breaker in a row, and when it lets the probe through.
+    int breaker_opens_;
+    clock::time_point breaker_until_;
+    // Task of the probe in flight, and when to stop waiting for its answer.
+    task *probe_;
+    clock::time_point probe_until_;
+
+    std::minstd_rand random_;
+
+    stats stats_;
+
+    void refill(clock::time_point now);
+    // Spread the tasks evenly over their period.
+    void spread();
+    clock::duration jitter(const entry& e);
+    // Random delay between half and all of base_ms * 2^(n - 1), at most max_ms.
+    clock::duration backoff(int base_ms, int max_ms, int n);
+    void failed(task *t);
+    void succeeded(task *t);
+    // The timer of the entry fired.
+    void run(entry& e);
+  };
+
+}
@@ -1,5 +1,4 @@
 #include "scheduled_client.h"
-#include "openssl_hostname_validation.h"
 #include <iostream>
 #include <cassert>
 #include <event2/bufferevent_ssl.h>
@@ -14,7 +13,6 @@
 #include <string.h>
 #include <errno.h>
 #include <openssl/err.h>
-#include "rapidjson/document.h"
 
 namespace cryptom {
 
@@ -25,210 +23,125 @@ namespace cryptom {
     fputs(msg, stderr);
   }
 
-  static void
-  err_openssl(const char *func)
-  {
-    fprintf (stderr, "%s failed:\n", func);
-
-    /* This is the OpenSSL function that prints the contents of the
-     * error stack to the specified file handle. */
-    ERR_print_errors_fp (stderr);
-
-    exit(1);
-  }
-
-
-  static int cert_verify_callback(X509_STORE_CTX *x509_ctx, void *arg)
-  {
-    char cert_str[256];
-    const char *host = (const char *) arg;
-    const char *res_str = "X509_verify_cert failed";
-    HostnameValidationResult res = Error;
-
-    /* This is the function that OpenSSL would call if we hadn't called
-     * SSL_CTX_set_cert_verify_callback().  Therefore, we are "wrapping"
-     * the default functionality, rather than replacing it. */
-    int ok_so_far = 0;
-
-    X509 *server_cert = NULL;
-
-    ok_so_far = X509_verify_cert(x509_ctx);
-
-    server_cert = X509_STORE_CTX_get_current_cert(x509_ctx);
-
-    if (ok_so_far) {
-      res = validate_hostname(host, server_cert);
-
-      switch (res) {
-      case MatchFound:
-	res_str = "MatchFound";
-	break;
-      case MatchNotFound:
-	res_str = "MatchNotFound";
-	break;
-      case NoSANPresent:
-	res_str = "NoSANPresent";
-	break;
-      case MalformedCertificate:
-	res_str = "MalformedCertificate";
-	break;
-      case Error:
-	res_str = "Error";
-	break;
-      default:
-	res_str = "WTF!";
-	break;
-      }
-    }
-
-    X509_NAME_oneline(X509_get_subject_name (server_cert),
-		      cert_str, sizeof (cert_str));
-
-    if (res == MatchFound) {
-      printf("https server '%s' has this certificate, "
-	     "which looks good to me:\n%s\n",
-	     host, cert_str);
-      return 1;
-    } else {
-      printf("Got '%s' for hostname '%s' and certificate:\n%s\n",
-	     res_str, host, cert_str);
-      return 0;
-    }
-  }
-
-
-  scheduled_client::scheduled_client(event_base *base, const char* url, timeval duration,
-				     boost::lockfree::queue<cryptom::ticker> *out_queue):
+  template <class Converter>
+  const uint64_t basic_scheduled_client<Converter>::hedge_min_samples;
+  template <class Converter>
+  const uint64_t basic_scheduled_client<Converter>::hedge_update;
+
+  template <class Converter>
+  basic_scheduled_client<Converter>::basic_scheduled_client(event_base *base, const char* url,
+							    timeval duration,
+							    request_scheduler *scheduler,
+							    connection_pool *pool,
+							    symbol_map symbols,
+							    ticker_channel *out_queue,
+							    size_t lane,
+							    stage_histograms *metrics,
+							    bool hedge):
     base_(base),
-    duration_(duration),
-    converter_(new binance_converter()),
-    out_queue_(out_queue){
+    scheduler_(scheduler),
+    pool_(pool),
+    evcon_(nullptr),
+    req_(nullptr),
+    symbols_(std::move(symbols)),
+    sent_(0),
+    received_(0),
+    error_(-1),
+    hedge_error_(-1),
+    out_queue_(out_queue),
+    lane_(lane),
+    metrics_(metrics),
+    hedge_evcon_(nullptr),
+    hedge_req_(nullptr),
+    hedge_received_(0),
+    hedge_timer_(nullptr),
+    nb_durations_(0),
+    hedge_delay_(0) {
 
     uri_ = evhttp_uri_parse(url);
 
-    ssl_ctx_ = SSL_CTX_new(SSLv23_method());
-    assert(ssl_ctx_);
-
-    /* TODO: Add certificate loading on Windows as well */
-    X509_STORE *store;
-    /* Attempt to use the system's trusted root certificates. */
-    store = SSL_CTX_get_cert_store(ssl_ctx_);
-    assert(X509_STORE_set_default_paths(store) == 1);
-
-    /* Ask OpenSSL to verify the server certificate.  Note that this
-     * does NOT include verifying that the hostname is correct.
-     * So, by itself, this means anyone with any legitimate
-     * CA-issued certificate for any website, can impersonate any
-     * other website in the world.  This is not good.  See "The
-     * Most Dangerous Code in the World" article at
-     * https://crypto.stanford.edu/~dabo/pubs/abstracts/ssl-client-bugs.html
-     */
-    SSL_CTX_set_verify(ssl_ctx_, SSL_VERIFY_PEER, NULL);
-
-    /* This is how we solve the problem mentioned in the previous
-     * comment.  We "wrap" OpenSSL's validation routine in our
-     * own routine, which also validates the hostname by calling
-     * the code provided by iSECPartners.  Note that even though
-     * the "Everything You've Always Wanted to Know About
-     * Certificate Validation With OpenSSL (But Were Afraid to
-     * Ask)" paper from iSECPartners says very explicitly not to
-     * call SSL_CTX_set_cert_verify_callback (at the bottom of
-     * page 2), what we're doing here is safe because our
-     * cert_verify_callback() calls X509_verify_cert(), which is
-     * OpenSSL's built-in routine which would have been called if
-     * we hadn't set the callback.  Therefore, we're just
-     * "wrapping" OpenSSL's routine, not replacing it. */
-    SSL_CTX_set_cert_verify_callback(ssl_ctx_, cert_verify_callback,
-				     (void *) evhttp_uri_get_host(uri_));
-
-    timer_ = evtimer_new(base, &scheduled_client::libevent_timeout, (void*) this);
+    if (hedge) {
+      hedge_timer_ = evtimer_new(base_, &basic_scheduled_client::libevent_hedge, this);
+      durations_.reset(new latency_histogram);
+    }
 
-    execute_query();
+    // Without a query, the endpoint gives the tickers of all the markets and weighs more.
+    const rate_limit& limit = scheduler_->limit();
+    bool all_markets = uri_ == nullptr || evhttp_uri_get_query(uri_) == nullptr;
+    scheduler_->add(this, duration, all_markets ? limit.all_markets_weight : limit.market_weight);
   }
 
-  scheduled_client::scheduled_client(scheduled_client&& other):
-    converter_(new binance_converter()) {
-
-    // These are not owned by the other...
-    base_ = other.base_;
-    other.base_ = nullptr;
-
-    ssl_ctx_ = other.ssl_ctx_;
-    other.ssl_ctx_ = nullptr;
-
-    ssl_ = other.ssl_;
-    other.ssl_ = nullptr;
-
-    duration_ = other.duration_;
-
-    uri_ = other.uri_;
-    other.uri_ = nullptr;
-
-    bev_ = other.bev_;
-    other.bev_ = nullptr;
-
-    evcon_ = other.evcon_;
-    other.evcon_ = nullptr;
-
-    timer_ = other.timer_;
-    other.timer_ = nullptr;
+  template <class Converter>
+  basic_scheduled_client<Converter>::~basic_scheduled_client() {
+    scheduler_->remove(this);
 
-    out_queue_ = other.out_queue_;
-    other.out_queue_ = nullptr;
-  }
+    // Otherwise libevent would call us back once destroyed.
+    if (req_ != nullptr) {
+      evhttp_cancel_request(req_);
+      pool_->release(evcon_);
+    }
+    if (hedge_req_ != nullptr) {
+      evhttp_cancel_request(hedge_req_);
+      pool_->release(hedge_evcon_);
+    }
 
-  // Only destroy if we hold the resources...
-  scheduled_client::~scheduled_client() {
-    if (ssl_ctx_)
-      SSL_CTX_free(ssl_ctx_);
+    if (hedge_timer_ != nullptr)
+      event_free(hedge_timer_);
 
     if (uri_ != nullptr)
       evhttp_uri_free(uri_);
+  }
 
-    if (timer_ != nullptr)
-      event_free(timer_);
+  template <class Converter>
+  bool basic_scheduled_client<Converter>::poll() {
+    if (req_ != nullptr || hedge_req_ != nullptr) {
+      return false;
+    }
+    execute_query();
+    return req_ != nullptr;
   }
 
 
     // Send a GET request to the server.
-  void scheduled_client::execute_query() {
+  template <class Converter>
+  void basic_scheduled_client<Converter>::execute_query() {
 
-    ssl_ = SSL_new(ssl_ctx_);
-    if (ssl_ == NULL) {
-      err_openssl("SSL_new()");
+    // Validates the scheme and host of the url as well.
+    evcon_ = pool_->acquire(uri_, metrics_);
+    if (evcon_ == NULL) {
+      err("cannot get a connection from the pool\n");
       return;
     }
 
-    const char *scheme, *host, *path, *query;
-    char uri[256];
-    int port;
-    int retries = 0;
-    int timeout = -1;
-
-    struct evkeyvalq *output_headers;
-    struct evbuffer *output_buffer;
-
-    int i;
-    int ret = 0;
-    enum { HTTP, HTTPS } type = HTTP;
-
-    scheme = evhttp_uri_get_scheme(uri_);
-    if (scheme == NULL || (strcasecmp(scheme, "https") != 0 &&
-			   strcasecmp(scheme, "http") != 0)) {
-      err("url must be http or https");
+    // The connection, the handshake and the response are bounded by the timeouts of
+    // the pool. The scheduler retries the failures.
+    received_ = 0;
+    error_ = -1;
+    req_ = send(evcon_, &basic_scheduled_client::libevent_request_done, &basic_scheduled_client::libevent_headers,
+		&basic_scheduled_client::libevent_request_error);
+    if (req_ == nullptr) {
       return;
     }
+    sent_ = receive_time();
 
-    host = evhttp_uri_get_host(uri_);
-    if (host == NULL) {
-      err("url must have a host");
-      return;
+    if (hedge_delay_ > 0) {
+      timeval delay{static_cast<time_t>(hedge_delay_ / 1000000000),
+		    static_cast<suseconds_t>(hedge_delay_ % 1000000000 / 1000)};
+      evtimer_add(hedge_timer_, &delay);
     }
+  }
 
-    port = evhttp_uri_get_port(uri_);
-    if (port == -1) {
-      port = (strcasecmp(scheme, "http") == 0) ? 80 : 443;
-    }
+  template <class Converter>
+  evhttp_request* basic_scheduled_client<Converter>::send(evhttp_connection *evcon,
+							  void (*done)(evhttp_request*, void*),
+							  int (*headers)(evhttp_request*, void*),
+							  void (*error)(evhttp_request_error, void*)) {
+    const char *host, *path, *query;
+    char uri[256];
+
+    struct evkeyvalq *output_headers;
+
+    host = evhttp_uri_get_host(uri_);
 
     path = evhttp_uri_get_path(uri_);
     if (strlen(path) == 0) {
@@ -243,122 +156,222 @@ namespace cryptom {
     }
     uri[sizeof(uri) - 1] = '\0';
 
-#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
-    // Set hostname for SNI extension
-    SSL_set_tlsext_host_name(ssl_, host);
-#endif
+    // Fire off the request
+    evhttp_request *req = evhttp_request_new(done, (void*) this);
+    if (req == NULL) {
+      fprintf(stderr, "evhttp_request_new() failed\n");
+      pool_->release(evcon);
+      return nullptr;
+    }
 
-    if (strcasecmp(scheme, "http") == 0) {
-      bev_ = bufferevent_socket_new(base_, -1, BEV_OPT_CLOSE_ON_FREE);
-    } else {
-      type = HTTPS;
-      bev_ = bufferevent_openssl_socket_new(base_, -1, ssl_,
-					    BUFFEREVENT_SSL_CONNECTING,
-					    BEV_OPT_CLOSE_ON_FREE|BEV_OPT_DEFER_CALLBACKS);
+    evhttp_request_set_header_cb(req, headers);
+    evhttp_request_set_error_cb(req, error);
+
+    // Keep-alive is the default for HTTP/1.1 so the connection stays open for the next request.
+    output_headers = evhttp_request_get_output_headers(req);
+    evhttp_add_header(output_headers, "Host", host);
+
+    int r = evhttp_make_request(evcon, req, EVHTTP_REQ_GET, uri);
+    if (r != 0) {
+      // The request is freed by libevent.
+      fprintf(stderr, "evhttp_make_request() failed\n");
+      pool_->release(evcon);
+      return nullptr;
     }
+    return req;
+  }
 
-    if (bev_ == NULL) {
-      fprintf(stderr, "bufferevent_openssl_socket_new() failed\n");
+  template <class Converter>
+  void basic_scheduled_client<Converter>::send_hedge() {
+    if (req_ == nullptr || hedge_req_ != nullptr) {
       return;
     }
 
-    bufferevent_openssl_set_allow_dirty_shutdown(bev_, 1);
+    // The hedged request weighs as much as the first one. Better slow than banned.
+    if (!scheduler_->try_spend(this)) {
+      return;
+    }
 
-    // For simplicity, we let DNS resolution block. Everything else should be
-    // asynchronous though.
-    evcon_ = evhttp_connection_base_bufferevent_new(base_, NULL, bev_,
-						    host, port);
-    if (evcon_ == NULL) {
-      fprintf(stderr, "evhttp_connection_base_bufferevent_new() failed\n");
+    // On another connection: this one is busy with the slow request.
+    hedge_evcon_ = pool_->acquire(uri_, metrics_, true);
+    if (hedge_evcon_ == NULL) {
       return;
     }
+    hedge_received_ = 0;
+    hedge_error_ = -1;
+    hedge_req_ = send(hedge_evcon_, &basic_scheduled_client::libevent_hedge_done,
+		      &basic_scheduled_client::libevent_hedge_headers,
+		      &basic_scheduled_client::libevent_hedge_error);
+  }
 
-    if (retries > 0) {
-      evhttp_connection_set_retries(evcon_, retries);
+  template <class Converter>
+  void basic_scheduled_client<Converter>::http_request_done(struct evhttp_request *req)
+  {
+    int64_t done = receive_time();
+
+    // libevent frees the request once we return.
+    req_ = nullptr;
+    pool_->release(evcon_, req);
+    if (hedge_timer_ != nullptr)
+      evtimer_del(hedge_timer_);
+
+    // Without response: no status when the connection failed.
+    if (req == NULL || evhttp_request_get_response_code(req) == 0) {
+      // The hedged request may still be answered.
+      if (hedge_req_ == nullptr) {
+	failed(evcon_, error_);
+      }
+      return;
     }
-    if (timeout >= 0) {
-      evhttp_connection_set_timeout(evcon_, timeout);
+
+    if (hedge_req_ != nullptr) {
+      evhttp_cancel_request(hedge_req_);
+      hedge_req_ = nullptr;
+      pool_->release(hedge_evcon_);
+      scheduler_->on_hedge(false);
     }
 
-    // Fire off the request
-    evhttp_request *req = evhttp_request_new(&scheduled_client::libevent_request_done, (void*) this);
-    if (req == NULL) {
-      fprintf(stderr, "evhttp_request_new() failed\n");
+    handle_response(req, evcon_, received_, done);
+  }
+
+  template <class Converter>
+  void basic_scheduled_client<Converter>::hedge_done(struct evhttp_request *req)
+  {
+    int64_t done = receive_time();
+
+    hedge_req_ = nullptr;
+    pool_->release(hedge_evcon_, req);
+
+    if (req == NULL || evhttp_request_get_response_code(req) == 0) {
+      scheduler_->on_hedge(false);
+      if (req_ == nullptr) {
+	failed(hedge_evcon_, hedge_error_);
+      }
       return;
     }
 
-    output_headers = evhttp_request_get_output_headers(req);
-    evhttp_add_header(output_headers, "Host", host);
-    evhttp_add_header(output_headers, "Connection", "close");
-
-    int r = evhttp_make_request(evcon_, req, EVHTTP_REQ_GET, uri);
-    if (r != 0) {
-      fprintf(stderr, "evhttp_make_request() failed\n");
+    scheduler_->on_hedge(true);
+    if (req_ != nullptr) {
+      evhttp_cancel_request(req_);
+      req_ = nullptr;
+      pool_->release(evcon_);
     }
+
+    handle_response(req, hedge_evcon_, hedge_received_, done);
   }
 
-  void scheduled_client::http_request_done(struct evhttp_request *req)
+  template <class Converter>
+  void basic_scheduled_client<Converter>::failed(evhttp_connection *evcon, int error)
   {
-    if (req == NULL) {
-      /* If req is NULL, it means an error occurred, but
-       * sadly we are mostly left guessing what the error
-       * might have been.  We'll do our best... */
-      char error_buffer[256];
-      unsigned long oslerr;
-      int printed_err = 0;
-      int errcode = EVUTIL_SOCKET_ERROR();
-      fprintf(stderr, "some request failed - no idea which one though!\n");
-      /* Print out the OpenSSL error queue that libevent
-       * squirreled away for us, if any. */
-      while ((oslerr = bufferevent_get_openssl_error(bev_))) {
-	ERR_error_string_n(oslerr, error_buffer, sizeof(error_buffer));
-	fprintf(stderr, "%s\n", error_buffer);
-	printed_err = 1;
-      }
-      /* If the OpenSSL error queue was empty, maybe it was a
-       * socket error; let's try printing that. */
-      if (! printed_err)
-	fprintf(stderr, "socket error = %s (%d)\n",
-		evutil_socket_error_to_string(errcode),
-		errcode);
+    bool timed_out = error == EVREQ_HTTP_TIMEOUT;
+    scheduler_->on_failure(this, timed_out);
+
+    if (timed_out) {
+      fprintf(stderr, "request to %s timed out\n", evhttp_uri_get_host(uri_));
       return;
     }
 
-    fprintf(stderr, "Response line: %d %s\n",
-	    evhttp_request_get_response_code(req),
-	    evhttp_request_get_response_code_line(req));
+    /* If req is NULL, it means an error occurred, but
+     * sadly we are mostly left guessing what the error
+     * might have been.  We'll do our best... */
+    char error_buffer[256];
+    unsigned long oslerr;
+    int printed_err = 0;
+    int errcode = EVUTIL_SOCKET_ERROR();
+    fprintf(stderr, "request to %s failed\n", evhttp_uri_get_host(uri_));
+    /* Print out the OpenSSL error queue that libevent
+     * squirreled away for us, if any. */
+    bufferevent *bev = evhttp_connection_get_bufferevent(evcon);
+    while ((oslerr = bufferevent_get_openssl_error(bev))) {
+      ERR_error_string_n(oslerr, error_buffer, sizeof(error_buffer));
+      fprintf(stderr, "%s\n", error_buffer);
+      printed_err = 1;
+    }
+    /* If the OpenSSL error queue was empty, maybe it was a
+     * socket error; let's try printing that. */
+    if (! printed_err)
+      fprintf(stderr, "socket error = %s (%d)\n",
+	      evutil_socket_error_to_string(errcode),
+	      errcode);
+  }
+
+  template <class Converter>
+  void basic_scheduled_client<Converter>::handle_response(evhttp_request *req, evhttp_connection *evcon,
+							  int64_t received, int64_t done)
+  {
+    int status = evhttp_request_get_response_code(req);
+    // Only the unexpected responses, a line per response would slow the loop.
+    if (status != 200) {
+      fprintf(stderr, "Response line: %d %s\n", status, evhttp_request_get_response_code_line(req));
+    }
 
-    size_t length = evbuffer_get_length(evhttp_request_get_input_buffer(req));
-    char buffer[length+1];
-    evbuffer_remove(evhttp_request_get_input_buffer(req), buffer, length);
-    buffer[length] = '\0';
+    scheduler_->on_response(this, status, evhttp_request_get_input_headers(req));
 
-    // try to parse as JSON if response 200:
-    if (evhttp_request_get_response_code(req) == 200) {
-      rapidjson::Document json;
-      json.Parse(buffer);
-      std::cout << "Ticker\n";
-      std::cout << "------\n";
-      ticker t;
-
-      if (converter_ == nullptr || converter_.get() == nullptr) {
-	std::cout << "CONVERTER IS NULL\n";
+    if (metrics_ != nullptr && received != 0) {
+      int64_t written = pool_->last_write(evcon);
+      if (written != 0 && written <= received) {
+	metrics_->record(stage::first_byte, received - written);
       }
+      metrics_->record(stage::body_read, done - received);
+    }
 
-      converter_->ticker_from_json(json, t);
-      while (!out_queue_->push(t))
-            ;
+    // Hedge the requests slower than nearly all the previous ones.
+    if (durations_ != nullptr) {
+      durations_->record(done - sent_);
+      if (++nb_durations_ >= hedge_min_samples && nb_durations_ % hedge_update == 0) {
+	latency_histogram::snapshot durations;
+	durations.merge(*durations_);
+	hedge_delay_ = durations.quantile(0.99);
+      }
     }
 
-    SSL_free(ssl_);
-    //evhttp_connection_free(evcon_);
+    // try to parse as JSON if response 200:
+    if (status == 200) {
+      tickers_.clear();
+      if (converter_.tickers_from_buffer(evhttp_request_get_input_buffer(req), symbols_, tickers_) != 0) {
+	fprintf(stderr, "Cannot convert the response to tickers\n");
+      }
 
-    evtimer_add(timer_, &duration_);
+      int64_t converted = receive_time();
+      if (metrics_ != nullptr) {
+	metrics_->record_parse(done, converter_.parsed_at(), converted);
+      }
+
+      for (ticker& t: tickers_) {
+	t.received = received;
+	t.queued = converted;
+	out_queue_->push(lane_, t);
+      }
+    }
   }
 
-  void scheduled_client::timeout() {
-    std::cout << "\n";
-    execute_query();
+  template class basic_scheduled_client<kucoin_converter>;
+  template class basic_scheduled_client<binance_converter>;
+
+  std::unique_ptr<scheduled_client> make_scheduled_client(const std::string& exchange,
+							   event_base *base,
+							   const char* url,
+							   timeval duration,
+							   request_scheduler *scheduler,
+							   connection_pool *pool,
+							   symbol_map symbols,
+							   ticker_channel *out_queue,
+							   size_t lane,
+							   stage_histograms *metrics,
+							   bool hedge) {
+    if (exchange == "binance") {
+      return std::unique_ptr<scheduled_client>(
+	new basic_scheduled_client<binance_converter>(base, url, duration, scheduler, pool, std::move(symbols),
+						      out_queue, lane, metrics, hedge));
+    }
+
+    if (exchange == "kucoin") {
+      return std::unique_ptr<scheduled_client>(
+	new basic_scheduled_client<kucoin_converter>(base, url, duration, scheduler, pool, std::move(symbols),
+						     out_queue, lane, metrics, hedge));
+    }
+
+    return nullptr;
   }
 
 }
@@ -5,73 +5,204 @@
 #include <event2/bufferevent.h>
 #include <event2/http.h>
 #include "ticker.h"
+#include "connection_pool.h"
+#include "latency_histogram.h"
+#include "metrics.h"
+#include "request_scheduler.h"
+#include "ticker_channel.h"
 #include <memory>
-
-#include <boost/lockfree/queue.hpp>
+#include <string>
 
 namespace cryptom {
 
-  class scheduled_client {
+  /*
+    Client polling the ticker endpoint of an exchange. Common interface of the clients
+    of all the exchanges, to create them from the configuration and keep them in one
+    collection, see make_scheduled_client. The requests are sent when the
+    request_scheduler of the host polls the client.
+  */
+  class scheduled_client: public request_scheduler::task {
 
   public:
-    scheduled_client(event_base *base,
-		     const char* url,
-		     timeval duration,
-		     boost::lockfree::queue<cryptom::ticker> *out_queue);
-    ~scheduled_client();
+    virtual ~scheduled_client() {}
+
+    // Keep the tickers of these symbols from the next response on.
+    virtual void set_symbols(symbol_map symbols) = 0;
+  };
 
-    // no copy or assignement
-    scheduled_client(const scheduled_client&) = delete;
-    scheduled_client& operator=(scheduled_client&) = delete;
+  /*
+    Client of the exchange of Converter. The conversion of the responses is resolved at
+    compile time. The members are instantiated in scheduled_client.cpp for the
+    converters we know.
 
-    // enable move. I want to keep the clients in a collection of clients. e.g. vector using emplace_back
-    scheduled_client(scheduled_client&& other);
+    The failures are reported to the request_scheduler, which retries them. With hedge,
+    a request slower than the 99th percentile of the previous ones is sent again on the
+    spare connection of the host: the first answer is used, the other request is
+    cancelled.
+  */
+  template <class Converter>
+  class basic_scheduled_client final: public scheduled_client {
+
+  public:
+    basic_scheduled_client(event_base *base,
+			   const char* url,
+			   timeval duration,
+			   request_scheduler *scheduler,
+			   connection_pool *pool,
+			   symbol_map symbols,
+			   ticker_channel *out_queue,
+			   size_t lane,
+			   stage_histograms *metrics = nullptr,
+			   bool hedge = false);
+    ~basic_scheduled_client();
+
+    // Send the request, unless the previous one is still in flight.
+    bool poll();
+
+    void set_symbols(symbol_map symbols) { symbols_ = std::move(symbols); }
+
+    // no copy or assignement. The callbacks of libevent hold the address of the client.
+    basic_scheduled_client(const basic_scheduled_client&) = delete;
+    basic_scheduled_client& operator=(const basic_scheduled_client&) = delete;
 
   private:
 
     // pointer to the event loop of libevent.
     event_base *base_;
 
-    // SSL context used for TLS requests.
-    SSL_CTX *ssl_ctx_;
-    SSL *ssl_;
+    // When to send the requests. Not owned by this object
+    request_scheduler *scheduler_;
 
-    // how long should we wait between updates
-    timeval duration_;
+    // Where to get the connection to the exchange. Not owned by this object
+    connection_pool *pool_;
 
     // Data structure to extract host/port/scheme... and so on.
     evhttp_uri *uri_;
 
-    bufferevent *bev_;
+    // Connection used by the last request. Owned by the pool.
     evhttp_connection *evcon_;
 
-    // timer between the requests.
-    event *timer_;
+    // Request in flight, cancelled if the client is destroyed. Owned by libevent.
+    evhttp_request *req_;
 
     // How to convert from json to ticker?
-    std::unique_ptr<json_converter> converter_;
+    Converter converter_;
+
+    // Symbols to send to the queue, with their interned id. One symbol for the ticker
+    // endpoint of one market, or the symbols of the portfolio for the endpoint of all the
+    // markets (batch mode).
+    symbol_map symbols_;
+
+    // When the request was sent, and when the headers of the response were read, see
+    // ticker::received.
+    int64_t sent_;
+    int64_t received_;
+
+    // Error of the request which failed, see evhttp_request_set_error_cb. -1 if none.
+    int error_;
+    int hedge_error_;
+
+    // Tickers of the last response. Kept to reuse the memory.
+    std::vector<ticker> tickers_;
 
     // Way to send the results. Not owned by this object
-    boost::lockfree::queue<cryptom::ticker> *out_queue_;
+    ticker_channel *out_queue_;
+    // Lane of the channel of our event loop.
+    size_t lane_;
+
+    // Where to time the stages of the requests, NULL if they are not timed. Written
+    // by the thread of our event loop only. Not owned by this object
+    stage_histograms *metrics_;
+
+    // Hedged request in flight, on the spare connection of the host. Owned by libevent.
+    evhttp_connection *hedge_evcon_;
+    evhttp_request *hedge_req_;
+    int64_t hedge_received_;
+    // Sends the hedged request. NULL without hedge.
+    event *hedge_timer_;
+    // Durations of the requests, and their 99th percentile once there are enough of
+    // them (0 before). NULL without hedge.
+    std::unique_ptr<latency_histogram> durations_;
+    uint64_t nb_durations_;
+    int64_t hedge_delay_;
+
+    // Hedge once that many requests were timed, and compute the delay again every
+    // hedge_update requests.
+    static const uint64_t hedge_min_samples = 100;
+    static const uint64_t hedge_update = 64;
 
     // Send a GET request to the server.
     void execute_query();
 
+    // Send the request on the connection. Return NULL on error.
+    evhttp_request* send(evhttp_connection *evcon, void (*done)(evhttp_request*, void*),
+			 int (*headers)(evhttp_request*, void*),
+			 void (*error)(evhttp_request_error, void*));
+
     /*
       Callback for when we receive the response to our request.
     */
     static void libevent_request_done(struct evhttp_request *req, void *ctx) {
-      (static_cast<scheduled_client*>(ctx))->http_request_done(req);
+      (static_cast<basic_scheduled_client*>(ctx))->http_request_done(req);
     }
     void http_request_done(struct evhttp_request *req);
 
+    // Same for the hedged request.
+    static void libevent_hedge_done(struct evhttp_request *req, void *ctx) {
+      (static_cast<basic_scheduled_client*>(ctx))->hedge_done(req);
+    }
+    void hedge_done(struct evhttp_request *req);
+
+    static void libevent_hedge(evutil_socket_t fd, short what, void *arg) {
+      static_cast<basic_scheduled_client*>(arg)->send_hedge();
+    }
+    void send_hedge();
+
     /*
-      callbacks for when the timer times out.
+      Callback for when a request fails, before libevent calls back with no response.
     */
-    static void libevent_timeout(evutil_socket_t fd, short a, void* data) {
-      (static_cast<scheduled_client*>(data))->timeout();
+    static void libevent_request_error(enum evhttp_request_error error, void *ctx) {
+      (static_cast<basic_scheduled_client*>(ctx))->error_ = error;
+    }
+    static void libevent_hedge_error(enum evhttp_request_error error, void *ctx) {
+      (static_cast<basic_scheduled_client*>(ctx))->hedge_error_ = error;
+    }
+
+    // Print why the request on the connection failed with the error, and tell the
+    // scheduler.
+    void failed(evhttp_connection *evcon, int error);
+
+    // Use the response, of the request sent on the connection.
+    void handle_response(evhttp_request *req, evhttp_connection *evcon, int64_t received, int64_t done);
+
+    /*
+      Callback for when the headers of the response are read: the first read of the
+      response from the socket.
+    */
+    static int libevent_headers(struct evhttp_request *req, void *ctx) {
+      (static_cast<basic_scheduled_client*>(ctx))->received_ = receive_time();
+      return 0;
+    }
+    static int libevent_hedge_headers(struct evhttp_request *req, void *ctx) {
+      (static_cast<basic_scheduled_client*>(ctx))->hedge_received_ = receive_time();
+      return 0;
     }
-    void timeout();
   };
 
+  /**
+     Create the client of an exchange ("binance" or "kucoin"). NULL if unknown.
+     metrics can be NULL. See basic_scheduled_client for hedge.
+   */
+  std::unique_ptr<scheduled_client> make_scheduled_client(const std::string& exchange,
+							   event_base *base,
+							   const char* url,
+							   timeval duration,
+							   request_scheduler *scheduler,
+							   connection_pool *pool,
+							   symbol_map symbols,
+							   ticker_channel *out_queue,
+							   size_t lane,
+							   stage_histograms *metrics = nullptr,
+							   bool hedge = false);
+
 }
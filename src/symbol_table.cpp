@@ -0,0 +1,56 @@
+#include "symbol_table.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+namespace cryptom {
+
+  symbol_table& symbol_table::global() {
+    static symbol_table table;
+    return table;
+  }
+
+  symbol_table::symbol_table() {
+    for (size_t i = 0; i < max_chunks; i++) {
+      chunks_[i] = nullptr;
+    }
+  }
+
+  symbol_table::~symbol_table() {
+    for (size_t i = 0; i < max_chunks; i++) {
+      delete[] chunks_[i];
+    }
+  }
+
+  symbol_id symbol_table::intern(const char *symbol, size_t length) {
+    std::string key(symbol, length);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = ids_.find(key);
+    if (it != ids_.end()) {
+      return it->second;
+    }
+
+    size_t id = ids_.size();
+    if (id >= chunk_size * max_chunks) {
+      fprintf(stderr, "Too many symbols in the symbol table\n");
+      abort();
+    }
+
+    std::string *&chunk = chunks_[id / chunk_size];
+    if (chunk == nullptr) {
+      chunk = new std::string[chunk_size];
+    }
+    chunk[id % chunk_size] = key;
+
+    symbol_id new_id = static_cast<symbol_id>(id);
+    ids_.emplace(std::move(key), new_id);
+    return new_id;
+  }
+
+  size_t symbol_table::size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return ids_.size();
+  }
+
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace cryptom {
+
+  // Compact identifier of an interned symbol ("ETHBTC", "ETH-BTC"...).
+  typedef uint32_t symbol_id;
+
+  /*
+    Process-wide table of the symbols. Each symbol is stored once and identified by
+    its index, so the tickers can carry an integer instead of a string.
+
+    intern() takes a lock and is meant to be called when the clients are created.
+    name() is O(1) and lock-free: the storage of a symbol never moves, and the id
+    reaches the other threads through the ticker queue, after the symbol was stored.
+  */
+  class symbol_table {
+
+  public:
+    static symbol_table& global();
+
+    // Return the id of the symbol, adding it to the table if needed.
+    symbol_id intern(const char *symbol, size_t length);
+    symbol_id intern(const std::string& symbol) { return intern(symbol.c_str(), symbol.size()); }
+
+    // Name of an interned symbol.
+    const char* name(symbol_id id) const {
+      return chunks_[id / chunk_size][id % chunk_size].c_str();
+    }
+
+    // Number of symbols in the table, the ids are from 0 to size() - 1.
+    size_t size() const;
+
+    // no copy or assignement
+    symbol_table(const symbol_table&) = delete;
+    symbol_table& operator=(const symbol_table&) = delete;
+
+  private:
+    // Symbols are stored by chunks which are never reallocated. With 1024 chunks of
+    // 1024 symbols we can keep all the markets of all the exchanges.
+    static const size_t chunk_size = 1024;
+    static const size_t max_chunks = 1024;
+
+    symbol_table();
+    ~symbol_table();
+
+    mutable std::mutex mutex_;
+    std::string *chunks_[max_chunks];
+    std::unordered_map<std::string, symbol_id> ids_;
+  };
+
+}
@@ -0,0 +1,446 @@
+#include "tick_log.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+namespace cryptom {
+
+  namespace {
+
+    // FNV-1a of the record without its checksum.
+    uint32_t checksum_of(const tick_record& r) {
+      const unsigned char *bytes = reinterpret_cast<const unsigned char*>(&r);
+      uint32_t hash = 2166136261u;
+      for (size_t i = 0; i < sizeof(tick_record); i++) {
+	if (i == offsetof(tick_record, checksum)) {
+	  i += sizeof(r.checksum) - 1;
+	  continue;
+	}
+	hash = (hash ^ bytes[i]) * 16777619u;
+      }
+      return hash | 1;
+    }
+
+    size_t hash_of(const uint64_t key[2]) {
+      return ((key[0] * 0x9E3779B97F4A7C15ull) ^ (key[1] * 0xC2B2AE3D27D4EB4Full)) >> 32;
+    }
+
+    bool is_zero(const tick_record& r) {
+      static const tick_record zero = {};
+      return memcmp(&r, &zero, sizeof(r)) == 0;
+    }
+
+    std::string path_of(const std::string& directory, unsigned number, const char *extension) {
+      char name[32];
+      snprintf(name, sizeof(name), "ticks-%08u.%s", number, extension);
+      return directory + "/" + name;
+    }
+
+    // Numbers of the segments of the directory, in order.
+    std::vector<unsigned> list_segments(const std::string& directory) {
+      std::vector<unsigned> numbers;
+      DIR *dir = opendir(directory.c_str());
+      if (dir == nullptr) {
+	return numbers;
+      }
+      while (dirent *entry = readdir(dir)) {
+	unsigned number;
+	char extension[4];
+	if (sscanf(entry->d_name, "ticks-%8u.%3s", &number, extension) == 2 &&
+	    strcmp(extension, "log") == 0) {
+	  numbers.push_back(number);
+	}
+      }
+      closedir(dir);
+      std::sort(numbers.begin(), numbers.end());
+      return numbers;
+    }
+
+    // Index saved when the segment was sealed. Return false if missing or stale.
+    bool load_index(tick_segment& s, const std::string& path) {
+      FILE *file = fopen(path.c_str(), "rb");
+      if (file == nullptr) {
+	return false;
+      }
+      s.index.resize(s.count / tick_segment::index_stride + 1);
+      size_t n = fread(s.index.data(), sizeof(int32_t), s.index.size(), file);
+      fclose(file);
+      if (n != s.count / tick_segment::index_stride) {
+	s.index.clear();
+	return false;
+      }
+      s.index.resize(n);
+      s.block_max = n > 0 ? s.index.back() : INT32_MIN;
+      for (size_t i = n * tick_segment::index_stride; i < s.count; i++) {
+	s.block_max = std::max(s.block_max, s.records[i].date);
+      }
+      return true;
+    }
+
+    /*
+      Map the segment file and count its valid records. Sealed segments are full and
+      synced. Otherwise the records are checked up to the first bad one.
+    */
+    int map_segment(tick_segment& s, const std::string& directory, size_t capacity, bool writable) {
+      std::string path = path_of(directory, s.number, "log");
+      s.fd = ::open(path.c_str(), writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+      if (s.fd < 0) {
+	fprintf(stderr, "Cannot open %s: %s\n", path.c_str(), strerror(errno));
+	return -1;
+      }
+
+      struct stat st;
+      if (fstat(s.fd, &st) != 0) {
+	perror("fstat");
+	return -1;
+      }
+      if (st.st_size == 0 && writable) {
+	if (ftruncate(s.fd, capacity * sizeof(tick_record)) != 0) {
+	  perror("ftruncate");
+	  return -1;
+	}
+      } else {
+	capacity = st.st_size / sizeof(tick_record);
+      }
+      s.capacity = capacity;
+      if (capacity == 0) {
+	return 0;
+      }
+
+      void *map = mmap(NULL, capacity * sizeof(tick_record),
+		       writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, s.fd, 0);
+      if (map == MAP_FAILED) {
+	perror("mmap");
+	return -1;
+      }
+      s.records = static_cast<tick_record*>(map);
+
+      const tick_record& last = s.records[capacity - 1];
+      if (last.checksum != 0 && last.checksum == checksum_of(last)) {
+	s.count = capacity;
+      } else {
+	s.count = 0;
+	while (s.count < capacity &&
+	       s.records[s.count].checksum != 0 &&
+	       s.records[s.count].checksum == checksum_of(s.records[s.count])) {
+	  ++s.count;
+	}
+      }
+
+      if (s.count == capacity && load_index(s, path_of(directory, s.number, "idx"))) {
+	return 0;
+      }
+      s.index.clear();
+      s.block_max = INT32_MIN;
+      for (size_t n = 1; n <= s.count; n++) {
+	s.index_record(n, s.records[n - 1].date);
+      }
+      return 0;
+    }
+
+  }
+
+  const size_t tick_segment::index_stride;
+
+  tick_segment::~tick_segment() {
+    if (records != nullptr)
+      munmap(records, capacity * sizeof(tick_record));
+    if (fd >= 0)
+      close(fd);
+  }
+
+  void tick_segment::index_record(size_t n, int32_t date) {
+    block_max = std::max(block_max, date);
+    if (n % index_stride == 0) {
+      index.push_back(block_max);
+    }
+  }
+
+  tick_log::tick_log(const std::string& directory, size_t records_per_segment):
+    directory_(directory),
+    records_per_segment_(std::max<size_t>(records_per_segment, 1)),
+    sequence_(0),
+    recovered_(0),
+    rejected_(0) {
+  }
+
+  tick_log::~tick_log() {
+    flush();
+  }
+
+  int tick_log::open() {
+    if (mkdir(directory_.c_str(), 0755) != 0 && errno != EEXIST) {
+      fprintf(stderr, "Cannot create %s: %s\n", directory_.c_str(), strerror(errno));
+      return -1;
+    }
+
+    std::vector<unsigned> numbers = list_segments(directory_);
+
+    // The sequence goes on from the last record of the previous segment, in case we
+    // stopped right after creating the last one.
+    if (numbers.size() > 1) {
+      tick_segment previous;
+      previous.number = numbers[numbers.size() - 2];
+      if (map_segment(previous, directory_, 0, false) == 0 && previous.count > 0) {
+	sequence_ = previous.records[previous.count - 1].sequence + 1;
+      }
+    }
+
+    return open_segment(numbers.empty() ? 0 : numbers.back());
+  }
+
+  int tick_log::open_segment(unsigned number) {
+    segment_.reset(new tick_segment());
+    segment_->number = number;
+
+    if (map_segment(*segment_, directory_, records_per_segment_, true) != 0) {
+      segment_.reset();
+      return -1;
+    }
+    tick_segment& segment = *segment_;
+
+    // Drop what follows the last valid record: a torn record, or records written back
+    // after a hole.
+    size_t dropped = 0;
+    for (size_t i = segment.count; i < segment.capacity; i++) {
+      if (!is_zero(segment.records[i])) {
+	memset(&segment.records[i], 0, sizeof(tick_record));
+	++dropped;
+      }
+    }
+    if (dropped > 0) {
+      fprintf(stderr, "Tick log: dropped %zu records after record %zu of %s\n", dropped,
+	      segment.count, path_of(directory_, number, "log").c_str());
+      recovered_ += dropped;
+    }
+
+    if (segment.count > 0) {
+      sequence_ = segment.records[segment.count - 1].sequence + 1;
+    }
+
+    if (segment.count == segment.capacity) {
+      return seal();
+    }
+    return 0;
+  }
+
+  int tick_log::seal() {
+    // The index of the segment, for the readers.
+    std::string path = path_of(directory_, segment_->number, "idx");
+    FILE *file = fopen(path.c_str(), "wb");
+    if (file != nullptr) {
+      fwrite(segment_->index.data(), sizeof(int32_t), segment_->index.size(), file);
+      fclose(file);
+    }
+
+    if (msync(segment_->records, segment_->capacity * sizeof(tick_record), MS_SYNC) != 0) {
+      perror("msync");
+    }
+    return open_segment(segment_->number + 1);
+  }
+
+  int tick_log::append(const ticker& t) {
+    if (segment_ == nullptr) {
+      return -1;
+    }
+
+    // A truncated name would be replayed as another symbol.
+    const char *name = symbol_table::global().name(t.symbol);
+    size_t length = strlen(name);
+    if (length > sizeof(tick_record::symbol)) {
+      // Once in a while, the symbol comes with each of its tickers.
+      ++rejected_;
+      if ((rejected_ & (rejected_ - 1)) == 0) {
+	fprintf(stderr, "Tick log: %s is too long for a record, %zu tickers not logged\n", name, rejected_);
+      }
+      return -1;
+    }
+
+    tick_record& r = segment_->records[segment_->count];
+    memcpy(r.symbol, name, length);
+    memset(r.symbol + length, 0, sizeof(r.symbol) - length);
+    r.high = t.high;
+    r.low = t.low;
+    r.close = t.close;
+    r.volume = t.volume;
+    r.date = t.date;
+    r.sequence = sequence_++;
+    r.checksum = checksum_of(r);
+
+    ++segment_->count;
+    segment_->index_record(segment_->count, t.date);
+
+    if (segment_->count == segment_->capacity) {
+      return seal();
+    }
+    return 0;
+  }
+
+  int tick_log::flush() {
+    if (segment_ == nullptr || segment_->records == nullptr) {
+      return -1;
+    }
+    if (msync(segment_->records, segment_->capacity * sizeof(tick_record), MS_SYNC) != 0) {
+      perror("msync");
+      return -1;
+    }
+    return 0;
+  }
+
+  tick_log_reader::tick_log_reader(const std::string& directory):
+    directory_(directory),
+    segment_(0),
+    record_(0),
+    from_(INT32_MIN),
+    symbols_(1024),
+    nb_symbols_(0) {
+  }
+
+  int tick_log_reader::open() {
+    segments_.clear();
+    for (unsigned number: list_segments(directory_)) {
+      std::unique_ptr<tick_segment> s(new tick_segment());
+      s->number = number;
+      if (map_segment(*s, directory_, 0, false) != 0) {
+	return -1;
+      }
+      segments_.push_back(std::move(s));
+    }
+    segment_ = 0;
+    record_ = 0;
+    return 0;
+  }
+
+  uint64_t tick_log_reader::size() const {
+    uint64_t n = 0;
+    for (const auto& s: segments_) {
+      n += s->count;
+    }
+    return n;
+  }
+
+  void tick_log_reader::seek(int from) {
+    from_ = from;
+    for (segment_ = 0; segment_ < segments_.size(); segment_++) {
+      const tick_segment& s = *segments_[segment_];
+      if (s.count > 0 && s.block_max >= from) {
+	// The records of the blocks before the first one whose maximum reaches from are
+	// all older.
+	auto block = std::lower_bound(s.index.begin(), s.index.end(), from);
+	record_ = (block - s.index.begin()) * tick_segment::index_stride;
+	return;
+      }
+    }
+    record_ = 0;
+  }
+
+  symbol_id tick_log_reader::intern(const char *symbol) {
+    uint64_t key[2];
+    memcpy(key, symbol, sizeof(key));
+
+    size_t mask = symbols_.size() - 1;
+    size_t i = hash_of(key);
+    for (;; i++) {
+      symbol_slot& slot = symbols_[i & mask];
+      if (!slot.used) {
+	break;
+      }
+      if (slot.key[0] == key[0] && slot.key[1] == key[1]) {
+	return slot.id;
+      }
+    }
+
+    symbol_slot& slot = symbols_[i & mask];
+    slot.key[0] = key[0];
+    slot.key[1] = key[1];
+    slot.id = symbol_table::global().intern(symbol, strnlen(symbol, sizeof(tick_record::symbol)));
+    slot.used = true;
+    symbol_id id = slot.id;
+
+    // Keep the table at most half full.
+    if (2 * ++nb_symbols_ > symbols_.size()) {
+      std::vector<symbol_slot> old(symbols_.size() * 2);
+      old.swap(symbols_);
+      mask = symbols_.size() - 1;
+      for (const symbol_slot& moved: old) {
+	if (moved.used) {
+	  size_t j = hash_of(moved.key);
+	  while (symbols_[j & mask].used) {
+	    j++;
+	  }
+	  symbols_[j & mask] = moved;
+	}
+      }
+    }
+    return id;
+  }
+
+  size_t tick_log_reader::read(ticker *out, size_t n) {
+    size_t read = 0;
+    while (read < n && segment_ < segments_.size()) {
+      const tick_segment& s = *segments_[segment_];
+      if (record_ >= s.count) {
+	++segment_;
+	record_ = 0;
+	continue;
+      }
+
+      size_t end = std::min(s.count, record_ + (n - read));
+      for (; record_ < end; record_++) {
+	const tick_record& r = s.records[record_];
+	if (r.date < from_) {
+	  continue;
+	}
+	ticker& t = out[read++];
+	t.high = r.high;
+	t.low = r.low;
+	t.close = r.close;
+	t.volume = r.volume;
+	t.date = r.date;
+	t.symbol = intern(r.symbol);
+	t.received = 0;
+	t.queued = 0;
+      }
+    }
+    return read;
+  }
+
+  size_t tick_log_reader::replay(ticker_channel *out, size_t lane, bool wall_clock) {
+    ticker batch[256];
+    size_t total = 0;
+
+    bool started = false;
+    int first_date = 0;
+    std::chrono::steady_clock::time_point start;
+
+    size_t n;
+    while ((n = read(batch, sizeof(batch) / sizeof(batch[0]))) > 0) {
+      for (size_t i = 0; i < n; i++) {
+	const ticker& t = batch[i];
+	if (wall_clock) {
+	  if (!started) {
+	    started = true;
+	    first_date = t.date;
+	    start = std::chrono::steady_clock::now();
+	  }
+	  // The dates are in seconds, the tickers of a second go together.
+	  std::this_thread::sleep_until(start + std::chrono::seconds(std::max(0, t.date - first_date)));
+	}
+	out->push(lane, t);
+      }
+      total += n;
+    }
+    return total;
+  }
+
+}
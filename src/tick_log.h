@@ -0,0 +1,174 @@
+#pragma once
+
+#include "symbol_table.h"
+#include "ticker.h"
+#include "ticker_channel.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace cryptom {
+
+  /*
+    Record of a ticker in the log. The symbol is stored by name, the ids of the symbol
+    table change from one run to the next.
+  */
+  struct tick_record {
+    // Not NUL terminated if 16 characters long.
+    char symbol[16];
+    double high;
+    double low;
+    double close;
+    double volume;
+    int32_t date;
+    // Of the other fields, never 0: a record of zeros was never written.
+    uint32_t checksum;
+    // Number of the record since the creation of the log.
+    uint64_t sequence;
+  };
+
+  static_assert(sizeof(tick_record) == 64, "a tick_record should fill a cache line");
+
+  /*
+    Segment file of the log, mapped in memory: ticks-<number>.log, preallocated with
+    zeros, holding capacity records. Shared by the writer and the reader.
+  */
+  struct tick_segment {
+    unsigned number = 0;
+    int fd = -1;
+    tick_record *records = nullptr;
+    size_t capacity = 0;
+    // Number of valid records.
+    size_t count = 0;
+
+    // Index by date: the largest date of the records before the end of each block of
+    // index_stride records. The dates are not sorted (the tickers of different markets
+    // arrive out of order) but this maximum is.
+    std::vector<int32_t> index;
+    int32_t block_max = INT32_MIN;
+
+    static const size_t index_stride = 1024;
+
+    tick_segment() {}
+    ~tick_segment();
+
+    // no copy or assignement, the segment owns its mapping.
+    tick_segment(const tick_segment&) = delete;
+    tick_segment& operator=(const tick_segment&) = delete;
+
+    // Add the date of the nth record (from 1) to the index.
+    void index_record(size_t n, int32_t date);
+  };
+
+  /*
+    Append-only log of the tickers, in segment files of a directory mapped in memory.
+    Appending copies the record into the mapping, the kernel writes it back: the
+    records survive a crash of the process. After a crash of the machine, the records
+    of the tail whose checksum is wrong are dropped when the log is opened again.
+
+    When a segment is full, its index is saved in ticks-<number>.idx, it is synced and
+    the next segment is created.
+  */
+  class tick_log {
+
+  public:
+    // 1M records of 64 bytes per segment by default.
+    explicit tick_log(const std::string& directory, size_t records_per_segment = 1 << 20);
+    ~tick_log();
+
+    // no copy or assignement
+    tick_log(const tick_log&) = delete;
+    tick_log& operator=(const tick_log&) = delete;
+
+    /**
+       Open the log, creating the directory if needed, and recover the tail of the last
+       segment. Will return 0 if ok.
+     */
+    int open();
+
+    // Will return 0 if ok, -1 if the log is not open or the name of the symbol does
+    // not fit in a record.
+    int append(const ticker& t);
+
+    // Write the records back to the disk and wait for it. Will return 0 if ok.
+    int flush();
+
+    // Number of records in the log.
+    uint64_t size() const { return sequence_; }
+
+    // Records dropped by the recovery of the tail.
+    size_t recovered() const { return recovered_; }
+
+    // Tickers not logged as the name of their symbol is too long.
+    size_t rejected() const { return rejected_; }
+
+  private:
+    std::string directory_;
+    size_t records_per_segment_;
+    std::unique_ptr<tick_segment> segment_;
+    uint64_t sequence_;
+    size_t recovered_;
+    size_t rejected_;
+
+    int open_segment(unsigned number);
+    int seal();
+  };
+
+  /*
+    Sequential reader of a log, for the replays and the backtests.
+  */
+  class tick_log_reader {
+
+  public:
+    explicit tick_log_reader(const std::string& directory);
+
+    // no copy or assignement
+    tick_log_reader(const tick_log_reader&) = delete;
+    tick_log_reader& operator=(const tick_log_reader&) = delete;
+
+    // Map the segments of the log. Will return 0 if ok.
+    int open();
+
+    // Number of records in the log.
+    uint64_t size() const;
+
+    // Read from the first record of date >= from, with the index of the segments.
+    void seek(int from);
+
+    /**
+       Read at most n tickers from the position. Their symbols are added to the symbol
+       table if needed. Return the number of tickers read, 0 at the end of the log.
+     */
+    size_t read(ticker *out, size_t n);
+
+    /**
+       Push the tickers from the position to the lane of the channel, as fast as the
+       consumer takes them, or at the pace of their dates. Return the number of tickers.
+     */
+    size_t replay(ticker_channel *out, size_t lane, bool wall_clock);
+
+  private:
+    std::string directory_;
+    std::vector<std::unique_ptr<tick_segment>> segments_;
+
+    // Position.
+    size_t segment_;
+    size_t record_;
+    int from_;
+
+    // Open addressing table of the symbols read, by their 16 bytes, to avoid the lock of
+    // the symbol table for each record.
+    struct symbol_slot {
+      uint64_t key[2];
+      symbol_id id;
+      bool used;
+    };
+    std::vector<symbol_slot> symbols_;
+    size_t nb_symbols_;
+
+    symbol_id intern(const char *symbol);
+  };
+
+}
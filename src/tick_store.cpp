@@ -0,0 +1,186 @@
+#include "tick_store.h"
+
+#include <algorithm>
+
+namespace cryptom {
+
+  int tick_store::seconds_of(resolution r) {
+    switch (r) {
+    case one_minute:
+      return 60;
+    case five_minutes:
+      return 5 * 60;
+    case one_hour:
+    default:
+      return 60 * 60;
+    }
+  }
+
+  size_t tick_store::round_up(size_t n) {
+    size_t power = 1;
+    while (power < n) {
+      power <<= 1;
+    }
+    return power;
+  }
+
+  tick_store::series::series(size_t capacity, size_t bar_capacity):
+    first(0),
+    count(0),
+    close(new double[capacity]),
+    high(new double[capacity]),
+    low(new double[capacity]),
+    volume(new double[capacity]),
+    date(new int[capacity]) {
+    for (bar_ring& ring: bars) {
+      ring.first = 0;
+      ring.count = 0;
+      ring.bars.reset(new bar[bar_capacity]);
+    }
+  }
+
+  tick_store::tick_store(size_t samples_per_symbol, size_t bars_per_resolution):
+    capacity_(round_up(std::max<size_t>(samples_per_symbol, 1))),
+    bar_capacity_(round_up(std::max<size_t>(bars_per_resolution, 1))) {
+  }
+
+  bool tick_store::append(const ticker& t) {
+    if (t.symbol >= series_.size()) {
+      series_.resize(t.symbol + 1);
+    }
+    std::unique_ptr<series>& slot = series_[t.symbol];
+    if (slot == nullptr) {
+      slot.reset(new series(capacity_, bar_capacity_));
+    }
+    series& s = *slot;
+
+    size_t mask = capacity_ - 1;
+    if (s.count > 0 && t.date < s.date[(s.first + s.count - 1) & mask]) {
+      return false;
+    }
+
+    // Overwrite the oldest sample once full.
+    size_t index;
+    if (s.count < capacity_) {
+      index = (s.first + s.count) & mask;
+      ++s.count;
+    } else {
+      index = s.first;
+      s.first = (s.first + 1) & mask;
+    }
+    s.close[index] = t.close;
+    s.high[index] = t.high;
+    s.low[index] = t.low;
+    s.volume[index] = t.volume;
+    s.date[index] = t.date;
+
+    size_t bar_mask = bar_capacity_ - 1;
+    for (int r = 0; r < nb_resolutions; r++) {
+      series::bar_ring& ring = s.bars[r];
+      int seconds = seconds_of(static_cast<resolution>(r));
+      int start = t.date - t.date % seconds;
+
+      if (ring.count > 0) {
+	bar& last = ring.bars[(ring.first + ring.count - 1) & bar_mask];
+	if (last.start == start) {
+	  last.high = std::max(last.high, t.close);
+	  last.low = std::min(last.low, t.close);
+	  last.close = t.close;
+	  last.volume = t.volume;
+	  continue;
+	}
+      }
+
+      size_t bar_index;
+      if (ring.count < bar_capacity_) {
+	bar_index = (ring.first + ring.count) & bar_mask;
+	++ring.count;
+      } else {
+	bar_index = ring.first;
+	ring.first = (ring.first + 1) & bar_mask;
+      }
+      ring.bars[bar_index] = bar{start, t.close, t.close, t.close, t.close, t.volume};
+    }
+
+    return true;
+  }
+
+  size_t tick_store::range(symbol_id symbol, int from, int to, std::vector<ticker>& out) const {
+    const series *s = find(symbol);
+    if (s == nullptr) {
+      return 0;
+    }
+    size_t mask = capacity_ - 1;
+
+    // The dates are sorted: binary search of the first sample in the range.
+    size_t low = 0, high = s->count;
+    while (low < high) {
+      size_t middle = (low + high) / 2;
+      if (s->date[(s->first + middle) & mask] < from) {
+	low = middle + 1;
+      } else {
+	high = middle;
+      }
+    }
+
+    size_t n = 0;
+    for (size_t i = low; i < s->count; i++, n++) {
+      size_t index = (s->first + i) & mask;
+      if (s->date[index] >= to) {
+	break;
+      }
+      ticker t;
+      t.high = s->high[index];
+      t.low = s->low[index];
+      t.close = s->close[index];
+      t.volume = s->volume[index];
+      t.date = s->date[index];
+      t.symbol = symbol;
+      t.received = 0;
+      t.queued = 0;
+      out.push_back(t);
+    }
+    return n;
+  }
+
+  size_t tick_store::bars(symbol_id symbol, resolution r, int from, int to, std::vector<bar>& out) const {
+    const series *s = find(symbol);
+    if (s == nullptr) {
+      return 0;
+    }
+    const series::bar_ring& ring = s->bars[r];
+    size_t mask = bar_capacity_ - 1;
+
+    size_t n = 0;
+    for (size_t i = 0; i < ring.count; i++) {
+      const bar& b = ring.bars[(ring.first + i) & mask];
+      if (b.start >= to) {
+	break;
+      }
+      if (b.start >= from) {
+	out.push_back(b);
+	++n;
+      }
+    }
+    return n;
+  }
+
+  size_t tick_store::size(symbol_id symbol) const {
+    const series *s = find(symbol);
+    return s != nullptr ? s->count : 0;
+  }
+
+  size_t tick_store::memory() const {
+    size_t per_series = sizeof(series) +
+      capacity_ * (4 * sizeof(double) + sizeof(int)) +
+      nb_resolutions * bar_capacity_ * sizeof(bar);
+    size_t n = 0;
+    for (const auto& s: series_) {
+      if (s != nullptr) {
+	++n;
+      }
+    }
+    return series_.capacity() * sizeof(series_[0]) + n * per_series;
+  }
+
+}
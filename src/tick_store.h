@@ -0,0 +1,113 @@
+#pragma once
+
+#include "symbol_table.h"
+#include "ticker.h"
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+namespace cryptom {
+
+  /*
+    History of the tickers of each symbol, in memory.
+
+    Each symbol has fixed size ring buffers, one per field (struct of arrays), allocated
+    with its first ticker: appending a ticker does not allocate and the oldest samples
+    are overwritten, so the memory is bounded by the number of symbols. The OHLC bars of
+    1 minute, 5 minutes and 1 hour are updated as the tickers arrive, in rings as well.
+
+    The samples of a symbol are kept in the order of their date, a ticker older than
+    the last one is dropped. Not thread safe, meant for the thread reading the ticker
+    channel.
+  */
+  class tick_store {
+
+  public:
+    enum resolution {
+      one_minute,
+      five_minutes,
+      one_hour,
+      nb_resolutions
+    };
+
+    // Duration of the bars of a resolution, in seconds.
+    static int seconds_of(resolution r);
+
+    struct bar {
+      // Date of the start of the bar, a multiple of its duration.
+      int start;
+      // Of the close prices of the tickers in the bar.
+      double open;
+      double high;
+      double low;
+      double close;
+      // 24h volume given by the last ticker of the bar.
+      double volume;
+    };
+
+    // Capacities are rounded up to a power of 2.
+    tick_store(size_t samples_per_symbol, size_t bars_per_resolution);
+
+    // no copy or assignement
+    tick_store(const tick_store&) = delete;
+    tick_store& operator=(const tick_store&) = delete;
+
+    /**
+       Append the ticker to the history of its symbol and update its bars. Return false
+       if it was dropped because older than the last ticker of the symbol.
+     */
+    bool append(const ticker& t);
+
+    /**
+       Append the tickers of the symbol with from <= date < to, oldest first, to out.
+       Return their number.
+     */
+    size_t range(symbol_id symbol, int from, int to, std::vector<ticker>& out) const;
+
+    /**
+       Append the bars of the symbol starting in [from, to), oldest first, to out. The
+       last one is still open. Return their number.
+     */
+    size_t bars(symbol_id symbol, resolution r, int from, int to, std::vector<bar>& out) const;
+
+    // Number of tickers kept for the symbol.
+    size_t size(symbol_id symbol) const;
+
+    // Memory of the rings of all the symbols, in bytes.
+    size_t memory() const;
+
+  private:
+    struct series {
+      explicit series(size_t capacity, size_t bar_capacity);
+
+      // Ring of the samples: the oldest at first, count of them.
+      size_t first;
+      size_t count;
+      std::unique_ptr<double[]> close;
+      std::unique_ptr<double[]> high;
+      std::unique_ptr<double[]> low;
+      std::unique_ptr<double[]> volume;
+      std::unique_ptr<int[]> date;
+
+      // Ring of the bars of each resolution, the last one is the open bar.
+      struct bar_ring {
+	size_t first;
+	size_t count;
+	std::unique_ptr<bar[]> bars;
+      } bars[nb_resolutions];
+    };
+
+    size_t capacity_;
+    size_t bar_capacity_;
+
+    // Indexed by symbol_id, NULL until the first ticker of the symbol.
+    std::vector<std::unique_ptr<series>> series_;
+
+    static size_t round_up(size_t n);
+
+    const series* find(symbol_id symbol) const {
+      return symbol < series_.size() ? series_[symbol].get() : nullptr;
+    }
+  };
+
+}
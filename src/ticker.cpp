@@ -1,80 +1,355 @@
 #include "ticker.h"
+#include "evbuffer_stream.h"
+#include "decimal.h"
+
+#include <cstring>
 
 namespace cryptom {
 
-  int kucoin_converter::ticker_from_json(const rapidjson::Document& json, ticker& t) const {
+  namespace {
 
     /*
-      {"success":true,
-      "code":"OK",
-      "msg":"Operation succeeded.",
-      "timestamp":1534491836685,
-      "data":{"coinType":"ETH",
-              "trading":true,
-	      "symbol":"ETH-BTC",
-	      "lastDealPrice":0.04631749,
-	      "buy":0.04631749,
-	      "sell":0.04644194,
-	      "change":8.7768E-4,
-	      "coinTypePair":"BTC",
-	      "sort":100,
-	      "feeRate":0.001,
-	      "volValue":120.95825502,
-	      "high":0.046572,
-	      "datetime":1534491836000,
-	      "vol":2645.902635,
-	      "low":0.04500002,
-	      "changeRate":0.0193}}
+      SAX handler for the 24hr ticker of binance. The document is either one ticker
+      object or an array of ticker objects. Only the fields we need are looked at and
+      the ticker is added to the output when its object ends.
     */
+    class binance_ticker_handler:
+      public rapidjson::BaseReaderHandler<rapidjson::UTF8<>, binance_ticker_handler> {
+
+    public:
+      binance_ticker_handler(const symbol_map& symbols, std::vector<ticker>& out):
+	symbols_(symbols),
+	out_(out),
+	depth_(0),
+	ticker_depth_(0),
+	field_(none),
+	found_(0),
+	wanted_(false) {
+      }
+
+      bool StartObject() {
+	++depth_;
+	if (ticker_depth_ == 0) {
+	  // The root is a single ticker.
+	  ticker_depth_ = depth_;
+	}
+
+	if (depth_ == ticker_depth_) {
+	  found_ = 0;
+	  wanted_ = false;
+	  t_.date = 0;
+	}
+	field_ = none;
+	return true;
+      }
+
+      bool EndObject(rapidjson::SizeType) {
+	if (depth_ == ticker_depth_ && found_ == all_fields && wanted_) {
+	  out_.push_back(t_);
+	}
+	--depth_;
+	field_ = none;
+	return true;
+      }
+
+      bool StartArray() {
+	++depth_;
+	if (ticker_depth_ == 0) {
+	  // The root is the array of all the markets.
+	  ticker_depth_ = depth_ + 1;
+	}
+	field_ = none;
+	return true;
+      }
+
+      bool EndArray(rapidjson::SizeType) {
+	--depth_;
+	field_ = none;
+	return true;
+      }
+
+      bool Key(const char* str, rapidjson::SizeType length, bool) {
+	field_ = none;
+	if (depth_ != ticker_depth_) {
+	  return true;
+	}
 
-    if (!json.HasMember("data")) {
+	if (is(str, length, binance_converter::schema.symbol)) {
+	  field_ = symbol;
+	} else if (is(str, length, binance_converter::schema.high)) {
+	  field_ = high;
+	} else if (is(str, length, binance_converter::schema.low)) {
+	  field_ = low;
+	} else if (is(str, length, binance_converter::schema.close)) {
+	  field_ = close;
+	} else if (is(str, length, binance_converter::schema.volume)) {
+	  field_ = volume;
+	} else if (is(str, length, binance_converter::schema.time)) {
+	  field_ = time;
+	}
+	return true;
+      }
+
+      bool Uint64(uint64_t value) {
+	// The time is optional, it is not in all_fields.
+	if (field_ == time) {
+	  t_.date = static_cast<int>(value / 1000);
+	}
+	field_ = none;
+	return true;
+      }
+
+      bool String(const char* str, rapidjson::SizeType length, bool) {
+	switch (field_) {
+	case none:
+	case time:
+	  break;
+	case symbol: {
+	  // Markets which are not in the portfolio are skipped.
+	  auto it = symbols_.find(str);
+	  if (it != symbols_.end()) {
+	    t_.symbol = it->second;
+	    wanted_ = true;
+	  }
+	  found_ |= field_;
+	  break;
+	}
+	default:
+	  // A ticker with an invalid number misses the field, so it is skipped.
+	  if (parse_decimal(str, length, field_ == high ? t_.high :
+			    field_ == low ? t_.low :
+			    field_ == close ? t_.close : t_.volume)) {
+	    found_ |= field_;
+	  }
+	  break;
+	}
+	field_ = none;
+	return true;
+      }
+
+      bool Default() {
+	field_ = none;
+	return true;
+      }
+
+    private:
+      enum field { none = 0, symbol = 1, high = 2, low = 4, close = 8, volume = 16, time = 32 };
+      static const int all_fields = symbol | high | low | close | volume;
+
+      const symbol_map& symbols_;
+      std::vector<ticker>& out_;
+
+      // Current depth of objects and arrays, and depth of the ticker objects.
+      int depth_;
+      int ticker_depth_;
+
+      // Field of the current key, and the fields found in the current ticker object.
+      field field_;
+      int found_;
+
+      // Ticker of the current object, and whether its symbol is in the map.
+      ticker t_;
+      bool wanted_;
+
+      static bool is(const char* str, rapidjson::SizeType length, const char* name) {
+	return length == strlen(name) && memcmp(str, name, length) == 0;
+      }
+    };
+
+  }
+
+  constexpr ticker_schema kucoin_converter::schema;
+  constexpr ticker_schema binance_converter::schema;
+
+  namespace {
+
+    // Read a price or volume. The test on quoted is resolved at compile time.
+    template <bool quoted>
+    inline bool number_field(const rapidjson::Value& object, const char *name, double& out) {
+      rapidjson::Value::ConstMemberIterator it = object.FindMember(name);
+      if (it == object.MemberEnd()) {
+	return false;
+      }
+
+      if (quoted) {
+	return it->value.IsString() &&
+	  parse_decimal(it->value.GetString(), it->value.GetStringLength(), out);
+      }
+
+      if (!it->value.IsNumber()) {
+	return false;
+      }
+      out = it->value.GetDouble();
+      return true;
+    }
+
+  }
+
+  template <class Exchange>
+  int basic_converter<Exchange>::ticker_from_object(const rapidjson::Value& object, ticker& t, const char*& symbol) {
+    constexpr bool quoted = Exchange::schema.quoted_numbers;
+
+    rapidjson::Value::ConstMemberIterator it = object.FindMember(Exchange::schema.symbol);
+    if (it == object.MemberEnd() || !it->value.IsString()) {
       return -1;
     }
+    symbol = it->value.GetString();
 
-    const rapidjson::Value& data_object = json["data"];
-    if (!data_object.IsObject()) {
+    if (!number_field<quoted>(object, Exchange::schema.high, t.high) ||
+	!number_field<quoted>(object, Exchange::schema.low, t.low) ||
+	!number_field<quoted>(object, Exchange::schema.close, t.close) ||
+	!number_field<quoted>(object, Exchange::schema.volume, t.volume)) {
       return -1;
     }
 
-    if (!data_object.HasMember("lastDealPrice") ||
-	!data_object.HasMember("symbol") ||
-	!data_object.HasMember("high") ||
-	!data_object.HasMember("low") ||
-	!data_object.HasMember("vol") ||
-	!data_object.HasMember("datetime")) {
+    it = object.FindMember(Exchange::schema.time);
+    t.date = it != object.MemberEnd() && it->value.IsNumber() ?
+      static_cast<int>(it->value.GetDouble() / 1000) : 0;
+    return 0;
+  }
+
+  template <class Exchange>
+  int basic_converter<Exchange>::ticker_from_json(const rapidjson::Value& json, ticker& t) const {
+    const rapidjson::Value *object = Exchange::payload(json);
+    if (object == nullptr || !object->IsObject()) {
       return -1;
     }
 
-    // ------------------------------------------------
-    if (!data_object["symbol"].IsString()) {
+    const char *symbol;
+    if (ticker_from_object(*object, t, symbol) != 0) {
       return -1;
     }
-    t.symbol = data_object["symbol"].GetString();
 
-    // ------------------------------------------------
-    if (!data_object["high"].IsDouble()) {
+    t.symbol = symbol_table::global().intern(symbol, strlen(symbol));
+    return 0;
+  }
+
+  template <class Exchange>
+  int basic_converter<Exchange>::tickers_from_json(const rapidjson::Value& json,
+						    const symbol_map& symbols,
+						    std::vector<ticker>& out) const {
+    const rapidjson::Value *tickers = Exchange::payload(json);
+    if (tickers == nullptr) {
+      return -1;
+    }
+
+    if (tickers->IsObject()) {
+      ticker t;
+      const char *symbol;
+      if (ticker_from_object(*tickers, t, symbol) != 0) {
+	return -1;
+      }
+      auto it = symbols.find(symbol);
+      if (it != symbols.end()) {
+	t.symbol = it->second;
+	out.push_back(t);
+      }
+      return 0;
+    }
+
+    if (!tickers->IsArray()) {
       return -1;
     }
-    t.high = data_object["high"].GetDouble();
 
-    if (!data_object["low"].IsDouble()) {
+    // All the markets of the exchange. Skip the ones we are not interested in, and the
+    // ones we cannot parse (e.g. markets without trades).
+    for (const rapidjson::Value& object: tickers->GetArray()) {
+      if (!object.IsObject()) {
+	continue;
+      }
+
+      ticker t;
+      const char *symbol;
+      if (ticker_from_object(object, t, symbol) != 0) {
+	continue;
+      }
+
+      auto it = symbols.find(symbol);
+      if (it != symbols.end()) {
+	t.symbol = it->second;
+	out.push_back(t);
+      }
+    }
+    return 0;
+  }
+
+  template <class Exchange>
+  int basic_converter<Exchange>::tickers_from_buffer(evbuffer *buffer,
+						      const symbol_map& symbols,
+						      std::vector<ticker>& out) const {
+    // The in situ parser needs a terminated string. The buffer is ours, it is freed
+    // with the request. The terminator goes to the free space of the last segment,
+    // unless it is full (libevent does not grow a full segment, it appends another).
+    size_t length = evbuffer_get_length(buffer);
+    if (evbuffer_add(buffer, "", 1) != 0) {
       return -1;
     }
-    t.low = data_object["low"].GetDouble();
 
-    if (!data_object["lastDealPrice"].IsDouble()) {
+    // A response which fits in one segment, with its terminator, is parsed where it
+    // is. Otherwise the segments are moved once into a contiguous block, counted to
+    // know how often.
+    char *text;
+    if (evbuffer_get_contiguous_space(buffer) == length + 1) {
+      evbuffer_iovec segment;
+      evbuffer_peek(buffer, -1, NULL, &segment, 1);
+      text = static_cast<char*>(segment.iov_base);
+    } else {
+      arena_.count_pullup();
+      text = reinterpret_cast<char*>(evbuffer_pullup(buffer, -1));
+    }
+    if (text == nullptr) {
       return -1;
     }
-    t.close = data_object["lastDealPrice"].GetDouble();
 
-    if (!data_object["vol"].IsDouble()) {
+    // The strings of the document point to the buffer instead of being copied.
+    json_arena::document_type& json = arena_.parse_insitu(text);
+    if (json.HasParseError()) {
       return -1;
     }
-    t.volume = data_object["vol"].GetDouble();
-    return 0;
+
+    return tickers_from_json(json, symbols, out);
+  }
+
+  const rapidjson::Value* kucoin_converter::payload(const rapidjson::Value& json) {
+
+    /*
+      {"success":true,
+      "code":"OK",
+      "msg":"Operation succeeded.",
+      "timestamp":1534491836685,
+      "data":{"coinType":"ETH",
+              "trading":true,
+	      "symbol":"ETH-BTC",
+	      "lastDealPrice":0.04631749,
+	      "buy":0.04631749,
+	      "sell":0.04644194,
+	      "change":8.7768E-4,
+	      "coinTypePair":"BTC",
+	      "sort":100,
+	      "feeRate":0.001,
+	      "volValue":120.95825502,
+	      "high":0.046572,
+	      "datetime":1534491836000,
+	      "vol":2645.902635,
+	      "low":0.04500002,
+	      "changeRate":0.0193}}
+
+      The all-markets endpoint has the same format, with an array of such objects in "data".
+    */
+
+    if (!json.IsObject()) {
+      return nullptr;
+    }
+    rapidjson::Value::ConstMemberIterator data = json.FindMember("data");
+    if (data == json.MemberEnd()) {
+      return nullptr;
+    }
+    return &data->value;
   }
 
-  int binance_converter::ticker_from_json(const rapidjson::Document& json, ticker& t) const {
+  int binance_converter::tickers_from_buffer(evbuffer *buffer,
+					     const symbol_map& symbols,
+					     std::vector<ticker>& out) const {
 
     /*
       {
@@ -98,45 +373,32 @@ namespace cryptom {
       "lastId": 28460,    // Last tradeId
       "count": 76         // Trade count
       }
-    */
 
+      Without symbol, the endpoint returns an array of such objects for all the markets.
+    */
 
-    if (!json.HasMember("lastPrice") ||
-	!json.HasMember("symbol") ||
-	!json.HasMember("highPrice") ||
-	!json.HasMember("lowPrice") ||
-	!json.HasMember("volume") ||
-	!json.HasMember("closeTime")) {
-      return -1;
-    }
+    evbuffer_stream stream(buffer);
+    binance_ticker_handler handler(symbols, out);
 
-    // ------------------------------------------------
-    if (!json["symbol"].IsString()) {
+    if (reader_.Parse<rapidjson::kParseStopWhenDoneFlag>(stream, handler).IsError()) {
       return -1;
     }
-    t.symbol = json["symbol"].GetString();
+    return 0;
+  }
 
-    // ------------------------------------------------
-    if (!json["highPrice"].IsString()) {
-      return -1;
-    }
-    t.high = std::stod(json["highPrice"].GetString());
+  template class basic_converter<kucoin_converter>;
+  template class basic_converter<binance_converter>;
 
-    if (!json["lowPrice"].IsString()) {
-      return -1;
+  std::unique_ptr<json_converter> make_converter(const std::string& exchange) {
+    if (exchange == "binance") {
+      return std::unique_ptr<json_converter>(new dynamic_converter<binance_converter>());
     }
-    t.low = std::stod(json["lowPrice"].GetString());
 
-    if (!json["lastPrice"].IsString()) {
-      return -1;
+    if (exchange == "kucoin") {
+      return std::unique_ptr<json_converter>(new dynamic_converter<kucoin_converter>());
     }
-    t.close = std::stod(json["lastPrice"].GetString());
 
-    if (!json["volume"].IsString()) {
-      return -1;
-    }
-    t.volume = std::stod(json["volume"].GetString());
-    return 0;
+    return nullptr;
   }
 
 }
@@ -1,7 +1,17 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
 #include <string>
+#include <vector>
 #include "rapidjson/document.h"
+#include "rapidjson/reader.h"
+#include "json_arena.h"
+#include "symbol_table.h"
+
+struct evbuffer;
 
 namespace cryptom {
 
@@ -11,26 +21,178 @@ namespace cryptom {
     double close;
     double volume;
     int date;
-    const char* symbol;
+    // Interned in symbol_table::global(). An id rather than a pointer so the ticker
+    // does not depend on the lifetime of the JSON document.
+    symbol_id symbol;
+    // When the message of the ticker was read from the socket, see receive_time. To
+    // measure the latency of the pipeline, 0 if unknown (e.g. replayed tickers).
+    int64_t received;
+    // When the ticker was pushed to the ticker_channel, see receive_time. 0 if unknown.
+    int64_t queued;
+  };
+
+  // Steady clock in nanoseconds, for ticker::received and ticker::queued.
+  inline int64_t receive_time() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
 
+  // Symbols of the markets we are interested in, with their interned id. Transparent
+  // comparator to look up the symbols of the JSON documents without building std::string.
+  typedef std::map<std::string, symbol_id, std::less<>> symbol_map;
+
+  /*
+    Names of the fields of the ticker objects of an exchange.
+  */
+  struct ticker_schema {
+    const char *symbol;
+    const char *high;
+    const char *low;
+    const char *close;
+    const char *volume;
+    // Time of the ticker, in milliseconds since the epoch. Optional.
+    const char *time;
+    // The prices and volumes are JSON strings ("0.0463") instead of JSON numbers.
+    bool quoted_numbers;
   };
 
-  class json_converter {
+  /*
+    Conversion of the JSON tickers of an exchange, resolved at compile time. Exchange
+    gives its schema (static constexpr ticker_schema schema) and where the tickers are
+    in the document (static const rapidjson::Value* payload(const rapidjson::Value&)).
+    The members are instantiated in ticker.cpp for the exchanges we know.
+  */
+  template <class Exchange>
+  class basic_converter {
   public:
+    // The label names the arena of the converter in json_arena::usage_by_label.
+    explicit basic_converter(const char *label): arena_(label) {}
+
     /**
        Should parse the JSON document in a ticker structure. Will return 0 if ok.
+       The symbol is added to the symbol table if needed.
+     */
+    int ticker_from_json(const rapidjson::Value& json, ticker& t) const;
+
+    /**
+       Parse a JSON document which holds either one ticker or an array of tickers (the
+       endpoint for all the markets). Only the tickers of the given symbols are added to
+       out, with the id of the map. Will return 0 if ok.
+     */
+    int tickers_from_json(const rapidjson::Value& json,
+			  const symbol_map& symbols,
+			  std::vector<ticker>& out) const;
+
+    /**
+       Same as tickers_from_json, reading the JSON text from the buffer of a response.
+       The DOM of the document is built in situ, over the memory of the buffer which is
+       modified, and in the arena.
+     */
+    int tickers_from_buffer(evbuffer *buffer,
+			    const symbol_map& symbols,
+			    std::vector<ticker>& out) const;
+
+    // When tickers_from_buffer finished parsing the document, see json_arena::parsed_at.
+    // Tells the parse from the conversion.
+    int64_t parsed_at() const { return arena_.parsed_at(); }
+
+  protected:
+    /**
+       Parse one ticker object with the schema of the exchange. The symbol of the
+       ticker is not set, it is returned in symbol and points to the document.
+       Will return 0 if ok.
+     */
+    static int ticker_from_object(const rapidjson::Value& object, ticker& t, const char*& symbol);
+
+    // Memory of the documents, reused from one response to the next.
+    mutable json_arena arena_;
+  };
+
+  class kucoin_converter: public basic_converter<kucoin_converter> {
+  public:
+    static constexpr ticker_schema schema = {
+      "symbol", "high", "low", "lastDealPrice", "vol", "datetime", false
+    };
+
+    kucoin_converter(): basic_converter("kucoin") {}
+
+    // The ticker object (or the array of ticker objects) is in "data". NULL if not found.
+    static const rapidjson::Value* payload(const rapidjson::Value& json);
+  };
+
+  class binance_converter: public basic_converter<binance_converter> {
+  public:
+    static constexpr ticker_schema schema = {
+      "symbol", "highPrice", "lowPrice", "lastPrice", "volume", "closeTime", true
+    };
+
+    binance_converter(): basic_converter("binance") {}
+
+    // The document is the ticker object, or the array of ticker objects.
+    static const rapidjson::Value* payload(const rapidjson::Value& json) { return &json; }
+
+    /**
+       Parse the response with rapidjson's SAX reader directly from the segments of
+       the buffer. Only the fields of the ticker are extracted, no DOM is built.
+       Hides the DOM version of basic_converter.
      */
-    virtual int ticker_from_json(const rapidjson::Document& json, ticker& t) const = 0;
+    int tickers_from_buffer(evbuffer *buffer,
+			    const symbol_map& symbols,
+			    std::vector<ticker>& out) const;
+
+    // The document is converted while it is parsed.
+    int64_t parsed_at() const { return 0; }
+
+  private:
+    // The reader keeps its stack between two responses.
+    mutable rapidjson::Reader reader_;
   };
 
-  class kucoin_converter: public json_converter {
+  /*
+    Runtime interface of the converters, when the exchange is only known from the
+    configuration. The clients use the converters directly, see basic_scheduled_client.
+  */
+  class json_converter {
   public:
-    int ticker_from_json(const rapidjson::Document& json, ticker& t) const;
+    virtual ~json_converter() {}
+
+    virtual int ticker_from_json(const rapidjson::Value& json, ticker& t) const = 0;
+
+    virtual int tickers_from_json(const rapidjson::Value& json,
+				  const symbol_map& symbols,
+				  std::vector<ticker>& out) const = 0;
+
+    virtual int tickers_from_buffer(evbuffer *buffer,
+				    const symbol_map& symbols,
+				    std::vector<ticker>& out) const = 0;
   };
 
-  class binance_converter: public json_converter {
+  template <class Converter>
+  class dynamic_converter final: public json_converter {
   public:
-    int ticker_from_json(const rapidjson::Document& json, ticker& t) const;
+    int ticker_from_json(const rapidjson::Value& json, ticker& t) const {
+      return converter_.ticker_from_json(json, t);
+    }
+
+    int tickers_from_json(const rapidjson::Value& json,
+			  const symbol_map& symbols,
+			  std::vector<ticker>& out) const {
+      return converter_.tickers_from_json(json, symbols, out);
+    }
+
+    int tickers_from_buffer(evbuffer *buffer,
+			    const symbol_map& symbols,
+			    std::vector<ticker>& out) const {
+      return converter_.tickers_from_buffer(buffer, symbols, out);
+    }
+
+  private:
+    Converter converter_;
   };
 
+  /**
+     Create the converter of an exchange ("binance" or "kucoin"). NULL if unknown.
+   */
+  std::unique_ptr<json_converter> make_converter(const std::string& exchange);
+
 }
@@ -0,0 +1,141 @@
+#include "ticker_channel.h"
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRYPTOM_CPU_RELAX() _mm_pause()
+#else
+#define CRYPTOM_CPU_RELAX() std::atomic_signal_fence(std::memory_order_seq_cst)
+#endif
+
+namespace cryptom {
+
+  ticker_channel::ticker_channel(size_t nb_lanes, size_t capacity):
+    next_lane_(0),
+    consumers_waiting_(0),
+    producers_waiting_(0) {
+    for (size_t i = 0; i < nb_lanes; i++) {
+      lanes_.emplace_back(new ring(capacity));
+    }
+  }
+
+  bool ticker_channel::try_push(size_t lane, const ticker& t) {
+    if (!lanes_[lane]->push(t)) {
+      return false;
+    }
+    notify_consumers();
+    return true;
+  }
+
+  void ticker_channel::push(size_t lane, const ticker& t) {
+    for (int i = 0; i < spin_iterations; i++) {
+      if (try_push(lane, t)) {
+	return;
+      }
+      CRYPTOM_CPU_RELAX();
+    }
+
+    for (int i = 0; i < yield_iterations; i++) {
+      if (try_push(lane, t)) {
+	return;
+      }
+      std::this_thread::yield();
+    }
+
+    while (!try_push(lane, t)) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      ++producers_waiting_;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      // Check again once we are registered, the consumer might have popped in between.
+      if (lanes_[lane]->push(t)) {
+	--producers_waiting_;
+	lock.unlock();
+	notify_consumers();
+	return;
+      }
+      // The timeout is only a safety net, the consumer wakes us up.
+      not_full_.wait_for(lock, std::chrono::milliseconds(100));
+      --producers_waiting_;
+    }
+  }
+
+  bool ticker_channel::try_pop(ticker& t) {
+    if (!pop_lanes(t)) {
+      return false;
+    }
+    notify_producers();
+    return true;
+  }
+
+  bool ticker_channel::pop_lanes(ticker& t) {
+    // Only the consumer thread pops, so next_lane_ needs no synchronisation.
+    size_t nb_lanes = lanes_.size();
+    for (size_t i = 0; i < nb_lanes; i++) {
+      size_t index = next_lane_;
+      next_lane_ = next_lane_ + 1 == nb_lanes ? 0 : next_lane_ + 1;
+      if (lanes_[index]->pop(t)) {
+	return true;
+      }
+    }
+    return false;
+  }
+
+  void ticker_channel::pop(ticker& t) {
+    while (!pop(t, std::chrono::milliseconds(1000)))
+      ;
+  }
+
+  bool ticker_channel::pop(ticker& t, std::chrono::milliseconds timeout) {
+    for (int i = 0; i < spin_iterations; i++) {
+      if (try_pop(t)) {
+	return true;
+      }
+      CRYPTOM_CPU_RELAX();
+    }
+
+    for (int i = 0; i < yield_iterations; i++) {
+      if (try_pop(t)) {
+	return true;
+      }
+      std::this_thread::yield();
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::unique_lock<std::mutex> lock(mutex_);
+    ++consumers_waiting_;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    bool popped;
+    while (!(popped = pop_lanes(t))) {
+      if (not_empty_.wait_until(lock, deadline) == std::cv_status::timeout) {
+	popped = pop_lanes(t);
+	break;
+      }
+    }
+    --consumers_waiting_;
+    lock.unlock();
+
+    if (popped) {
+      notify_producers();
+    }
+    return popped;
+  }
+
+  void ticker_channel::notify_consumers() {
+    // Pairs with the fence of the consumer: either it sees our ticker, or we see it waiting.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (consumers_waiting_.load(std::memory_order_relaxed) > 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      not_empty_.notify_all();
+    }
+  }
+
+  void ticker_channel::notify_producers() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (producers_waiting_.load(std::memory_order_relaxed) > 0) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      not_full_.notify_all();
+    }
+  }
+
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "ticker.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <boost/lockfree/spsc_queue.hpp>
+
+namespace cryptom {
+
+  /*
+    Channel of tickers between the IO threads and the consumer. Each IO thread has its
+    own lane, a single-producer single-consumer ring, so producers never contend.
+
+    When the queue is empty (consumer) or full (producer), the waiting side spins for a
+    short while, then yields, then parks on a condition variable (a futex on Linux).
+    The other side only takes the lock to wake it up when somebody is parked, so the
+    fast path stays lock-free and an idle consumer does not burn a core.
+  */
+  class ticker_channel {
+
+  public:
+    // One lane per producer thread, each with room for capacity tickers.
+    ticker_channel(size_t nb_lanes, size_t capacity);
+
+    // no copy or assignement
+    ticker_channel(const ticker_channel&) = delete;
+    ticker_channel& operator=(const ticker_channel&) = delete;
+
+    size_t nb_lanes() const { return lanes_.size(); }
+
+    // Send a ticker on the lane of the calling thread, waiting if it is full.
+    void push(size_t lane, const ticker& t);
+
+    // Send a ticker if there is room in the lane. Never blocks.
+    bool try_push(size_t lane, const ticker& t);
+
+    // Receive a ticker, waiting until there is one.
+    void pop(ticker& t);
+
+    // Receive a ticker, waiting at most timeout. Return false if there was none.
+    bool pop(ticker& t, std::chrono::milliseconds timeout);
+
+    // Receive a ticker if there is one in any lane. Never blocks.
+    bool try_pop(ticker& t);
+
+  private:
+    // Iterations of busy spinning, then of yielding, before parking.
+    static const int spin_iterations = 100;
+    static const int yield_iterations = 10;
+
+    typedef boost::lockfree::spsc_queue<ticker> ring;
+    std::vector<std::unique_ptr<ring>> lanes_;
+
+    // Lane to look at first in the next pop, so that no lane starves the others.
+    size_t next_lane_;
+
+    // Number of threads parked on each condition.
+    std::atomic<int> consumers_waiting_;
+    std::atomic<int> producers_waiting_;
+
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+
+    // Pop from the first non empty lane, without waking up the producers.
+    bool pop_lanes(ticker& t);
+
+    // Wake up the parked threads of the other side, if any.
+    void notify_consumers();
+    void notify_producers();
+  };
+
+}
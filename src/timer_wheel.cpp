@@ -0,0 +1,187 @@
+#include "timer_wheel.h"
+
+#include <algorithm>
+
+namespace cryptom {
+
+  timer_wheel::timer::~timer() {
+    if (pending() && wheel_ != nullptr)
+      wheel_->cancel(this);
+  }
+
+  timer_wheel::timer_wheel(event_base *base, clock::duration resolution):
+    base_(base),
+    resolution_(resolution),
+    start_(clock::now()),
+    current_(0),
+    size_(0) {
+    for (int level = 0; level < levels; level++) {
+      for (uint64_t index = 0; index < slots_per_level; index++) {
+	make_empty(&slots_[level][index]);
+      }
+    }
+
+    tick_ = event_new(base, -1, EV_PERSIST, &timer_wheel::libevent_tick, this);
+  }
+
+  timer_wheel::~timer_wheel() {
+    // The timers may outlive the wheel, they must not cancel themselves in it.
+    for (int level = 0; level < levels; level++) {
+      for (uint64_t index = 0; index < slots_per_level; index++) {
+	timer *head = &slots_[level][index];
+	while (head->next_ != head) {
+	  timer *t = head->next_;
+	  unlink(t);
+	  t->wheel_ = nullptr;
+	}
+      }
+    }
+
+    if (tick_ != nullptr)
+      event_free(tick_);
+  }
+
+  uint64_t timer_wheel::tick_of(clock::time_point when) const {
+    if (when <= start_) {
+      return 0;
+    }
+    return (when - start_) / resolution_;
+  }
+
+  void timer_wheel::link(timer *head, timer *t) {
+    t->prev_ = head->prev_;
+    t->next_ = head;
+    head->prev_->next_ = t;
+    head->prev_ = t;
+  }
+
+  void timer_wheel::unlink(timer *t) {
+    t->prev_->next_ = t->next_;
+    t->next_->prev_ = t->prev_;
+    t->prev_ = t->next_ = nullptr;
+  }
+
+  void timer_wheel::splice(timer *from, timer *to) {
+    if (from->next_ == from) {
+      return;
+    }
+    to->next_ = from->next_;
+    to->prev_ = from->prev_;
+    to->next_->prev_ = to;
+    to->prev_->next_ = to;
+    make_empty(from);
+  }
+
+  void timer_wheel::insert(timer *t) {
+    uint64_t delta = t->expires_ - current_;
+
+    // Smallest level whose span holds the delay.
+    int level = 0;
+    while (level < levels - 1 && delta >= (uint64_t(1) << (level_bits * (level + 1)))) {
+      ++level;
+    }
+
+    // Beyond the span of the wheel, park the timer in the last slot of the top level,
+    // it is put back in the right place when that slot is cascaded.
+    uint64_t expires = t->expires_;
+    uint64_t span = uint64_t(1) << (level_bits * levels);
+    if (delta >= span) {
+      expires = current_ + span - (uint64_t(1) << (level_bits * (levels - 1)));
+    }
+
+    link(&slots_[level][(expires >> (level_bits * level)) & slot_mask], t);
+  }
+
+  void timer_wheel::schedule(timer *t, clock::time_point when) {
+    if (t->pending() && t->wheel_ != nullptr) {
+      unlink(t);
+      --t->wheel_->size_;
+    }
+
+    // The tick is stopped while the wheel is empty, catch up with the time.
+    if (size_ == 0) {
+      current_ = std::max(current_, tick_of(clock::now()));
+    }
+
+    // Rounded up to the next tick, and never in a tick already processed.
+    uint64_t expires = tick_of(when);
+    if (when > start_ + expires * resolution_) {
+      ++expires;
+    }
+    t->expires_ = std::max(expires, current_ + 1);
+    t->wheel_ = this;
+
+    insert(t);
+    ++size_;
+    ++stats_.scheduled;
+
+    if (!evtimer_pending(tick_, NULL)) {
+      long us = std::chrono::duration_cast<std::chrono::microseconds>(resolution_).count();
+      timeval interval{us / 1000000, us % 1000000};
+      evtimer_add(tick_, &interval);
+    }
+  }
+
+  void timer_wheel::cancel(timer *t) {
+    if (!t->pending()) {
+      return;
+    }
+    unlink(t);
+    --size_;
+    ++stats_.cancelled;
+  }
+
+  void timer_wheel::cascade(int level, uint64_t index) {
+    sentinel moved;
+    make_empty(&moved);
+    splice(&slots_[level][index], &moved);
+
+    while (moved.next_ != &moved) {
+      timer *t = moved.next_;
+      unlink(t);
+      insert(t);
+      ++stats_.cascaded;
+    }
+  }
+
+  void timer_wheel::run() {
+    ++stats_.ticks;
+
+    // Process each tick since the last run, the loop may have been late.
+    uint64_t now = tick_of(clock::now());
+    while (current_ < now) {
+      if (size_ == 0) {
+	current_ = now;
+	break;
+      }
+
+      ++current_;
+
+      // At the start of the span of a slot of a higher level, its timers go down.
+      for (int level = 1; level < levels; level++) {
+	if ((current_ & ((uint64_t(1) << (level_bits * level)) - 1)) != 0) {
+	  break;
+	}
+	cascade(level, (current_ >> (level_bits * level)) & slot_mask);
+      }
+
+      // Out of the slot before the callbacks, which may schedule or cancel timers.
+      sentinel due;
+      make_empty(&due);
+      splice(&slots_[0][current_ & slot_mask], &due);
+
+      while (due.next_ != &due) {
+	timer *t = due.next_;
+	unlink(t);
+	--size_;
+	++stats_.fired;
+	t->expire();
+      }
+    }
+
+    if (size_ == 0) {
+      evtimer_del(tick_);
+    }
+  }
+
+}
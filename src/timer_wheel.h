@@ -0,0 +1,124 @@
+#pragma once
+
+#include <event2/event.h>
+#include <chrono>
+#include <cstdint>
+
+namespace cryptom {
+
+  /*
+    Hierarchical timer wheel of an event loop, for the many periodic timers of the
+    clients. Scheduling and cancelling a timer is O(1), and a single libevent timer
+    ticks the wheel, instead of one entry per timer in the min-heap of libevent.
+
+    The wheel has 4 levels of 64 slots. The first level holds the timers due in the
+    next 64 ticks, one slot per tick, the next levels hold 64 times longer spans per
+    slot and are cascaded down as the time comes. The timers due in the same tick fire
+    together, in the order they were scheduled. The timers are not owned by the wheel.
+  */
+  class timer_wheel {
+
+  public:
+    typedef std::chrono::steady_clock clock;
+
+    /*
+      Node of the intrusive lists of the wheel. Cancelled when destroyed.
+    */
+    class timer {
+      friend class timer_wheel;
+
+    public:
+      timer(): wheel_(nullptr), prev_(nullptr), next_(nullptr), expires_(0) {}
+      virtual ~timer();
+
+      // no copy or assignement. The wheel holds the address of the timer.
+      timer(const timer&) = delete;
+      timer& operator=(const timer&) = delete;
+
+      bool pending() const { return next_ != nullptr; }
+
+    protected:
+      // Called from the loop once due. The timer may be scheduled again from there.
+      virtual void expire() = 0;
+
+    private:
+      timer_wheel *wheel_;
+      timer *prev_;
+      timer *next_;
+      // Tick at which the timer is due.
+      uint64_t expires_;
+    };
+
+    struct stats {
+      unsigned long scheduled = 0;
+      unsigned long cancelled = 0;
+      unsigned long fired = 0;
+      // Timers moved down a level.
+      unsigned long cascaded = 0;
+      unsigned long ticks = 0;
+    };
+
+    // The resolution is the duration of a tick: the timers fire up to one tick late.
+    timer_wheel(event_base *base, clock::duration resolution = std::chrono::milliseconds(10));
+    ~timer_wheel();
+
+    // no copy or assignement
+    timer_wheel(const timer_wheel&) = delete;
+    timer_wheel& operator=(const timer_wheel&) = delete;
+
+    // Fire the timer at the given time (on the next tick if already past). Schedules
+    // it again if pending.
+    void schedule(timer *t, clock::time_point when);
+    void schedule(timer *t, clock::duration delay) { schedule(t, clock::now() + delay); }
+
+    void cancel(timer *t);
+
+    // Number of pending timers.
+    size_t size() const { return size_; }
+
+    const stats& get_stats() const { return stats_; }
+
+  private:
+    static const int level_bits = 6;
+    static const int levels = 4;
+    static const uint64_t slots_per_level = 1 << level_bits;
+    static const uint64_t slot_mask = slots_per_level - 1;
+
+    event_base *base_;
+    clock::duration resolution_;
+    clock::time_point start_;
+
+    // Last tick processed.
+    uint64_t current_;
+
+    // Head of the circular list of the timers of a slot.
+    struct sentinel: timer {
+      void expire() {}
+    };
+    sentinel slots_[levels][slots_per_level];
+
+    size_t size_;
+
+    event *tick_;
+
+    stats stats_;
+
+    uint64_t tick_of(clock::time_point when) const;
+
+    // Put the timer in the slot of its expiration tick.
+    void insert(timer *t);
+    static void make_empty(timer *head) { head->prev_ = head->next_ = head; }
+    static void link(timer *head, timer *t);
+    static void unlink(timer *t);
+    // Move all the timers of the list from to the empty list to.
+    static void splice(timer *from, timer *to);
+    // Move the timers of a slot of a higher level to the lower levels.
+    void cascade(int level, uint64_t index);
+
+    void run();
+    static void libevent_tick(evutil_socket_t fd, short what, void *arg) {
+      static_cast<timer_wheel*>(arg)->run();
+    }
+  };
+
+}
@@ -0,0 +1,238 @@
+#include "tls_context.h"
+#include "openssl_hostname_validation.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <openssl/err.h>
+
+namespace cryptom {
+
+  static void
+  err_openssl(const char *func)
+  {
+    fprintf (stderr, "%s failed:\n", func);
+
+    /* This is the OpenSSL function that prints the contents of the
+     * error stack to the specified file handle. */
+    ERR_print_errors_fp (stderr);
+
+    exit(1);
+  }
+
+  tls_context::tls_context(const char *ca_file) {
+
+    ssl_ctx_ = SSL_CTX_new(SSLv23_method());
+    if (ssl_ctx_ == NULL) {
+      err_openssl("SSL_CTX_new()");
+    }
+    SSL_CTX_set_app_data(ssl_ctx_, this);
+
+    host_index_ = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    listener_index_ = SSL_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+
+    /* TODO: Add certificate loading on Windows as well */
+    /* Attempt to use the system's trusted root certificates. This is done
+     * once for all the connections of the process. */
+    X509_STORE *store = SSL_CTX_get_cert_store(ssl_ctx_);
+    if (X509_STORE_set_default_paths(store) != 1) {
+      err_openssl("X509_STORE_set_default_paths()");
+    }
+    if (ca_file != NULL && X509_STORE_load_locations(store, ca_file, NULL) != 1) {
+      err_openssl("X509_STORE_load_locations()");
+    }
+
+    /* Ask OpenSSL to verify the server certificate.  Note that this
+     * does NOT include verifying that the hostname is correct.
+     * So, by itself, this means anyone with any legitimate
+     * CA-issued certificate for any website, can impersonate any
+     * other website in the world.  This is not good.  See "The
+     * Most Dangerous Code in the World" article at
+     * https://crypto.stanford.edu/~dabo/pubs/abstracts/ssl-client-bugs.html
+     */
+    SSL_CTX_set_verify(ssl_ctx_, SSL_VERIFY_PEER, NULL);
+
+    /* This is how we solve the problem mentioned in the previous
+     * comment.  We "wrap" OpenSSL's validation routine in our
+     * own routine, which also validates the hostname by calling
+     * the code provided by iSECPartners.  Note that even though
+     * the "Everything You've Always Wanted to Know About
+     * Certificate Validation With OpenSSL (But Were Afraid to
+     * Ask)" paper from iSECPartners says very explicitly not to
+     * call SSL_CTX_set_cert_verify_callback (at the bottom of
+     * page 2), what we're doing here is safe because our
+     * cert_verify_callback() calls X509_verify_cert(), which is
+     * OpenSSL's built-in routine which would have been called if
+     * we hadn't set the callback.  Therefore, we're just
+     * "wrapping" OpenSSL's routine, not replacing it.
+     * The context is shared by all the hosts so the hostname is
+     * taken from the SSL object. */
+    SSL_CTX_set_cert_verify_callback(ssl_ctx_, &tls_context::openssl_cert_verify, (void *) this);
+
+    /* Client side session cache. OpenSSL's internal cache is only used by
+     * servers, so we store the sessions ourselves, by host. Session tickets
+     * are enabled by default. */
+    SSL_CTX_set_session_cache_mode(ssl_ctx_, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ssl_ctx_, &tls_context::openssl_new_session);
+
+    SSL_CTX_set_info_callback(ssl_ctx_, &tls_context::openssl_info);
+  }
+
+  tls_context::~tls_context() {
+    for (auto& entry: sessions_) {
+      if (entry.second != nullptr)
+	SSL_SESSION_free(entry.second);
+    }
+
+    SSL_CTX_free(ssl_ctx_);
+  }
+
+  SSL* tls_context::new_ssl(const char *host) {
+    SSL *ssl = SSL_new(ssl_ctx_);
+    if (ssl == NULL) {
+      ERR_print_errors_fp(stderr);
+      return nullptr;
+    }
+
+    SSL_SESSION *session;
+    const char *host_str;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // The key of the map is used as host name by the SSL object. Nodes of a map are stable.
+      auto it = sessions_.emplace(host, nullptr).first;
+      host_str = it->first.c_str();
+      session = it->second;
+      if (session != nullptr) {
+	SSL_set_session(ssl, session);
+      }
+    }
+
+    SSL_set_ex_data(ssl, host_index_, (void*) host_str);
+
+#ifdef SSL_CTRL_SET_TLSEXT_HOSTNAME
+    // Set hostname for SNI extension
+    SSL_set_tlsext_host_name(ssl, host);
+#endif
+
+    return ssl;
+  }
+
+  void tls_context::watch_handshakes(SSL *ssl, handshake_listener *listener) {
+    SSL_set_ex_data(ssl, listener_index_, listener);
+  }
+
+  const char* tls_context::host_of(const SSL *ssl) const {
+    return static_cast<const char*>(SSL_get_ex_data(ssl, host_index_));
+  }
+
+  int tls_context::openssl_new_session(SSL *ssl, SSL_SESSION *session) {
+    tls_context *context = static_cast<tls_context*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    return context->new_session(ssl, session);
+  }
+
+  int tls_context::new_session(SSL *ssl, SSL_SESSION *session) {
+    const char *host = host_of(ssl);
+    if (host == nullptr) {
+      return 0;
+    }
+
+    // A copy: the session of the connection is marked not resumable when the SSL
+    // object is freed without a clean shutdown, which is how libevent closes.
+    SSL_SESSION *copy = SSL_SESSION_dup(session);
+    if (copy == NULL) {
+      return 0;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    SSL_SESSION *&cached = sessions_[host];
+    if (cached != nullptr) {
+      SSL_SESSION_free(cached);
+    }
+    cached = copy;
+    return 0;
+  }
+
+  void tls_context::openssl_info(const SSL *ssl, int where, int ret) {
+    if ((where & (SSL_CB_HANDSHAKE_START | SSL_CB_HANDSHAKE_DONE)) == 0) {
+      return;
+    }
+
+    tls_context *context = static_cast<tls_context*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    handshake_listener *listener = static_cast<handshake_listener*>(SSL_get_ex_data(ssl, context->listener_index_));
+    if ((where & SSL_CB_HANDSHAKE_START) != 0) {
+      if (listener != nullptr)
+	listener->handshake_started();
+      return;
+    }
+
+    if (SSL_session_reused(const_cast<SSL*>(ssl))) {
+      ++context->stats_.resumed_handshakes;
+    } else {
+      ++context->stats_.full_handshakes;
+    }
+    if (listener != nullptr)
+      listener->handshake_done();
+  }
+
+  int tls_context::openssl_cert_verify(X509_STORE_CTX *x509_ctx, void *arg)
+  {
+    char cert_str[256];
+    const char *res_str = "X509_verify_cert failed";
+    HostnameValidationResult res = Error;
+
+    tls_context *context = static_cast<tls_context*>(arg);
+    SSL *ssl = static_cast<SSL*>(X509_STORE_CTX_get_ex_data(x509_ctx, SSL_get_ex_data_X509_STORE_CTX_idx()));
+    const char *host = context->host_of(ssl);
+    if (host == nullptr) {
+      fprintf(stderr, "No host name to validate the certificate\n");
+      return 0;
+    }
+
+    /* This is the function that OpenSSL would call if we hadn't called
+     * SSL_CTX_set_cert_verify_callback().  Therefore, we are "wrapping"
+     * the default functionality, rather than replacing it. */
+    int ok_so_far = 0;
+
+    X509 *server_cert = NULL;
+
+    ok_so_far = X509_verify_cert(x509_ctx);
+
+    server_cert = X509_STORE_CTX_get_current_cert(x509_ctx);
+
+    if (ok_so_far) {
+      res = validate_hostname(host, server_cert);
+
+      switch (res) {
+      case MatchFound:
+	res_str = "MatchFound";
+	break;
+      case MatchNotFound:
+	res_str = "MatchNotFound";
+	break;
+      case NoSANPresent:
+	res_str = "NoSANPresent";
+	break;
+      case MalformedCertificate:
+	res_str = "MalformedCertificate";
+	break;
+      case Error:
+	res_str = "Error";
+	break;
+      default:
+	res_str = "WTF!";
+	break;
+      }
+    }
+
+    if (res == MatchFound) {
+      return 1;
+    }
+
+    // Only the failures are worth a line, the check runs at each full handshake.
+    X509_NAME_oneline(X509_get_subject_name (server_cert),
+		      cert_str, sizeof (cert_str));
+    fprintf(stderr, "Got '%s' for hostname '%s' and certificate:\n%s\n",
+	    res_str, host, cert_str);
+    return 0;
+  }
+
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <openssl/ssl.h>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace cryptom {
+
+  /*
+    Process-wide TLS client context. The system trust store is loaded once and
+    the TLS sessions (session IDs and tickets) are cached by host, so that a
+    reconnection to an exchange does an abbreviated handshake.
+
+    Can be shared by all the connection pools, from any thread.
+  */
+  class tls_context {
+
+  public:
+
+    struct stats {
+      // Handshakes with a full key exchange and certificate verification.
+      std::atomic<unsigned long> full_handshakes{0};
+      // Handshakes which resumed a cached session.
+      std::atomic<unsigned long> resumed_handshakes{0};
+    };
+
+    /*
+      Told when the handshakes of an SSL object start and finish, in the thread of
+      its connection. See watch_handshakes.
+    */
+    class handshake_listener {
+    public:
+      virtual ~handshake_listener() {}
+      virtual void handshake_started() = 0;
+      virtual void handshake_done() = 0;
+    };
+
+    // ca_file: PEM file of more certificates to trust, e.g. the CA of a mock exchange.
+    explicit tls_context(const char *ca_file = nullptr);
+    ~tls_context();
+
+    // no copy or assignement
+    tls_context(const tls_context&) = delete;
+    tls_context& operator=(const tls_context&) = delete;
+
+    /*
+      Create a new SSL object to connect to the given host: set the SNI extension,
+      the hostname to validate in the certificate and the cached session of this
+      host if any. The caller owns the SSL object.
+    */
+    SSL* new_ssl(const char *host);
+
+    // Tell the listener about the handshakes of the SSL object, NULL to stop.
+    void watch_handshakes(SSL *ssl, handshake_listener *listener);
+
+    const stats& get_stats() const { return stats_; }
+
+  private:
+
+    SSL_CTX *ssl_ctx_;
+
+    // Index of the host name (const char*) in the SSL ex_data.
+    int host_index_;
+    // Index of the handshake_listener in the SSL ex_data.
+    int listener_index_;
+
+    // Last session received for each host. Protected by the mutex since several event
+    // loops can use the same context.
+    std::mutex mutex_;
+    std::map<std::string, SSL_SESSION*> sessions_;
+
+    stats stats_;
+
+    // Return the host name stored in the ex_data of the SSL object.
+    const char* host_of(const SSL *ssl) const;
+
+    /*
+      Called by OpenSSL when the server gives us a new session. Caches a copy of the
+      session, and returns 0 as we keep no reference to the one of OpenSSL.
+    */
+    static int openssl_new_session(SSL *ssl, SSL_SESSION *session);
+    int new_session(SSL *ssl, SSL_SESSION *session);
+
+    /*
+      Called by OpenSSL at each step of the handshake. Used to count resumed sessions
+      and to tell the listeners.
+    */
+    static void openssl_info(const SSL *ssl, int where, int ret);
+
+    static int openssl_cert_verify(X509_STORE_CTX *x509_ctx, void *arg);
+  };
+
+}
@@ -0,0 +1,159 @@
+#include "websocket.h"
+#include <event2/buffer.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace cryptom {
+
+  namespace websocket {
+
+    namespace {
+
+      // Appended to the key by the server before hashing it, see RFC 6455 section 1.3.
+      const char *handshake_guid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+      std::string base64(const unsigned char *data, size_t length) {
+	// 4 characters for each 3 bytes and the terminating 0 written by OpenSSL: large
+	// enough for the nonce and the SHA-1 digest.
+	char encoded[64];
+	int size = EVP_EncodeBlock(reinterpret_cast<unsigned char*>(encoded), data, length);
+	return std::string(encoded, size);
+      }
+
+    }
+
+    std::string make_key() {
+      unsigned char nonce[16];
+      if (RAND_bytes(nonce, sizeof(nonce)) != 1) {
+	// The key only protects against caching proxies, it does not need to be secret.
+	for (size_t i = 0; i < sizeof(nonce); i++) {
+	  nonce[i] = static_cast<unsigned char>(rand());
+	}
+      }
+      return base64(nonce, sizeof(nonce));
+    }
+
+    std::string accept_key(const std::string& key) {
+      std::string text = key + handshake_guid;
+      unsigned char digest[SHA_DIGEST_LENGTH];
+      SHA1(reinterpret_cast<const unsigned char*>(text.data()), text.size(), digest);
+      return base64(digest, sizeof(digest));
+    }
+
+    int read_header(evbuffer *buffer, frame_header& header) {
+      // The largest header: 2 bytes, 8 bytes of extended length and the mask.
+      unsigned char bytes[14];
+      ev_ssize_t available = evbuffer_copyout(buffer, bytes, sizeof(bytes));
+      if (available < 2) {
+	return 0;
+      }
+
+      // No extension is negotiated, so the reserved bits must be 0.
+      if ((bytes[0] & 0x70) != 0) {
+	return -1;
+      }
+
+      header.fin = (bytes[0] & 0x80) != 0;
+      header.opcode = bytes[0] & 0x0f;
+      header.masked = (bytes[1] & 0x80) != 0;
+      header.length = bytes[1] & 0x7f;
+      header.size = 2;
+
+      if (header.length == 126) {
+	header.size += 2;
+      } else if (header.length == 127) {
+	header.size += 8;
+      }
+      if (header.masked) {
+	header.size += 4;
+      }
+      if (available < static_cast<ev_ssize_t>(header.size)) {
+	return 0;
+      }
+
+      if (header.length == 126) {
+	header.length = (static_cast<uint64_t>(bytes[2]) << 8) | bytes[3];
+      } else if (header.length == 127) {
+	header.length = 0;
+	for (int i = 0; i < 8; i++) {
+	  header.length = (header.length << 8) | bytes[2 + i];
+	}
+      }
+
+      if (header.masked) {
+	memcpy(header.mask, bytes + header.size - 4, 4);
+      }
+
+      if (is_control(header.opcode) && (!header.fin || header.length > 125)) {
+	return -1;
+      }
+      return 1;
+    }
+
+    int write_frame(evbuffer *buffer, int opcode, const char *payload, size_t length, bool mask) {
+      unsigned char header[14];
+      size_t size = 0;
+
+      header[size++] = 0x80 | opcode;
+      unsigned char mask_bit = mask ? 0x80 : 0;
+      if (length < 126) {
+	header[size++] = mask_bit | static_cast<unsigned char>(length);
+      } else if (length <= 0xffff) {
+	header[size++] = mask_bit | 126;
+	header[size++] = static_cast<unsigned char>(length >> 8);
+	header[size++] = static_cast<unsigned char>(length);
+      } else {
+	header[size++] = mask_bit | 127;
+	for (int i = 7; i >= 0; i--) {
+	  header[size++] = static_cast<unsigned char>(static_cast<uint64_t>(length) >> (8 * i));
+	}
+      }
+
+      unsigned char key[4] = {0, 0, 0, 0};
+      if (mask) {
+	// The masking key must be unpredictable (section 5.3).
+	if (RAND_bytes(key, sizeof(key)) != 1) {
+	  for (size_t i = 0; i < sizeof(key); i++) {
+	    key[i] = static_cast<unsigned char>(rand());
+	  }
+	}
+	memcpy(header + size, key, sizeof(key));
+	size += sizeof(key);
+      }
+
+      // The header and the payload in one piece: a header alone would be followed by
+      // the next frame.
+      evbuffer_iovec space;
+      if (evbuffer_reserve_space(buffer, size + length, &space, 1) != 1) {
+	return -1;
+      }
+      char *out = static_cast<char*>(space.iov_base);
+      memcpy(out, header, size);
+      out += size;
+      if (!mask) {
+	if (length > 0) {
+	  memcpy(out, payload, length);
+	}
+      } else {
+	// Mask while writing in the buffer, instead of in a temporary copy.
+	for (size_t i = 0; i < length; i++) {
+	  out[i] = payload[i] ^ key[i & 3];
+	}
+      }
+      space.iov_len = size + length;
+      return evbuffer_commit_space(buffer, &space, 1);
+    }
+
+    void unmask(char *data, size_t length, const unsigned char mask[4], uint64_t offset) {
+      for (size_t i = 0; i < length; i++) {
+	data[i] ^= mask[(offset + i) & 3];
+      }
+    }
+
+  }
+
+}
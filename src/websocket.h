@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+struct evbuffer;
+
+namespace cryptom {
+
+  /*
+    Framing of the WebSocket protocol (RFC 6455), shared by the streaming client and
+    the stand-in server of the tools.
+  */
+  namespace websocket {
+
+    enum opcode {
+      continuation = 0x0,
+      text = 0x1,
+      binary = 0x2,
+      close = 0x8,
+      ping = 0x9,
+      pong = 0xa
+    };
+
+    // Control frames (close, ping, pong) have the high bit of the opcode set.
+    inline bool is_control(int op) { return (op & 0x8) != 0; }
+
+    struct frame_header {
+      bool fin;
+      int opcode;
+      bool masked;
+      unsigned char mask[4];
+      uint64_t length;
+      // Size of the header itself, before the payload.
+      size_t size;
+    };
+
+    /*
+      Random key of the opening handshake (Sec-WebSocket-Key), base64 encoded.
+    */
+    std::string make_key();
+
+    /*
+      Value of Sec-WebSocket-Accept the server must answer to the given key.
+    */
+    std::string accept_key(const std::string& key);
+
+    /*
+      Decode the header of the first frame of the buffer, without removing it.
+      Return 1 if the header is complete, 0 if more bytes are needed and -1 if it is
+      invalid (reserved bits set, or control frame fragmented or too long).
+    */
+    int read_header(evbuffer *buffer, frame_header& header);
+
+    /*
+      Append a complete frame to the buffer. The frames of a client must be masked,
+      the ones of a server must not. Return 0 if ok, -1 if the buffer cannot take the
+      frame: nothing is appended then.
+    */
+    int write_frame(evbuffer *buffer, int opcode, const char *payload, size_t length, bool mask);
+
+    /*
+      Apply the mask to the payload, in place. offset is the position of data in the
+      payload of the frame.
+    */
+    void unmask(char *data, size_t length, const unsigned char mask[4], uint64_t offset = 0);
+
+  }
+
+}
@@ -0,0 +1,473 @@
+#include "websocket_client.h"
+#include "websocket.h"
+#include <event2/buffer.h>
+#include <event2/bufferevent_ssl.h>
+#include <event2/dns.h>
+#include <event2/util.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include <openssl/err.h>
+
+namespace cryptom {
+
+  websocket_client::websocket_client(event_base *base, const char *url,
+				     tls_context *tls,
+				     dns_cache *dns,
+				     std::unique_ptr<stream_protocol> protocol,
+				     symbol_map symbols,
+				     ticker_channel *out_queue,
+				     size_t lane,
+				     stage_histograms *metrics):
+    base_(base),
+    secure_(false),
+    tls_(tls),
+    dns_(dns),
+    protocol_(std::move(protocol)),
+    symbols_(std::move(symbols)),
+    out_queue_(out_queue),
+    lane_(lane),
+    metrics_(metrics),
+    bev_(nullptr),
+    state_(disconnected),
+    message_opcode_(websocket::text),
+    in_message_(false),
+    backoff_(min_backoff) {
+
+    heartbeat_timer_ = event_new(base, -1, EV_PERSIST, &websocket_client::libevent_heartbeat, this);
+    reconnect_timer_ = evtimer_new(base, &websocket_client::libevent_reconnect, this);
+
+    uri_ = evhttp_uri_parse(url);
+    const char *scheme = uri_ != NULL ? evhttp_uri_get_scheme(uri_) : NULL;
+    if (scheme == NULL || evhttp_uri_get_host(uri_) == NULL ||
+	(strcasecmp(scheme, "ws") != 0 && strcasecmp(scheme, "wss") != 0)) {
+      fprintf(stderr, "Invalid stream url %s, must be ws:// or wss://\n", url);
+      if (uri_ != NULL) {
+	evhttp_uri_free(uri_);
+	uri_ = nullptr;
+      }
+      return;
+    }
+    secure_ = strcasecmp(scheme, "wss") == 0;
+
+    timeval interval{protocol_->ping_interval(), 0};
+    evtimer_add(heartbeat_timer_, &interval);
+
+    connect();
+  }
+
+  websocket_client::~websocket_client() {
+    disconnect();
+
+    if (heartbeat_timer_ != nullptr)
+      event_free(heartbeat_timer_);
+
+    if (reconnect_timer_ != nullptr)
+      event_free(reconnect_timer_);
+
+    if (uri_ != nullptr)
+      evhttp_uri_free(uri_);
+  }
+
+  void websocket_client::connect() {
+    if (uri_ == nullptr || bev_ != nullptr) {
+      return;
+    }
+
+    const char *host = evhttp_uri_get_host(uri_);
+    int port = evhttp_uri_get_port(uri_);
+    if (port == -1) {
+      port = secure_ ? 443 : 80;
+    }
+
+    if (secure_) {
+      if (tls_ == nullptr) {
+	fprintf(stderr, "No TLS context for %s\n", host);
+	return;
+      }
+      SSL *ssl = tls_->new_ssl(host);
+      if (ssl == NULL) {
+	fprintf(stderr, "Cannot create the SSL object for %s\n", host);
+	reconnect();
+	return;
+      }
+      // The bufferevent frees the SSL object.
+      bev_ = bufferevent_openssl_socket_new(base_, -1, ssl,
+					    BUFFEREVENT_SSL_CONNECTING,
+					    BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+      if (bev_ == NULL) {
+	SSL_free(ssl);
+      } else {
+	bufferevent_openssl_set_allow_dirty_shutdown(bev_, 1);
+      }
+    } else {
+      bev_ = bufferevent_socket_new(base_, -1, BEV_OPT_CLOSE_ON_FREE | BEV_OPT_DEFER_CALLBACKS);
+    }
+
+    if (bev_ == NULL) {
+      fprintf(stderr, "Cannot create the bufferevent for %s\n", host);
+      reconnect();
+      return;
+    }
+
+    bufferevent_setcb(bev_, &websocket_client::libevent_read, NULL,
+		      &websocket_client::libevent_event, this);
+    bufferevent_enable(bev_, EV_READ | EV_WRITE);
+
+    state_ = connecting;
+    connect_time_ = clock::now();
+
+    // Same as the connection pool: connect to the cached address, or let libevent
+    // resolve the host without blocking.
+    const char *address = dns_ != nullptr ? dns_->lookup(host, metrics_) : nullptr;
+    evdns_base *dns_base = address == nullptr && dns_ != nullptr ? dns_->get_dns_base() : NULL;
+    if (bufferevent_socket_connect_hostname(bev_, dns_base, AF_INET,
+					    address != nullptr ? address : host, port) != 0) {
+      fprintf(stderr, "Cannot connect to %s\n", host);
+      reconnect();
+    }
+  }
+
+  void websocket_client::disconnect() {
+    if (bev_ != nullptr) {
+      bufferevent_free(bev_);
+      bev_ = nullptr;
+    }
+    state_ = disconnected;
+    in_message_ = false;
+  }
+
+  void websocket_client::reconnect() {
+    disconnect();
+
+    std::cerr << "Reconnecting to " << evhttp_uri_get_host(uri_) << " in " << backoff_ << "s\n";
+    timeval delay{backoff_, 0};
+    evtimer_add(reconnect_timer_, &delay);
+
+    backoff_ = backoff_ * 2 > max_backoff ? max_backoff : backoff_ * 2;
+  }
+
+  void websocket_client::on_event(short events) {
+    if (events & BEV_EVENT_CONNECTED) {
+      state_ = upgrading;
+      last_received_ = clock::now();
+      send_upgrade();
+      return;
+    }
+
+    if (events & BEV_EVENT_ERROR) {
+      unsigned long oslerr;
+      char error_buffer[256];
+      int printed_err = 0;
+      while ((oslerr = bufferevent_get_openssl_error(bev_))) {
+	ERR_error_string_n(oslerr, error_buffer, sizeof(error_buffer));
+	fprintf(stderr, "%s\n", error_buffer);
+	printed_err = 1;
+      }
+
+      int dns_error = bufferevent_socket_get_dns_error(bev_);
+      if (dns_error != 0) {
+	fprintf(stderr, "DNS error: %s\n", evutil_gai_strerror(dns_error));
+      } else if (!printed_err) {
+	int errcode = EVUTIL_SOCKET_ERROR();
+	fprintf(stderr, "socket error = %s (%d)\n",
+		evutil_socket_error_to_string(errcode),
+		errcode);
+      }
+    } else if (events & BEV_EVENT_EOF) {
+      fprintf(stderr, "%s closed the stream\n", evhttp_uri_get_host(uri_));
+    }
+
+    if (events & (BEV_EVENT_ERROR | BEV_EVENT_EOF)) {
+      reconnect();
+    }
+  }
+
+  void websocket_client::send_upgrade() {
+    const char *host = evhttp_uri_get_host(uri_);
+    const char *path = evhttp_uri_get_path(uri_);
+    const char *query = evhttp_uri_get_query(uri_);
+    int port = evhttp_uri_get_port(uri_);
+
+    std::string target = path != NULL && strlen(path) > 0 ? path : "/";
+    if (query != NULL) {
+      target += '?';
+      target += query;
+    }
+
+    std::string host_header = host;
+    if (port != -1) {
+      host_header += ':' + std::to_string(port);
+    }
+
+    std::string key = websocket::make_key();
+    accept_ = websocket::accept_key(key);
+
+    evbuffer_add_printf(bufferevent_get_output(bev_),
+			"GET %s HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Key: %s\r\n"
+			"Sec-WebSocket-Version: 13\r\n"
+			"\r\n",
+			target.c_str(), host_header.c_str(), key.c_str());
+  }
+
+  void websocket_client::on_read() {
+    last_received_ = clock::now();
+
+    bool ok = true;
+    if (state_ == upgrading) {
+      ok = read_upgrade();
+    }
+    if (ok && state_ == open) {
+      ok = read_frames();
+    }
+
+    if (!ok) {
+      reconnect();
+    }
+  }
+
+  bool websocket_client::read_upgrade() {
+    evbuffer *input = bufferevent_get_input(bev_);
+
+    evbuffer_ptr end = evbuffer_search(input, "\r\n\r\n", 4, NULL);
+    if (end.pos == -1) {
+      if (evbuffer_get_length(input) > max_handshake_size) {
+	fprintf(stderr, "Invalid answer to the WebSocket upgrade\n");
+	return false;
+      }
+      return true;
+    }
+
+    int status = 0;
+    char *line = evbuffer_readln(input, NULL, EVBUFFER_EOL_CRLF_STRICT);
+    if (line != NULL) {
+      sscanf(line, "HTTP/%*d.%*d %d", &status);
+      free(line);
+    }
+
+    bool upgraded = false;
+    bool accepted = false;
+    size_t length;
+    while ((line = evbuffer_readln(input, &length, EVBUFFER_EOL_CRLF_STRICT)) != NULL) {
+      if (length == 0) {
+	// End of the headers, the frames follow.
+	free(line);
+	break;
+      }
+
+      char *value = strchr(line, ':');
+      if (value != NULL) {
+	*value++ = '\0';
+	while (*value == ' ' || *value == '\t') {
+	  ++value;
+	}
+	char *last = value + strlen(value);
+	while (last > value && (last[-1] == ' ' || last[-1] == '\t')) {
+	  *--last = '\0';
+	}
+
+	if (evutil_ascii_strcasecmp(line, "Upgrade") == 0) {
+	  upgraded = evutil_ascii_strcasecmp(value, "websocket") == 0;
+	} else if (evutil_ascii_strcasecmp(line, "Sec-WebSocket-Accept") == 0) {
+	  accepted = accept_ == value;
+	}
+      }
+      free(line);
+    }
+
+    if (status != 101 || !upgraded || !accepted) {
+      fprintf(stderr, "WebSocket upgrade refused by %s (status %d)\n", evhttp_uri_get_host(uri_), status);
+      return false;
+    }
+
+    state_ = open;
+    backoff_ = min_backoff;
+    std::cerr << "Streaming " << symbols_.size() << " symbols from " << evhttp_uri_get_host(uri_) << "\n";
+
+    // (Re)subscribe to the tickers of our symbols.
+    std::vector<std::string> messages;
+    protocol_->subscribe_messages(symbols_, messages);
+    for (const std::string& message: messages) {
+      if (!send_frame(websocket::text, message.data(), message.size())) {
+	return false;
+      }
+    }
+    return true;
+  }
+
+  void websocket_client::set_symbols(symbol_map symbols) {
+    symbol_map added, removed;
+    for (const auto& entry: symbols) {
+      if (symbols_.count(entry.first) == 0)
+	added.insert(entry);
+    }
+    for (const auto& entry: symbols_) {
+      if (symbols.count(entry.first) == 0)
+	removed.insert(entry);
+    }
+    symbols_ = std::move(symbols);
+
+    // Otherwise the symbols are subscribed once connected.
+    if (state_ != open) {
+      return;
+    }
+
+    std::vector<std::string> messages;
+    protocol_->unsubscribe_messages(removed, messages);
+    protocol_->subscribe_messages(added, messages);
+    for (const std::string& message: messages) {
+      // The new connection subscribes to all the symbols.
+      if (!send_frame(websocket::text, message.data(), message.size())) {
+	reconnect();
+	return;
+      }
+    }
+    std::cerr << "Streaming " << symbols_.size() << " symbols from " << evhttp_uri_get_host(uri_)
+	      << " (" << added.size() << " added, " << removed.size() << " removed)\n";
+  }
+
+  bool websocket_client::read_frames() {
+    evbuffer *input = bufferevent_get_input(bev_);
+
+    websocket::frame_header header;
+    int r;
+    while ((r = websocket::read_header(input, header)) == 1) {
+      // A server must not mask its frames (section 5.1).
+      if (header.masked || header.length > max_message_size) {
+	fprintf(stderr, "Invalid frame from %s\n", evhttp_uri_get_host(uri_));
+	return false;
+      }
+
+      // Wait for the whole frame.
+      if (evbuffer_get_length(input) < header.size + header.length) {
+	return true;
+      }
+      evbuffer_drain(input, header.size);
+      size_t length = static_cast<size_t>(header.length);
+
+      if (websocket::is_control(header.opcode)) {
+	char payload[125];
+	evbuffer_remove(input, payload, length);
+
+	switch (header.opcode) {
+	case websocket::ping:
+	  if (!send_frame(websocket::pong, payload, length)) {
+	    return false;
+	  }
+	  break;
+	case websocket::pong:
+	  break;
+	case websocket::close:
+	  // We will not send anything else on this connection, no need to answer.
+	  fprintf(stderr, "%s closed the stream\n", evhttp_uri_get_host(uri_));
+	  return false;
+	default:
+	  return false;
+	}
+	continue;
+      }
+
+      if (header.opcode == websocket::continuation) {
+	if (!in_message_) {
+	  return false;
+	}
+      } else {
+	if (in_message_ || (header.opcode != websocket::text && header.opcode != websocket::binary)) {
+	  return false;
+	}
+	in_message_ = true;
+	message_opcode_ = header.opcode;
+	message_.clear();
+      }
+
+      size_t offset = message_.size();
+      if (offset + length > max_message_size) {
+	return false;
+      }
+      message_.resize(offset + length);
+      evbuffer_remove(input, message_.data() + offset, length);
+
+      if (header.fin) {
+	in_message_ = false;
+	// The exchanges we know only send text messages.
+	if (message_opcode_ == websocket::text) {
+	  on_message();
+	}
+      }
+    }
+
+    return r == 0;
+  }
+
+  void websocket_client::on_message() {
+    int64_t received = receive_time();
+
+    // Terminated for the in situ parser.
+    message_.push_back('\0');
+
+    tickers_.clear();
+    if (protocol_->tickers_from_message(message_.data(), symbols_, tickers_) != 0) {
+      fprintf(stderr, "Cannot convert the message to tickers\n");
+    }
+
+    int64_t converted = receive_time();
+    if (metrics_ != nullptr) {
+      metrics_->record_parse(received, protocol_->parsed_at(), converted);
+    }
+
+    for (ticker& t: tickers_) {
+      t.received = received;
+      t.queued = converted;
+      out_queue_->push(lane_, t);
+    }
+  }
+
+  bool websocket_client::send_frame(int opcode, const char *payload, size_t length) {
+    if (bev_ == nullptr) {
+      return false;
+    }
+    if (websocket::write_frame(bufferevent_get_output(bev_), opcode, payload, length, true) != 0) {
+      fprintf(stderr, "Cannot send a frame of %zu bytes to %s\n", length, evhttp_uri_get_host(uri_));
+      return false;
+    }
+    return true;
+  }
+
+  void websocket_client::heartbeat() {
+    if (state_ == disconnected) {
+      return;
+    }
+
+    clock::time_point now = clock::now();
+    std::chrono::seconds limit(2 * protocol_->ping_interval());
+
+    if (state_ != open) {
+      if (now - connect_time_ > limit) {
+	fprintf(stderr, "Timeout connecting to %s\n", evhttp_uri_get_host(uri_));
+	reconnect();
+      }
+      return;
+    }
+
+    if (now - last_received_ > limit) {
+      fprintf(stderr, "Nothing received from %s for %lds\n", evhttp_uri_get_host(uri_),
+	      static_cast<long>(limit.count()));
+      reconnect();
+      return;
+    }
+
+    std::string ping = protocol_->ping_message();
+    bool sent = ping.empty() ? send_frame(websocket::ping, nullptr, 0) :
+      send_frame(websocket::text, ping.data(), ping.size());
+    if (!sent) {
+      reconnect();
+    }
+  }
+
+}
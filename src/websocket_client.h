@@ -0,0 +1,157 @@
+#pragma once
+
+#include <event2/event.h>
+#include <event2/bufferevent.h>
+#include <event2/http.h>
+#include "dns_cache.h"
+#include "market_stream.h"
+#include "metrics.h"
+#include "ticker.h"
+#include "ticker_channel.h"
+#include "tls_context.h"
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace cryptom {
+
+  /*
+    Streaming client of the market data feed of an exchange, over WebSocket (ws:// or
+    wss://). The tickers are pushed to the channel as the exchange sends them, instead
+    of every few seconds as with scheduled_client.
+
+    The connection is checked with pings: when nothing comes from the server for two
+    intervals, or when it closes, the client reconnects with an exponential backoff and
+    subscribes again to the symbols.
+
+    The out_queue can be NULL when the protocol gives no ticker (e.g. binance_depth_stream).
+    The resolutions of the host and the parse of the messages are timed in metrics, if
+    not NULL.
+  */
+  class websocket_client {
+
+  public:
+    websocket_client(event_base *base,
+		     const char *url,
+		     tls_context *tls,
+		     dns_cache *dns,
+		     std::unique_ptr<stream_protocol> protocol,
+		     symbol_map symbols,
+		     ticker_channel *out_queue,
+		     size_t lane,
+		     stage_histograms *metrics = nullptr);
+    ~websocket_client();
+
+    // no copy or assignement
+    websocket_client(const websocket_client&) = delete;
+    websocket_client& operator=(const websocket_client&) = delete;
+
+    /**
+       Stream these symbols instead. On an open connection only the symbols added and
+       removed are subscribed and unsubscribed, without reconnecting.
+     */
+    void set_symbols(symbol_map symbols);
+
+  private:
+
+    enum state {
+      disconnected,
+      // TCP connection and TLS handshake.
+      connecting,
+      // Waiting for the answer to the upgrade request.
+      upgrading,
+      open
+    };
+
+    typedef std::chrono::steady_clock clock;
+
+    // Largest message we accept, anything bigger is a broken server.
+    static const size_t max_message_size = 1 << 20;
+    // Largest answer to the upgrade request.
+    static const size_t max_handshake_size = 8192;
+    // Bounds of the delay before a reconnection, in seconds.
+    static const int min_backoff = 1;
+    static const int max_backoff = 60;
+
+    // pointer to the event loop of libevent.
+    event_base *base_;
+
+    // Data structure to extract host/port/scheme... and so on.
+    evhttp_uri *uri_;
+    bool secure_;
+
+    // Not owned by this object. dns_ can be NULL.
+    tls_context *tls_;
+    dns_cache *dns_;
+
+    std::unique_ptr<stream_protocol> protocol_;
+
+    // Symbols to subscribe to, with their interned id.
+    symbol_map symbols_;
+
+    // Way to send the results. Not owned by this object
+    ticker_channel *out_queue_;
+    // Lane of the channel of our event loop.
+    size_t lane_;
+
+    // Written by the thread of our event loop only. Not owned by this object
+    stage_histograms *metrics_;
+
+    // Connection to the server, NULL when disconnected.
+    bufferevent *bev_;
+    state state_;
+
+    // Sec-WebSocket-Accept we expect from the server.
+    std::string accept_;
+
+    // Message being received, possibly in several frames. Kept to reuse the memory.
+    std::vector<char> message_;
+    int message_opcode_;
+    bool in_message_;
+
+    // Tickers of the last message. Kept to reuse the memory.
+    std::vector<ticker> tickers_;
+
+    // Sends the pings and checks that the server is alive.
+    event *heartbeat_timer_;
+    clock::time_point last_received_;
+    clock::time_point connect_time_;
+
+    event *reconnect_timer_;
+    int backoff_;
+
+    void connect();
+    void disconnect();
+    // Close the connection and connect again after the backoff.
+    void reconnect();
+
+    void send_upgrade();
+    // Return false if the connection must be closed.
+    bool read_upgrade();
+    bool read_frames();
+    void on_message();
+    // Return false if the frame could not be queued, the connection must be closed.
+    bool send_frame(int opcode, const char *payload, size_t length);
+
+    static void libevent_read(bufferevent *bev, void *ctx) {
+      static_cast<websocket_client*>(ctx)->on_read();
+    }
+    void on_read();
+
+    static void libevent_event(bufferevent *bev, short events, void *ctx) {
+      static_cast<websocket_client*>(ctx)->on_event(events);
+    }
+    void on_event(short events);
+
+    static void libevent_heartbeat(evutil_socket_t fd, short what, void *arg) {
+      static_cast<websocket_client*>(arg)->heartbeat();
+    }
+    void heartbeat();
+
+    static void libevent_reconnect(evutil_socket_t fd, short what, void *arg) {
+      static_cast<websocket_client*>(arg)->connect();
+    }
+  };
+
+}
@@ -0,0 +1,529 @@
+/*
+  Mock of the REST ticker endpoints of binance and kucoin, to measure the clients
+  without network. Serves both exchanges on the loopback, over http or https.
+
+    mock_exchange [-p port] [-t ca.pem] [-n markets] [-l latency_ms] [-j jitter_ms]
+                  [-e error_percent] [-w throttle_percent] [-b binance.json] [-k kucoin.json]
+
+  binance: /api/v1/ticker/24hr and /api/v3/ticker/24hr, ?symbol=COIN0BTC for a market,
+           /api/v1/depth and /api/v3/depth, ?symbol=COIN0BTC&limit=100 for the book.
+  kucoin:  /v1/open/tick, ?symbol=COIN0-BTC for a market.
+  Without a symbol, the tickers of all the markets. The markets are COIN0 to COIN<n-1>
+  against BTC, made from a ticker recorded on each exchange: -n sets the size of the
+  payloads. -b and -k serve a recorded response of all the markets instead.
+
+  -t serves https with a certificate of localhost signed by a new CA, whose certificate
+  is written to ca.pem for the clients to trust (tls_context's ca_file).
+  The lastUpdateId of the depth snapshots is the time in milliseconds, like the update
+  ids of the depth streams of ws_standin, so that the diffs follow the snapshots.
+
+  -l and -j delay the responses, -e answers 500 and -w 429 with a Retry-After to some
+  requests.
+*/
+#include "rapidjson/document.h"
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/bufferevent_ssl.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+#include <openssl/ec.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/x509v3.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+
+namespace {
+
+  struct options {
+    int port = 8080;
+    const char *ca_file = nullptr;
+    int markets = 100;
+    int latency_ms = 0;
+    int jitter_ms = 0;
+    int error_percent = 0;
+    int throttle_percent = 0;
+    const char *binance_file = nullptr;
+    const char *kucoin_file = nullptr;
+  };
+
+  options opts;
+  event_base *base;
+
+  struct stats {
+    unsigned long requests = 0;
+    unsigned long errors = 0;
+    unsigned long throttled = 0;
+    // Unknown paths and symbols.
+    unsigned long not_found = 0;
+    unsigned long bytes = 0;
+  };
+
+  stats counters;
+
+  // Responses of an exchange: the tickers of all the markets, and of each market.
+  struct payloads {
+    std::string all;
+    std::map<std::string, std::string> markets;
+  };
+
+  payloads binance;
+  payloads kucoin;
+
+  // Last price of the generated markets, by binance symbol.
+  std::map<std::string, double> prices;
+
+  long long now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  /*
+    Ticker of ETHBTC recorded on binance, and of ETH-BTC on kucoin, with the symbol
+    and the prices to fill.
+  */
+  std::string binance_ticker(const std::string& symbol, double price) {
+    char ticker[1024];
+    snprintf(ticker, sizeof(ticker),
+	     "{\"symbol\":\"%s\",\"priceChange\":\"-0.00018300\",\"priceChangePercent\":\"-0.418\","
+	     "\"weightedAvgPrice\":\"0.04366385\",\"prevClosePrice\":\"0.04378200\",\"lastPrice\":\"%.8f\","
+	     "\"lastQty\":\"0.16200000\",\"bidPrice\":\"%.8f\",\"bidQty\":\"12.31100000\","
+	     "\"askPrice\":\"%.8f\",\"askQty\":\"0.39200000\",\"openPrice\":\"0.04378200\","
+	     "\"highPrice\":\"%.8f\",\"lowPrice\":\"%.8f\",\"volume\":\"75893.39800000\","
+	     "\"quoteVolume\":\"3313.81268157\",\"openTime\":%lld,\"closeTime\":%lld,"
+	     "\"firstId\":62283402,\"lastId\":62389135,\"count\":105734}",
+	     symbol.c_str(), price, price * 0.9999, price * 1.0001, price * 1.02, price * 0.98,
+	     now_ms() - 86400000, now_ms());
+    return ticker;
+  }
+
+  std::string kucoin_ticker(const std::string& symbol, const std::string& coin, double price) {
+    char ticker[1024];
+    snprintf(ticker, sizeof(ticker),
+	     "{\"coinType\":\"%s\",\"trading\":true,\"symbol\":\"%s\",\"lastDealPrice\":%.8f,"
+	     "\"buy\":%.8f,\"sell\":%.8f,\"change\":-0.00012,\"coinTypePair\":\"BTC\",\"sort\":100,"
+	     "\"feeRate\":0.001,\"volValue\":45.62117932,\"high\":%.8f,\"datetime\":%lld,"
+	     "\"vol\":1042.3325,\"low\":%.8f,\"changeRate\":-0.0027}",
+	     coin.c_str(), symbol.c_str(), price, price * 0.9999, price * 1.0001, price * 1.02,
+	     now_ms(), price * 0.98);
+    return ticker;
+  }
+
+  // {"lastUpdateId": ..., "bids": [["0.0024", "10"], ...], "asks": [...]}
+  std::string depth_snapshot(double price, int limit) {
+    std::string depth = "{\"lastUpdateId\":" + std::to_string(now_ms());
+    char level[64];
+    for (int side = 0; side < 2; side++) {
+      depth += side == 0 ? ",\"bids\":[" : "],\"asks\":[";
+      for (int i = 0; i < limit; i++) {
+	double step = price * 0.0001 * (i + 1);
+	snprintf(level, sizeof(level), "%s[\"%.8f\",\"%.8f\"]", i > 0 ? "," : "",
+		 side == 0 ? price - step : price + step, 1.0 + (rand() % 1000) / 100.0);
+	depth += level;
+      }
+    }
+    return depth + "]}";
+  }
+
+  std::string kucoin_response(const std::string& data) {
+    return "{\"success\":true,\"code\":\"OK\",\"msg\":\"Operation succeeded.\",\"timestamp\":" +
+      std::to_string(now_ms()) + ",\"data\":" + data + "}";
+  }
+
+  void generate_payloads() {
+    binance.all = "[";
+    std::string kucoin_all = "[";
+    for (int i = 0; i < opts.markets; i++) {
+      std::string coin = "COIN" + std::to_string(i);
+      double price = 0.001 * (i + 1);
+
+      prices[coin + "BTC"] = price;
+      std::string ticker = binance_ticker(coin + "BTC", price);
+      binance.markets[coin + "BTC"] = ticker;
+      binance.all += (i > 0 ? "," : "") + ticker;
+
+      ticker = kucoin_ticker(coin + "-BTC", coin, price);
+      kucoin.markets[coin + "-BTC"] = kucoin_response(ticker);
+      kucoin_all += (i > 0 ? "," : "") + ticker;
+    }
+    binance.all += "]";
+    kucoin.all = kucoin_response(kucoin_all + "]");
+  }
+
+  /*
+    Load a recorded response of all the markets, and split it by market. Will return 0
+    if ok.
+  */
+  int load_payloads(const char *path, bool is_kucoin, payloads& out) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+      perror(path);
+      return -1;
+    }
+    std::string text;
+    char buffer[65536];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+      text.append(buffer, n);
+    }
+    fclose(file);
+
+    rapidjson::Document json;
+    json.Parse(text.c_str());
+    const rapidjson::Value *tickers = &json;
+    if (!json.HasParseError() && is_kucoin) {
+      tickers = json.IsObject() && json.HasMember("data") ? &json["data"] : nullptr;
+    }
+    if (json.HasParseError() || tickers == nullptr || !tickers->IsArray()) {
+      fprintf(stderr, "%s is not a response of all the markets\n", path);
+      return -1;
+    }
+
+    out.all = text;
+    out.markets.clear();
+    for (const rapidjson::Value& ticker: tickers->GetArray()) {
+      if (!ticker.IsObject() || !ticker.HasMember("symbol") || !ticker["symbol"].IsString()) {
+	continue;
+      }
+      rapidjson::StringBuffer object;
+      rapidjson::Writer<rapidjson::StringBuffer> writer(object);
+      ticker.Accept(writer);
+      out.markets[ticker["symbol"].GetString()] =
+	is_kucoin ? kucoin_response(object.GetString()) : object.GetString();
+    }
+    fprintf(stderr, "Loaded %zu markets from %s\n", out.markets.size(), path);
+    return 0;
+  }
+
+  struct reply {
+    evhttp_request *req;
+    int code;
+    const char *reason;
+    const std::string *body;
+    // Body of the replies made for the request, when body is NULL.
+    std::string made{};
+  };
+
+  void send_reply(const reply& r) {
+    evkeyvalq *headers = evhttp_request_get_output_headers(r.req);
+    evhttp_add_header(headers, "Content-Type", "application/json");
+    if (r.code == 429) {
+      evhttp_add_header(headers, "Retry-After", "1");
+    }
+
+    // The payloads live until the end, no need to copy them. The replies made for the
+    // request are gone once sent.
+    evbuffer *body = evbuffer_new();
+    if (r.body != nullptr) {
+      evbuffer_add_reference(body, r.body->data(), r.body->size(), NULL, NULL);
+      counters.bytes += r.body->size();
+    } else {
+      evbuffer_add(body, r.made.data(), r.made.size());
+      counters.bytes += r.made.size();
+    }
+    evhttp_send_reply(r.req, r.code, r.reason, body);
+    evbuffer_free(body);
+  }
+
+  // Delayed replies of each connection. libevent frees the requests of a connection
+  // when it is closed, the replies are then dropped.
+  std::map<evhttp_connection*, std::set<reply*>> delayed;
+
+  void on_close(evhttp_connection *evcon, void *) {
+    auto it = delayed.find(evcon);
+    if (it == delayed.end()) {
+      return;
+    }
+    for (reply *r: it->second) {
+      r->req = nullptr;
+    }
+    delayed.erase(it);
+  }
+
+  void on_delay(evutil_socket_t, short, void *arg) {
+    reply *r = static_cast<reply*>(arg);
+    if (r->req != nullptr) {
+      evhttp_connection *evcon = evhttp_request_get_connection(r->req);
+      delayed[evcon].erase(r);
+      send_reply(*r);
+    }
+    delete r;
+  }
+
+  const std::string not_found_body = "{\"code\":-1121,\"msg\":\"Invalid symbol.\"}";
+  const std::string error_body = "{\"code\":-1000,\"msg\":\"An unknown error occured while processing the request.\"}";
+  const std::string throttle_body = "{\"code\":-1003,\"msg\":\"Too many requests.\"}";
+
+  void on_request(evhttp_request *req, void *) {
+    ++counters.requests;
+
+    // Like the exchanges, send the end of the large payloads without waiting for the ACK
+    // of the client (Nagle and delayed ACKs add 40ms).
+    bufferevent *bev = evhttp_connection_get_bufferevent(evhttp_request_get_connection(req));
+    int one = 1;
+    setsockopt(bufferevent_getfd(bev), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    const evhttp_uri *uri = evhttp_request_get_evhttp_uri(req);
+    const char *path = evhttp_uri_get_path(uri);
+    const char *query = evhttp_uri_get_query(uri);
+
+    const payloads *exchange = nullptr;
+    bool depth = false;
+    if (path != NULL && (strcmp(path, "/api/v1/depth") == 0 || strcmp(path, "/api/v3/depth") == 0)) {
+      exchange = &binance;
+      depth = true;
+    } else if (path != NULL && (strcmp(path, "/api/v1/ticker/24hr") == 0 || strcmp(path, "/api/v3/ticker/24hr") == 0)) {
+      exchange = &binance;
+    } else if (path != NULL && strcmp(path, "/v1/open/tick") == 0) {
+      exchange = &kucoin;
+    }
+
+    reply r{req, 200, "OK", nullptr};
+    if (exchange == nullptr) {
+      ++counters.not_found;
+      r = reply{req, 404, "Not Found", &not_found_body};
+    } else if (opts.error_percent > 0 && rand() % 100 < opts.error_percent) {
+      ++counters.errors;
+      r = reply{req, 500, "Internal Server Error", &error_body};
+    } else if (opts.throttle_percent > 0 && rand() % 100 < opts.throttle_percent) {
+      ++counters.throttled;
+      r = reply{req, 429, "Too Many Requests", &throttle_body};
+    } else if (query == NULL && depth) {
+      ++counters.not_found;
+      r = reply{req, 400, "Bad Request", &not_found_body};
+    } else if (query == NULL) {
+      r.body = &exchange->all;
+    } else {
+      evkeyvalq parameters;
+      evhttp_parse_query_str(query, &parameters);
+      const char *symbol = evhttp_find_header(&parameters, "symbol");
+      auto it = symbol != NULL ? exchange->markets.find(symbol) : exchange->markets.end();
+      if (it != exchange->markets.end() && depth) {
+	const char *limit = evhttp_find_header(&parameters, "limit");
+	auto price = prices.find(symbol);
+	r.made = depth_snapshot(price != prices.end() ? price->second : 0.01,
+				std::min(limit != NULL ? atoi(limit) : 100, 5000));
+      } else if (it != exchange->markets.end()) {
+	r.body = &it->second;
+      } else {
+	++counters.not_found;
+	r = reply{req, 400, "Bad Request", &not_found_body};
+      }
+      evhttp_clear_headers(&parameters);
+    }
+
+    int delay_ms = opts.latency_ms + (opts.jitter_ms > 0 ? rand() % (opts.jitter_ms + 1) : 0);
+    if (delay_ms == 0) {
+      send_reply(r);
+      return;
+    }
+    timeval delay = {delay_ms / 1000, (delay_ms % 1000) * 1000};
+    reply *later = new reply(r);
+    evhttp_connection *evcon = evhttp_request_get_connection(req);
+    evhttp_connection_set_closecb(evcon, on_close, NULL);
+    delayed[evcon].insert(later);
+    event_base_once(base, -1, EV_TIMEOUT, on_delay, later, &delay);
+  }
+
+  /*
+    Certificates of the https mode: a CA, written to the given file, and the
+    certificate of localhost it signs.
+  */
+  EVP_PKEY* new_key() {
+    EVP_PKEY *key = NULL;
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    if (ctx == NULL ||
+	EVP_PKEY_keygen_init(ctx) != 1 ||
+	EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) != 1 ||
+	EVP_PKEY_keygen(ctx, &key) != 1) {
+      key = NULL;
+    }
+    EVP_PKEY_CTX_free(ctx);
+    return key;
+  }
+
+  X509* new_certificate(EVP_PKEY *key, const char *name, long serial, X509 *issuer, EVP_PKEY *issuer_key) {
+    X509 *cert = X509_new();
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), serial);
+    X509_gmtime_adj(X509_getm_notBefore(cert), -3600);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 30L * 24 * 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC,
+			       reinterpret_cast<const unsigned char*>(name), -1, -1, 0);
+    X509_set_issuer_name(cert, X509_get_subject_name(issuer != NULL ? issuer : cert));
+
+    X509V3_CTX ctx;
+    X509V3_set_ctx(&ctx, issuer != NULL ? issuer : cert, cert, NULL, NULL, 0);
+    const char *extensions[][2] = {
+      {"basicConstraints", issuer == NULL ? "critical,CA:TRUE" : "CA:FALSE"},
+      {"subjectAltName", issuer == NULL ? NULL : "DNS:localhost"},
+    };
+    for (const auto& extension: extensions) {
+      if (extension[1] == NULL) {
+	continue;
+      }
+      X509_EXTENSION *ext = X509V3_EXT_conf(NULL, &ctx, extension[0], extension[1]);
+      X509_add_ext(cert, ext, -1);
+      X509_EXTENSION_free(ext);
+    }
+
+    X509_sign(cert, issuer_key != NULL ? issuer_key : key, EVP_sha256());
+    return cert;
+  }
+
+  SSL_CTX* new_server_context(const char *ca_file) {
+    EVP_PKEY *ca_key = new_key();
+    EVP_PKEY *key = new_key();
+    if (ca_key == NULL || key == NULL) {
+      ERR_print_errors_fp(stderr);
+      return NULL;
+    }
+    X509 *ca = new_certificate(ca_key, "cryptom mock exchange CA", 1, NULL, NULL);
+    X509 *cert = new_certificate(key, "localhost", 2, ca, ca_key);
+
+    FILE *file = fopen(ca_file, "w");
+    if (file == NULL) {
+      perror(ca_file);
+      return NULL;
+    }
+    PEM_write_X509(file, ca);
+    fclose(file);
+
+    SSL_CTX *ctx = SSL_CTX_new(SSLv23_server_method());
+    if (ctx == NULL ||
+	SSL_CTX_use_certificate(ctx, cert) != 1 ||
+	SSL_CTX_use_PrivateKey(ctx, key) != 1) {
+      ERR_print_errors_fp(stderr);
+      return NULL;
+    }
+
+    X509_free(cert);
+    X509_free(ca);
+    EVP_PKEY_free(key);
+    EVP_PKEY_free(ca_key);
+    return ctx;
+  }
+
+  bufferevent* on_connection(event_base *base, void *arg) {
+    SSL_CTX *ctx = static_cast<SSL_CTX*>(arg);
+    return bufferevent_openssl_socket_new(base, -1, SSL_new(ctx), BUFFEREVENT_SSL_ACCEPTING,
+					  BEV_OPT_CLOSE_ON_FREE);
+  }
+
+  void on_signal(evutil_socket_t, short, void *) {
+    event_base_loopexit(base, NULL);
+  }
+
+}
+
+int main(int argc, char **argv) {
+  int c;
+  while ((c = getopt(argc, argv, "p:t:n:l:j:e:w:b:k:")) != -1) {
+    switch (c) {
+    case 'p':
+      opts.port = atoi(optarg);
+      break;
+    case 't':
+      opts.ca_file = optarg;
+      break;
+    case 'n':
+      opts.markets = atoi(optarg);
+      break;
+    case 'l':
+      opts.latency_ms = atoi(optarg);
+      break;
+    case 'j':
+      opts.jitter_ms = atoi(optarg);
+      break;
+    case 'e':
+      opts.error_percent = atoi(optarg);
+      break;
+    case 'w':
+      opts.throttle_percent = atoi(optarg);
+      break;
+    case 'b':
+      opts.binance_file = optarg;
+      break;
+    case 'k':
+      opts.kucoin_file = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-p port] [-t ca.pem] [-n markets] [-l latency_ms] [-j jitter_ms]"
+	      " [-e error_percent] [-w throttle_percent] [-b binance.json] [-k kucoin.json]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  generate_payloads();
+  if ((opts.binance_file != nullptr && load_payloads(opts.binance_file, false, binance) != 0) ||
+      (opts.kucoin_file != nullptr && load_payloads(opts.kucoin_file, true, kucoin) != 0)) {
+    return 1;
+  }
+
+  base = event_base_new();
+  if (base == NULL) {
+    perror("event_base_new()");
+    return 1;
+  }
+
+  evhttp *http = evhttp_new(base);
+  if (http == NULL) {
+    perror("evhttp_new()");
+    return 1;
+  }
+  evhttp_set_gencb(http, on_request, NULL);
+
+  SSL_CTX *ssl_ctx = NULL;
+  if (opts.ca_file != nullptr) {
+    ssl_ctx = new_server_context(opts.ca_file);
+    if (ssl_ctx == NULL) {
+      return 1;
+    }
+    evhttp_set_bevcb(http, on_connection, ssl_ctx);
+  }
+
+  if (evhttp_bind_socket(http, "127.0.0.1", opts.port) != 0) {
+    perror("evhttp_bind_socket()");
+    return 1;
+  }
+
+  event *sigint = evsignal_new(base, SIGINT, on_signal, NULL);
+  event *sigterm = evsignal_new(base, SIGTERM, on_signal, NULL);
+  event_add(sigint, NULL);
+  event_add(sigterm, NULL);
+
+  fprintf(stderr, "Mock exchange on %s://localhost:%d, %d markets (%zu bytes for binance, %zu for kucoin)\n",
+	  ssl_ctx != NULL ? "https" : "http", opts.port, opts.markets, binance.all.size(), kucoin.all.size());
+  if (ssl_ctx != NULL) {
+    fprintf(stderr, "CA certificate in %s\n", opts.ca_file);
+  }
+  event_base_dispatch(base);
+
+  fprintf(stderr, "%lu requests, %lu errors, %lu throttled, %lu not found, %lu bytes\n",
+	  counters.requests, counters.errors, counters.throttled, counters.not_found, counters.bytes);
+
+  event_free(sigint);
+  event_free(sigterm);
+  evhttp_free(http);
+  if (ssl_ctx != NULL) {
+    SSL_CTX_free(ssl_ctx);
+  }
+  event_base_free(base);
+  return 0;
+}
@@ -0,0 +1,423 @@
+/*
+  Stand-in for the WebSocket market data feeds of binance and kucoin, to test the
+  streaming client without network. Plain ws:// on the loopback.
+
+  Accepts the subscriptions of the exchange, then sends a ticker of each subscribed
+  symbol every interval, with a random walk of the price. Answers the pings (frames,
+  and the ping messages of kucoin) and sends ping frames like binance does.
+
+    ws_standin [-p port] [-e binance|kucoin] [-i interval_ms] [-d drop_after_s] [-g gap_every]
+
+  -d closes each connection after the given time, to check that the client
+  reconnects and subscribes again.
+
+  The depth streams of binance (<symbol>@depth) send a diff of a few levels every
+  interval. The update ids are the time in milliseconds, like the lastUpdateId of the
+  snapshots of mock_exchange. -g skips one diff out of gap_every, to check that the
+  client loads the book again.
+*/
+#include "websocket.h"
+#include "rapidjson/document.h"
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <event2/util.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+
+namespace {
+
+  struct options {
+    int port = 9443;
+    bool kucoin = false;
+    int interval_ms = 500;
+    int drop_after_s = 0;
+    int gap_every = 0;
+  };
+
+  options opts;
+  event_base *base;
+
+  // Last price of each symbol, shared by the sessions.
+  std::map<std::string, double> prices;
+
+  struct session {
+    bufferevent *bev;
+    bool upgraded = false;
+    std::set<std::string> symbols;
+    // Depth streams, with the last update id sent.
+    std::map<std::string, long long> depth_symbols;
+    unsigned long diffs = 0;
+    event *tick_timer = nullptr;
+    event *ping_timer = nullptr;
+    event *drop_timer = nullptr;
+  };
+
+  void close_session(session *s) {
+    fprintf(stderr, "Closing session with %zu symbols\n", s->symbols.size());
+    event_free(s->tick_timer);
+    event_free(s->ping_timer);
+    event_free(s->drop_timer);
+    bufferevent_free(s->bev);
+    delete s;
+  }
+
+  // Return false to close the session.
+  bool send_frame(session *s, int opcode, const char *payload, size_t length) {
+    if (cryptom::websocket::write_frame(bufferevent_get_output(s->bev), opcode, payload, length, false) != 0) {
+      fprintf(stderr, "Cannot send a frame of %zu bytes\n", length);
+      return false;
+    }
+    return true;
+  }
+
+  bool send_text(session *s, const std::string& text) {
+    return send_frame(s, cryptom::websocket::text, text.data(), text.size());
+  }
+
+  long long now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  std::string ticker_message(const std::string& symbol) {
+    double& price = prices[symbol];
+    if (price == 0) {
+      price = 0.01 + (rand() % 1000) / 1000.0;
+    }
+    price *= 1 + ((rand() % 201) - 100) / 100000.0;
+
+    char message[512];
+    if (opts.kucoin) {
+      snprintf(message, sizeof(message),
+	       "{\"type\":\"message\",\"topic\":\"/market/snapshot:%s\",\"subject\":\"trade.snapshot\","
+	       "\"data\":{\"sequence\":\"%lld\",\"data\":{\"symbol\":\"%s\",\"high\":%.8f,\"low\":%.8f,"
+	       "\"vol\":%.8f,\"lastTradedPrice\":%.8f,\"datetime\":%lld}}}",
+	       symbol.c_str(), now_ms(), symbol.c_str(), price * 1.05, price * 0.95,
+	       1000.0 + rand() % 1000, price, now_ms());
+    } else {
+      snprintf(message, sizeof(message),
+	       "{\"e\":\"24hrTicker\",\"E\":%lld,\"s\":\"%s\",\"p\":\"0.00000000\",\"P\":\"0.000\","
+	       "\"c\":\"%.8f\",\"Q\":\"1.00000000\",\"h\":\"%.8f\",\"l\":\"%.8f\",\"v\":\"%.8f\","
+	       "\"q\":\"0.00000000\",\"O\":0,\"C\":0,\"F\":0,\"L\":0,\"n\":0}",
+	       now_ms(), symbol.c_str(), price, price * 1.05, price * 0.95, 1000.0 + rand() % 1000);
+    }
+    return message;
+  }
+
+  // {"e":"depthUpdate","E":...,"s":"BNBBTC","U":157,"u":160,"b":[["0.0024","10"]],"a":[...]}
+  std::string depth_message(const std::string& symbol, long long first_id, long long last_id) {
+    double& price = prices[symbol];
+    if (price == 0) {
+      price = 0.01 + (rand() % 1000) / 1000.0;
+    }
+
+    std::string message = "{\"e\":\"depthUpdate\",\"E\":" + std::to_string(now_ms()) +
+      ",\"s\":\"" + symbol + "\",\"U\":" + std::to_string(first_id) + ",\"u\":" + std::to_string(last_id);
+    char level[64];
+    for (int side = 0; side < 2; side++) {
+      message += side == 0 ? ",\"b\":[" : "],\"a\":[";
+      for (int i = 0; i < 5; i++) {
+	// Some levels are removed.
+	double step = price * 0.0001 * (1 + rand() % 20);
+	double quantity = rand() % 4 == 0 ? 0 : 1.0 + (rand() % 1000) / 100.0;
+	snprintf(level, sizeof(level), "%s[\"%.8f\",\"%.8f\"]", i > 0 ? "," : "",
+		 side == 0 ? price - step : price + step, quantity);
+	message += level;
+      }
+    }
+    return message + "]}";
+  }
+
+  void on_tick(evutil_socket_t, short, void *arg) {
+    session *s = static_cast<session*>(arg);
+    for (const std::string& symbol: s->symbols) {
+      if (!send_text(s, ticker_message(symbol))) {
+	close_session(s);
+	return;
+      }
+    }
+
+    long long now = now_ms();
+    for (auto& entry: s->depth_symbols) {
+      long long first_id = entry.second != 0 ? entry.second + 1 : now - opts.interval_ms;
+      entry.second = now;
+      if (opts.gap_every > 0 && ++s->diffs % opts.gap_every == 0) {
+	fprintf(stderr, "Skipping the depth updates %lld to %lld of %s\n", first_id, now, entry.first.c_str());
+	continue;
+      }
+      if (!send_text(s, depth_message(entry.first, first_id, now))) {
+	close_session(s);
+	return;
+      }
+    }
+  }
+
+  void on_ping(evutil_socket_t, short, void *arg) {
+    session *s = static_cast<session*>(arg);
+    if (!send_frame(s, cryptom::websocket::ping, "standin", 7)) {
+      close_session(s);
+    }
+  }
+
+  void on_drop(evutil_socket_t, short, void *arg) {
+    close_session(static_cast<session*>(arg));
+  }
+
+  // Subscriptions, unsubscriptions and pings of the client. Return false to close the
+  // session.
+  bool on_text(session *s, char *text) {
+    rapidjson::Document json;
+    json.ParseInsitu(text);
+    if (json.HasParseError() || !json.IsObject()) {
+      fprintf(stderr, "Invalid message from the client\n");
+      return true;
+    }
+
+    if (opts.kucoin) {
+      std::string id = json.HasMember("id") && json["id"].IsInt() ? std::to_string(json["id"].GetInt()) : "0";
+      const char *type = json.HasMember("type") && json["type"].IsString() ? json["type"].GetString() : "";
+      if (strcmp(type, "ping") == 0) {
+	return send_text(s, "{\"id\":\"" + id + "\",\"type\":\"pong\"}");
+      } else if ((strcmp(type, "subscribe") == 0 || strcmp(type, "unsubscribe") == 0) &&
+		 json.HasMember("topic") && json["topic"].IsString()) {
+	bool subscribe = strcmp(type, "subscribe") == 0;
+	std::string topic = json["topic"].GetString();
+	size_t colon = topic.find(':');
+	size_t start = colon == std::string::npos ? topic.size() : colon + 1;
+	while (start < topic.size()) {
+	  size_t comma = topic.find(',', start);
+	  size_t end = comma == std::string::npos ? topic.size() : comma;
+	  if (subscribe) {
+	    s->symbols.insert(topic.substr(start, end - start));
+	  } else {
+	    s->symbols.erase(topic.substr(start, end - start));
+	  }
+	  start = end + 1;
+	}
+	if (!send_text(s, "{\"id\":\"" + id + "\",\"type\":\"ack\"}")) {
+	  return false;
+	}
+      }
+    } else if (json.HasMember("method") && json["method"].IsString() &&
+	       (strcmp(json["method"].GetString(), "SUBSCRIBE") == 0 ||
+		strcmp(json["method"].GetString(), "UNSUBSCRIBE") == 0) &&
+	       json.HasMember("params") && json["params"].IsArray()) {
+      bool subscribe = strcmp(json["method"].GetString(), "SUBSCRIBE") == 0;
+      for (const auto& param: json["params"].GetArray()) {
+	if (!param.IsString()) {
+	  continue;
+	}
+	std::string stream = param.GetString();
+	std::string symbol = stream.substr(0, stream.find('@'));
+	for (char& c: symbol) {
+	  c = static_cast<char>(toupper(static_cast<unsigned char>(c)));
+	}
+	if (stream.find("@depth") != std::string::npos) {
+	  if (subscribe) {
+	    s->depth_symbols[symbol] = 0;
+	  } else {
+	    s->depth_symbols.erase(symbol);
+	  }
+	} else if (subscribe) {
+	  s->symbols.insert(symbol);
+	} else {
+	  s->symbols.erase(symbol);
+	}
+      }
+      int id = json.HasMember("id") && json["id"].IsInt() ? json["id"].GetInt() : 0;
+      if (!send_text(s, "{\"result\":null,\"id\":" + std::to_string(id) + "}")) {
+	return false;
+      }
+    }
+    fprintf(stderr, "Session subscribed to %zu symbols\n", s->symbols.size() + s->depth_symbols.size());
+    return true;
+  }
+
+  // Return false to close the session.
+  bool read_upgrade(session *s) {
+    evbuffer *input = bufferevent_get_input(s->bev);
+    evbuffer_ptr end = evbuffer_search(input, "\r\n\r\n", 4, NULL);
+    if (end.pos == -1) {
+      return true;
+    }
+
+    std::string key;
+    char *line;
+    size_t length;
+    while ((line = evbuffer_readln(input, &length, EVBUFFER_EOL_CRLF_STRICT)) != NULL) {
+      if (length == 0) {
+	free(line);
+	break;
+      }
+      if (evutil_ascii_strncasecmp(line, "Sec-WebSocket-Key:", 18) == 0) {
+	const char *value = line + 18;
+	while (*value == ' ') {
+	  ++value;
+	}
+	key = value;
+      }
+      free(line);
+    }
+
+    if (key.empty()) {
+      evbuffer_add_printf(bufferevent_get_output(s->bev),
+			  "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n");
+      return false;
+    }
+
+    evbuffer_add_printf(bufferevent_get_output(s->bev),
+			"HTTP/1.1 101 Switching Protocols\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Accept: %s\r\n"
+			"\r\n",
+			cryptom::websocket::accept_key(key).c_str());
+    s->upgraded = true;
+
+    if (opts.kucoin && !send_text(s, "{\"id\":\"standin\",\"type\":\"welcome\"}")) {
+      return false;
+    }
+
+    timeval tick{opts.interval_ms / 1000, (opts.interval_ms % 1000) * 1000};
+    event_add(s->tick_timer, &tick);
+    timeval ping{10, 0};
+    event_add(s->ping_timer, &ping);
+    if (opts.drop_after_s > 0) {
+      timeval drop{opts.drop_after_s, 0};
+      event_add(s->drop_timer, &drop);
+    }
+    return true;
+  }
+
+  bool read_frames(session *s) {
+    evbuffer *input = bufferevent_get_input(s->bev);
+    cryptom::websocket::frame_header header;
+    int r;
+    while ((r = cryptom::websocket::read_header(input, header)) == 1) {
+      // The frames of a client must be masked. We do not bother with fragmented
+      // messages, the client does not send any.
+      if (!header.masked || !header.fin || header.length > 65536) {
+	return false;
+      }
+      if (evbuffer_get_length(input) < header.size + header.length) {
+	return true;
+      }
+      evbuffer_drain(input, header.size);
+
+      std::string payload(header.length, '\0');
+      evbuffer_remove(input, &payload[0], header.length);
+      cryptom::websocket::unmask(&payload[0], payload.size(), header.mask);
+
+      switch (header.opcode) {
+      case cryptom::websocket::text:
+	if (!on_text(s, &payload[0])) {
+	  return false;
+	}
+	break;
+      case cryptom::websocket::ping:
+	if (!send_frame(s, cryptom::websocket::pong, payload.data(), payload.size())) {
+	  return false;
+	}
+	break;
+      case cryptom::websocket::close:
+	return false;
+      default:
+	break;
+      }
+    }
+    return r == 0;
+  }
+
+  void on_read(bufferevent *bev, void *arg) {
+    session *s = static_cast<session*>(arg);
+    bool ok = s->upgraded || read_upgrade(s);
+    if (ok && s->upgraded) {
+      ok = read_frames(s);
+    }
+    if (!ok) {
+      close_session(s);
+    }
+  }
+
+  void on_event(bufferevent *bev, short events, void *arg) {
+    if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+      close_session(static_cast<session*>(arg));
+    }
+  }
+
+  void on_accept(evconnlistener *listener, evutil_socket_t fd, sockaddr *address, int length, void *arg) {
+    session *s = new session;
+    s->bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+    s->tick_timer = event_new(base, -1, EV_PERSIST, on_tick, s);
+    s->ping_timer = event_new(base, -1, EV_PERSIST, on_ping, s);
+    s->drop_timer = evtimer_new(base, on_drop, s);
+    bufferevent_setcb(s->bev, on_read, NULL, on_event, s);
+    bufferevent_enable(s->bev, EV_READ | EV_WRITE);
+    fprintf(stderr, "New session\n");
+  }
+
+}
+
+int main(int argc, char **argv) {
+  int c;
+  while ((c = getopt(argc, argv, "p:e:i:d:g:")) != -1) {
+    switch (c) {
+    case 'p':
+      opts.port = atoi(optarg);
+      break;
+    case 'e':
+      opts.kucoin = strcmp(optarg, "kucoin") == 0;
+      break;
+    case 'i':
+      opts.interval_ms = atoi(optarg);
+      break;
+    case 'd':
+      opts.drop_after_s = atoi(optarg);
+      break;
+    case 'g':
+      opts.gap_every = atoi(optarg);
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-p port] [-e binance|kucoin] [-i interval_ms] [-d drop_after_s] [-g gap_every]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  base = event_base_new();
+  if (base == NULL) {
+    perror("event_base_new()");
+    return 1;
+  }
+
+  sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(opts.port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  evconnlistener *listener = evconnlistener_new_bind(base, on_accept, NULL,
+						     LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1,
+						     reinterpret_cast<sockaddr*>(&address), sizeof(address));
+  if (listener == NULL) {
+    perror("evconnlistener_new_bind()");
+    return 1;
+  }
+
+  fprintf(stderr, "Stand-in %s feed on ws://127.0.0.1:%d/ws\n", opts.kucoin ? "kucoin" : "binance", opts.port);
+  event_base_dispatch(base);
+
+  evconnlistener_free(listener);
+  event_base_free(base);
+  return 0;
+}